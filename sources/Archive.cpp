@@ -9,6 +9,9 @@ Archive::Archive()
 Archive::Archive(ArchiveReaderInterfacePtr reader): m_impl(reader)
 {}
 
+Archive::Archive(ArchiveReaderInterfacePtr reader, ArchiveWriterInterfacePtr writer): m_impl(reader), m_writer(writer)
+{}
+
 bool Archive::Valid() const
 {
 	return m_impl != nullptr;
@@ -24,22 +27,65 @@ void* Archive::OpenFile(const fs::path& filepath, std::function<void*(size_t siz
 	return m_impl->OpenFile(filepath, std::move(alloc_func));
 }
 
+AsyncResult<File> Archive::OpenFileAsync(const fs::path& filepath, AsyncEngine& engine)
+{
+	ArchiveReaderInterfacePtr reader = m_impl;
+	AsyncResult<File> result = reader->OpenFileAsync(filepath, engine);
+	result.Then([reader](Status status, const File& file)
+	{
+	});
+	return result;
+}
+
+Status Archive::GetFileSize(const fs::path& filepath, size_t& size)
+{
+	return m_impl->GetFileSize(filepath, size);
+}
+
+Status Archive::ReadFile(const fs::path& filepath, uint8_t* dst, size_t size)
+{
+	return m_impl->ReadFile(filepath, dst, size);
+}
+
 bool Archive::Exists(const fs::path& filepath, PathType type)
 {
 	return m_impl->Exists(filepath, type);
 }
 
+size_t Archive::Prefetch(const std::vector<fs::path>& paths, bool decompress)
+{
+	return m_impl->Prefetch(paths, decompress);
+}
+
 Status Archive::AddFile(const fs::path& path, File file, int compression)
 {
-	return false;// m_impl->AddFile(path, file, compression);
+	if (!m_writer)
+	{
+		return false;
+	}
+	return m_writer->AddFile(path, file, compression);
 }
 
 Status Archive::CreateDirectory(const fs::path& path)
 {
-	return false;// m_impl->CreateDirectory(path);
+	if (!m_writer)
+	{
+		return false;
+	}
+	return m_writer->CreateDirectory(path);
 }
 
 std::vector<std::string> Archive::ListDirectory(const fs::path& path)
 {
 	return m_impl->ListDirectory(path);
 }
+
+bool Archive::ForEachEntry(const std::function<void(const std::string& path)>& f)
+{
+	return m_impl->ForEachEntry(f);
+}
+
+bool Archive::operator==(const Archive& other) const
+{
+	return m_impl == other.m_impl;
+}
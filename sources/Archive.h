@@ -12,20 +12,40 @@ namespace fsal
 
 		Archive(ArchiveReaderInterfacePtr reader);
 
+		// Archive, that entries can be added to. Added entries are not visible to the reader.
+		Archive(ArchiveReaderInterfacePtr reader, ArchiveWriterInterfacePtr writer);
+
 		bool Valid() const;
 
 		File OpenFile(const fs::path& filepath);
 
 		void* OpenFile(const fs::path& filepath, std::function<void*(size_t size)> alloc_func);
 
+		// Reads and decompresses the entry without blocking. Archive is kept alive until the result is completed.
+		AsyncResult<File> OpenFileAsync(const fs::path& filepath, AsyncEngine& engine = AsyncEngine::GetDefault());
+
+		Status GetFileSize(const fs::path& filepath, size_t& size);
+
+		Status ReadFile(const fs::path& filepath, uint8_t* dst, size_t size);
+
 		bool Exists(const fs::path& filepath, PathType type = kFile | kDirectory);
 
+		// Prefetches data of the entries, see ArchiveReaderInterface::Prefetch. Returns number of entries found.
+		size_t Prefetch(const std::vector<fs::path>& paths, bool decompress = false);
+
+		// Fail if the archive was not opened with a writer
 		Status AddFile(const fs::path& path, File file, int compression);
 
 		Status CreateDirectory(const fs::path& path);
 
 		std::vector<std::string> ListDirectory(const fs::path& path);
+
+		bool ForEachEntry(const std::function<void(const std::string& path)>& f);
+
+		// Archives are equal if they share the same reader
+		bool operator==(const Archive& other) const;
 	private:
 		ArchiveReaderInterfacePtr m_impl;
+		ArchiveWriterInterfacePtr m_writer;
 	};
 }
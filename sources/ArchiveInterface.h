@@ -1,6 +1,7 @@
 #pragma once
 #include "fsal_common.h"
 #include "File.h"
+#include "AsyncIO.h"
 #include <vector>
 #include <functional>
 
@@ -9,13 +10,77 @@ namespace fsal
 	class ArchiveReaderInterface
 	{
 	public:
+		virtual ~ArchiveReaderInterface() = default;
+
 		virtual File OpenFile(const fs::path& filepath) = 0;
 
 		virtual void* OpenFile(const fs::path& filepath, std::function<void*(size_t size)> alloc_func) = 0;
 
+		// Opens the entry on the thread pool of the engine. Reader must stay alive until the result is completed,
+		// Archive::OpenFileAsync takes care of that.
+		virtual AsyncResult<File> OpenFileAsync(const fs::path& filepath, AsyncEngine& engine)
+		{
+			AsyncResult<File> result;
+			engine.GetThreadPool().Push([this, filepath, result]()
+			{
+				if (result.Cancelled())
+				{
+					result.Complete(false, File());
+					return;
+				}
+				File file = OpenFile(filepath);
+				result.Complete(file ? Status(true) : Status(false), file);
+			});
+			return result;
+		}
+
+		// Returns uncompressed size of the entry. Fails if there is no such file.
+		virtual Status GetFileSize(const fs::path& filepath, size_t& size)
+		{
+			File file = OpenFile(filepath);
+			if (!file)
+			{
+				return false;
+			}
+			size = file.GetSize();
+			return true;
+		}
+
+		// Decompresses or copies the entry directly to dst, that can hold size bytes. Fails if the entry does not fit.
+		virtual Status ReadFile(const fs::path& filepath, uint8_t* dst, size_t size)
+		{
+			File file = OpenFile(filepath);
+			if (!file || file.GetSize() > size)
+			{
+				return false;
+			}
+			file.Seek(0);
+			return file.Read(dst, file.GetSize());
+		}
+
 		virtual bool Exists(const fs::path& filepath, PathType type = kFile | kDirectory) = 0;
 
+		// Hints, that the entries will be opened soon. Readers, that know where the entries are stored, prefetch their
+		// data in the order of offsets, and, if decompress is set, may decompress them to a cache. Returns number of
+		// entries found.
+		virtual size_t Prefetch(const std::vector<fs::path>& paths, bool decompress)
+		{
+			size_t found = 0;
+			for (auto& filepath: paths)
+			{
+				found += Exists(filepath, kFile) ? 1 : 0;
+			}
+			return found;
+		}
+
 		virtual std::vector<std::string> ListDirectory(const fs::path& path) = 0;
+
+		// Calls f with normalized path of each entry, paths of directories end with slash. Returns false if entries
+		// can not be enumerated.
+		virtual bool ForEachEntry(const std::function<void(const std::string& path)>& f)
+		{
+			return false;
+		}
 	};
 
 	typedef std::shared_ptr<ArchiveReaderInterface> ArchiveReaderInterfacePtr;
@@ -23,6 +88,8 @@ namespace fsal
 	class ArchiveWriterInterface
 	{
 	public:
+		virtual ~ArchiveWriterInterface() = default;
+
 		virtual Status AddFile(const fs::path& path, File file, int compression) = 0;
 
 		virtual Status CreateDirectory(const fs::path& path) = 0;
@@ -0,0 +1,548 @@
+#include "AsyncIO.h"
+#include "FileInterface.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FSAL_IO_URING
+#endif
+#endif
+
+#ifdef FSAL_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <thread>
+#endif
+
+using namespace fsal;
+
+#ifdef FSAL_IO_URING
+namespace
+{
+	struct Request
+	{
+		// Keeps the file, and so the descriptor, open until the read is completed
+		File file;
+		int fd;
+		size_t offset;
+		uint8_t* dst;
+		size_t size;
+		size_t done;
+
+		// Read was clipped to the end of a subfile, so it completes with EOF, as ReadAt does
+		bool clipped;
+		iovec iov;
+		AsyncResult<size_t> result;
+	};
+
+	int IoUringSetup(unsigned entries, io_uring_params* params)
+	{
+		return (int)syscall(__NR_io_uring_setup, entries, params);
+	}
+
+	int IoUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+	{
+		return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+	}
+}
+
+// Submission and completion rings, that are shared with the kernel. Submissions are serialized by the mutex, and a
+// single thread reaps completions. Number of reads in flight is kept below the size of the completion ring, so it
+// never overflows. Reads, that are chained from completion callbacks, and resubmissions of short reads are queued and
+// submitted by the completion thread after each batch, as it is the only thread, that frees slots. Completion thread
+// waits with poll, so it can be woken through the eventfd without a submission.
+struct AsyncEngine::Ring
+{
+	struct Queued
+	{
+		Request* request;
+
+		// Resubmission of a read, that was submitted before and keeps its slot
+		bool holdsSlot;
+	};
+
+	~Ring()
+	{
+		if (completionThread.joinable())
+		{
+			// Completion thread exits once the reads in flight and the queued ones are completed
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			Wake();
+			completionThread.join();
+		}
+		if (sqes != nullptr)
+		{
+			munmap(sqes, sqesSize);
+		}
+		if (cqPtr != nullptr && cqPtr != sqPtr)
+		{
+			munmap(cqPtr, cqSize);
+		}
+		if (sqPtr != nullptr)
+		{
+			munmap(sqPtr, sqSize);
+		}
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		if (wakeFd >= 0)
+		{
+			close(wakeFd);
+		}
+	}
+
+	bool Setup(unsigned entries)
+	{
+		wakeFd = eventfd(0, EFD_CLOEXEC);
+		if (wakeFd < 0)
+		{
+			return false;
+		}
+
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		fd = IoUringSetup(entries, &params);
+		if (fd < 0)
+		{
+			return false;
+		}
+
+		sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (singleMmap)
+		{
+			sqSize = cqSize = std::max(sqSize, cqSize);
+		}
+
+		sqPtr = mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if (sqPtr == MAP_FAILED)
+		{
+			sqPtr = nullptr;
+			return false;
+		}
+		if (singleMmap)
+		{
+			cqPtr = sqPtr;
+		}
+		else
+		{
+			cqPtr = mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+			if (cqPtr == MAP_FAILED)
+			{
+				cqPtr = nullptr;
+				return false;
+			}
+		}
+		sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		void* sqesPtr = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if (sqesPtr == MAP_FAILED)
+		{
+			return false;
+		}
+		sqes = (io_uring_sqe*)sqesPtr;
+
+		uint8_t* sq = (uint8_t*)sqPtr;
+		sqHead = (unsigned*)(sq + params.sq_off.head);
+		sqTail = (unsigned*)(sq + params.sq_off.tail);
+		sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+		sqArray = (unsigned*)(sq + params.sq_off.array);
+
+		uint8_t* cq = (uint8_t*)cqPtr;
+		cqHead = (unsigned*)(cq + params.cq_off.head);
+		cqTail = (unsigned*)(cq + params.cq_off.tail);
+		cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+		cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+		maxInFlight = params.cq_entries;
+		completionThread = std::thread(&Ring::CompletionLoop, this);
+		return true;
+	}
+
+	// Returns false if the ring can not take the read, then the caller falls back to the thread pool
+	bool Submit(Request* request)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (failed)
+		{
+			return false;
+		}
+		if (std::this_thread::get_id() == completionThread.get_id())
+		{
+			backlog.push_back(Queued{request, false});
+			return true;
+		}
+		for (;;)
+		{
+			slotFreed.wait(lock, [this]{ return inFlight < maxInFlight || failed; });
+			if (failed)
+			{
+				return false;
+			}
+			int error = Push(request);
+			if (error == 0)
+			{
+				++inFlight;
+				return true;
+			}
+			if (error != EAGAIN && error != EBUSY)
+			{
+				return false;
+			}
+			// Kernel can not take the request until completions are reaped, and the completion thread needs the mutex
+			// for that, so it is released before the retry
+			lock.unlock();
+			std::this_thread::yield();
+			lock.lock();
+		}
+	}
+
+	// Fills the next submission entry and submits it, the mutex must be held. Entry, that the kernel did not take, is
+	// taken back, so the ring has no pending entries outside of the lock. Returns zero or the error.
+	int Push(Request* request)
+	{
+		unsigned tail = *sqTail;
+		unsigned index = tail & sqMask;
+		io_uring_sqe* sqe = &sqes[index];
+		memset(sqe, 0, sizeof(io_uring_sqe));
+		request->iov.iov_base = request->dst + request->done;
+		request->iov.iov_len = request->size - request->done;
+		sqe->opcode = IORING_OP_READV;
+		sqe->fd = request->fd;
+		sqe->off = request->offset + request->done;
+		sqe->addr = (uint64_t)(uintptr_t)&request->iov;
+		sqe->len = 1;
+		sqe->user_data = (uint64_t)(uintptr_t)request;
+		sqArray[index] = index;
+		__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+		for (;;)
+		{
+			int result = IoUringEnter(fd, 1, 0, 0);
+			int error = result < 0 ? errno : 0;
+			if (error == EINTR)
+			{
+				continue;
+			}
+			if (__atomic_load_n(sqHead, __ATOMIC_ACQUIRE) != tail)
+			{
+				return 0;
+			}
+			__atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+			return error != 0 ? error : EAGAIN;
+		}
+	}
+
+	void CompletionLoop()
+	{
+		for (;;)
+		{
+			bool retry = !SubmitBacklog();
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if ((stopping || failed) && inFlight == 0 && backlog.empty())
+				{
+					break;
+				}
+			}
+
+			if (!Wait(retry))
+			{
+				// Reads in flight still own their buffers, so the thread keeps reaping their completions, but without
+				// waiting in the kernel, and only then exits
+				Fail();
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+
+			unsigned head = *cqHead;
+			unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+			// Requests were filled under the mutex before submission. Kernel orders them before their completions, but
+			// taking the mutex makes the order visible to race detectors too.
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+			}
+			while (head != tail)
+			{
+				const io_uring_cqe& cqe = cqes[head & cqMask];
+				Request* request = (Request*)(uintptr_t)cqe.user_data;
+				int res = cqe.res;
+				++head;
+				__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+				if (res == -EINTR || res == -EAGAIN)
+				{
+					Requeue(request);
+					continue;
+				}
+				if (res > 0)
+				{
+					request->done += (size_t)res;
+					if (request->done < request->size)
+					{
+						Requeue(request);
+						continue;
+					}
+				}
+
+				Release();
+				Status status = res < 0 ? Status(false) : (request->done < request->size || request->clipped ? Status(Status::kEOF) : Status(true));
+				Complete(request, status);
+			}
+		}
+	}
+
+	// Waits for completions or for the wake-up, or only checks for them if queued reads are retried. Returns false if
+	// the ring can not be waited on.
+	bool Wait(bool retry)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (failed)
+			{
+				return false;
+			}
+		}
+		pollfd fds[2] = {{fd, POLLIN, 0}, {wakeFd, POLLIN, 0}};
+		int result = poll(fds, 2, retry ? 0 : -1);
+		if (result < 0)
+		{
+			return errno == EINTR;
+		}
+		if ((fds[1].revents & POLLIN) != 0)
+		{
+			uint64_t value;
+			(void)!read(wakeFd, &value, sizeof(value));
+		}
+		if (retry)
+		{
+			std::this_thread::yield();
+		}
+		return true;
+	}
+
+	void Wake()
+	{
+		uint64_t value = 1;
+		(void)!write(wakeFd, &value, sizeof(value));
+	}
+
+	// Submits queued requests while there are free slots. Requests, that fail to submit, are completed with failure.
+	// Returns false if the kernel can not take them now.
+	bool SubmitBacklog()
+	{
+		std::vector<Queued> rejected;
+		bool submitted = true;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			while (!backlog.empty())
+			{
+				Queued queued = backlog.front();
+				if (failed)
+				{
+					backlog.pop_front();
+					rejected.push_back(queued);
+					continue;
+				}
+				if (!queued.holdsSlot && inFlight >= maxInFlight)
+				{
+					break;
+				}
+				int error = Push(queued.request);
+				if (error == EAGAIN || error == EBUSY)
+				{
+					submitted = false;
+					break;
+				}
+				backlog.pop_front();
+				if (error != 0)
+				{
+					rejected.push_back(queued);
+				}
+				else if (!queued.holdsSlot)
+				{
+					++inFlight;
+				}
+			}
+		}
+		for (auto& queued: rejected)
+		{
+			if (queued.holdsSlot)
+			{
+				Release();
+			}
+			Complete(queued.request, false);
+		}
+		return submitted;
+	}
+
+	// Ring can not be used anymore. Further reads fall back to the thread pool, queued ones are completed with failure,
+	// see SubmitBacklog, and reads in flight are completed, once their completions are reaped.
+	void Fail()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			failed = true;
+		}
+		slotFreed.notify_all();
+	}
+
+	void Complete(Request* request, Status status)
+	{
+		AsyncResult<size_t> completed = request->result;
+		size_t done = request->done;
+		delete request;
+		completed.Complete(status, done);
+	}
+
+	void Release()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			--inFlight;
+		}
+		slotFreed.notify_one();
+	}
+
+	void Requeue(Request* request)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		backlog.push_back(Queued{request, true});
+	}
+
+	int fd = -1;
+	int wakeFd = -1;
+	void* sqPtr = nullptr;
+	void* cqPtr = nullptr;
+	size_t sqSize = 0;
+	size_t cqSize = 0;
+	size_t sqesSize = 0;
+
+	unsigned* sqHead = nullptr;
+	unsigned* sqTail = nullptr;
+	unsigned sqMask = 0;
+	unsigned* sqArray = nullptr;
+	io_uring_sqe* sqes = nullptr;
+
+	unsigned* cqHead = nullptr;
+	unsigned* cqTail = nullptr;
+	unsigned cqMask = 0;
+	io_uring_cqe* cqes = nullptr;
+
+	std::mutex mutex;
+	std::condition_variable slotFreed;
+	unsigned inFlight = 0;
+	unsigned maxInFlight = 0;
+	std::deque<Queued> backlog;
+	bool stopping = false;
+	bool failed = false;
+	std::thread completionThread;
+};
+#else
+struct AsyncEngine::Ring
+{
+};
+#endif
+
+AsyncEngine::AsyncEngine(unsigned queueDepth, ThreadPool* pool, bool useIoUring): m_pool(pool != nullptr ? pool : &ThreadPool::GetDefault())
+{
+#ifdef FSAL_IO_URING
+	if (useIoUring)
+	{
+		m_ring.reset(new Ring());
+		if (!m_ring->Setup(std::max(queueDepth, 1u)))
+		{
+			m_ring.reset();
+		}
+	}
+#endif
+}
+
+AsyncEngine::~AsyncEngine()
+{
+	// Reads, that are chained from callbacks of the ring reads, fall back to the pool once the ring is gone
+	m_ring.reset();
+
+	std::unique_lock<std::mutex> lock(m_poolMutex);
+	m_poolIdle.wait(lock, [this]{ return m_poolReads == 0; });
+}
+
+AsyncResult<size_t> AsyncEngine::Read(File file, size_t offset, uint8_t* dst, size_t size)
+{
+	AsyncResult<size_t> result;
+
+	if (file.GetDataPointer() != nullptr || size == 0)
+	{
+		size_t bytesRead = 0;
+		Status status = file.ReadAt(offset, dst, size, &bytesRead);
+		result.Complete(status, bytesRead);
+		return result;
+	}
+
+#ifdef FSAL_IO_URING
+	int fd = -1;
+	size_t base = 0;
+	size_t limit = 0;
+	if (m_ring && file.GetInterface()->GetDescriptor(fd, base, limit))
+	{
+		if (offset >= limit)
+		{
+			result.Complete(Status::kEOF, 0);
+			return result;
+		}
+		size_t available = std::min(size, limit - offset);
+		Request* request = new Request{file, fd, base + offset, dst, available, 0, available < size, iovec(), result};
+		if (m_ring->Submit(request))
+		{
+			return result;
+		}
+		delete request;
+	}
+#endif
+
+	{
+		std::lock_guard<std::mutex> lock(m_poolMutex);
+		++m_poolReads;
+	}
+	m_pool->Push([this, file, offset, dst, size, result]()
+	{
+		size_t bytesRead = 0;
+		Status status = file.ReadAt(offset, dst, size, &bytesRead);
+		result.Complete(status, bytesRead);
+
+		// Notified under the mutex, so the destructor does not destroy it meanwhile
+		std::lock_guard<std::mutex> lock(m_poolMutex);
+		--m_poolReads;
+		m_poolIdle.notify_all();
+	});
+	return result;
+}
+
+bool AsyncEngine::UsesIoUring() const
+{
+	return m_ring != nullptr;
+}
+
+ThreadPool& AsyncEngine::GetThreadPool()
+{
+	return *m_pool;
+}
+
+AsyncEngine& AsyncEngine::GetDefault()
+{
+	static AsyncEngine engine;
+	return engine;
+}
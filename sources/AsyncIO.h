@@ -0,0 +1,248 @@
+#pragma once
+#include "fsal_common.h"
+#include "File.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace fsal
+{
+	// Caller owned state of WaitAny, that is registered with every pending result for the duration of the wait
+	struct AsyncWaiter
+	{
+		std::mutex mutex;
+		std::condition_variable condition;
+		size_t index = 0;
+		bool done = false;
+
+		void Notify(size_t i)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (done)
+				{
+					return;
+				}
+				index = i;
+				done = true;
+			}
+			condition.notify_all();
+		}
+	};
+
+	// Handle of an asynchronous operation, that completes once with a status and a value. Copies share the state.
+	// Operations check for cancellation between their stages, and complete with failure once they notice it, so the
+	// handle is completed only when the operation does not use its resources anymore.
+	template<typename T>
+	class AsyncResult
+	{
+	public:
+		typedef std::function<void(Status status, const T& value)> Callback;
+
+		AsyncResult(): m_state(std::make_shared<State>())
+		{}
+
+		bool Ready() const
+		{
+			std::lock_guard<std::mutex> lock(m_state->mutex);
+			return m_state->ready;
+		}
+
+		// Blocks until the operation is completed
+		Status Wait() const
+		{
+			std::unique_lock<std::mutex> lock(m_state->mutex);
+			m_state->condition.wait(lock, [this]{ return m_state->ready; });
+			return m_state->status;
+		}
+
+		// Waits for the operation and returns its value
+		const T& Get() const
+		{
+			Wait();
+			return m_state->value;
+		}
+
+		// Callback is called on the thread, that completes the operation, or right away if it is completed already.
+		// It should not block, heavy work is better pushed to a thread pool.
+		void Then(Callback callback) const
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_state->mutex);
+				if (!m_state->ready)
+				{
+					m_state->callbacks.push_back(std::move(callback));
+					return;
+				}
+			}
+			callback(m_state->status, m_state->value);
+		}
+
+		// Requests cancellation. Returns false if the operation is completed already.
+		bool Cancel() const
+		{
+			std::lock_guard<std::mutex> lock(m_state->mutex);
+			if (m_state->ready)
+			{
+				return false;
+			}
+			m_state->cancelled = true;
+			return true;
+		}
+
+		bool Cancelled() const
+		{
+			std::lock_guard<std::mutex> lock(m_state->mutex);
+			return m_state->cancelled;
+		}
+
+		// Called once, by the side that performs the operation
+		void Complete(Status status, T value) const
+		{
+			std::vector<Callback> callbacks;
+			{
+				std::lock_guard<std::mutex> lock(m_state->mutex);
+				m_state->status = status;
+				m_state->value = std::move(value);
+				m_state->ready = true;
+				callbacks.swap(m_state->callbacks);
+
+				// Waiters are notified under the mutex, so they are not destroyed meanwhile
+				for (auto& waiter: m_state->waiters)
+				{
+					waiter.first->Notify(waiter.second);
+				}
+				m_state->waiters.clear();
+			}
+			m_state->condition.notify_all();
+			for (auto& callback: callbacks)
+			{
+				callback(m_state->status, m_state->value);
+			}
+		}
+
+	private:
+		template<typename U>
+		friend size_t WaitAny(const std::vector<AsyncResult<U>>& results);
+
+		// Returns false if the operation is completed already
+		bool AddWaiter(AsyncWaiter* waiter, size_t index) const
+		{
+			std::lock_guard<std::mutex> lock(m_state->mutex);
+			if (m_state->ready)
+			{
+				return false;
+			}
+			m_state->waiters.emplace_back(waiter, index);
+			return true;
+		}
+
+		void RemoveWaiter(AsyncWaiter* waiter) const
+		{
+			std::lock_guard<std::mutex> lock(m_state->mutex);
+			auto& waiters = m_state->waiters;
+			waiters.erase(std::remove_if(waiters.begin(), waiters.end(), [waiter](const std::pair<AsyncWaiter*, size_t>& x){ return x.first == waiter; }), waiters.end());
+		}
+
+		struct State
+		{
+			std::mutex mutex;
+			std::condition_variable condition;
+			bool ready = false;
+			bool cancelled = false;
+			Status status;
+			T value = T();
+			std::vector<Callback> callbacks;
+			std::vector<std::pair<AsyncWaiter*, size_t>> waiters;
+		};
+
+		std::shared_ptr<State> m_state;
+	};
+
+	// Waits until all of the results are completed
+	template<typename T>
+	void WaitAll(const std::vector<AsyncResult<T>>& results)
+	{
+		for (auto& result: results)
+		{
+			result.Wait();
+		}
+	}
+
+	// Waits until any of the results is completed and returns its index. Returns size of the vector if it is empty.
+	// Waiter is removed from the results before returning, so calling it in a loop does not accumulate state.
+	template<typename T>
+	size_t WaitAny(const std::vector<AsyncResult<T>>& results)
+	{
+		if (results.empty())
+		{
+			return results.size();
+		}
+
+		AsyncWaiter waiter;
+		size_t registered = 0;
+		for (; registered < results.size(); ++registered)
+		{
+			if (!results[registered].AddWaiter(&waiter, registered))
+			{
+				waiter.Notify(registered);
+				break;
+			}
+		}
+		{
+			std::unique_lock<std::mutex> lock(waiter.mutex);
+			waiter.condition.wait(lock, [&waiter]{ return waiter.done; });
+		}
+		for (size_t i = 0; i < registered; ++i)
+		{
+			results[i].RemoveWaiter(&waiter);
+		}
+		return waiter.index;
+	}
+
+	// Performs reads asynchronously. On Linux, reads of files, that have a descriptor, are submitted to io_uring and
+	// completed by a single thread, so many reads can be in flight without a thread per read. Other reads, and all
+	// reads if io_uring is not available, are done with ReadAt on the thread pool. Reads of memory files are done
+	// right away.
+	class AsyncEngine
+	{
+	public:
+		// Queue depth limits the number of reads in flight in io_uring, further reads wait for a free slot.
+		// Pool is also used by readers to decompress data, default pool is used if none is given.
+		explicit AsyncEngine(unsigned queueDepth = 256, ThreadPool* pool = nullptr, bool useIoUring = true);
+
+		// Waits for reads in flight, both in io_uring and on the pool
+		~AsyncEngine();
+
+		AsyncEngine(const AsyncEngine&) = delete;
+		AsyncEngine& operator=(const AsyncEngine&) = delete;
+
+		// Result is the number of bytes read. Destination must stay valid until the read is completed. Reads, that are
+		// submitted already, are not cancelled.
+		AsyncResult<size_t> Read(File file, size_t offset, uint8_t* dst, size_t size);
+
+		bool UsesIoUring() const;
+
+		ThreadPool& GetThreadPool();
+
+		// Engine, that is used when none is given explicitly.
+		static AsyncEngine& GetDefault();
+
+	private:
+		struct Ring;
+
+		std::unique_ptr<Ring> m_ring;
+		ThreadPool* m_pool;
+
+		// Reads pushed to the pool, that are not completed yet
+		std::mutex m_poolMutex;
+		std::condition_variable m_poolIdle;
+		size_t m_poolReads = 0;
+	};
+}
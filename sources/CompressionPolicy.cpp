@@ -0,0 +1,121 @@
+#include "CompressionPolicy.h"
+
+#include <lz4.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+using namespace fsal;
+
+static std::string ToLower(std::string str)
+{
+	std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c){ return (char)std::tolower(c); });
+	return str;
+}
+
+CompressionPolicy::CompressionPolicy(int compression, int level): m_probeSize(0), m_minSaving(0.05)
+{
+	m_default.compression = compression;
+	m_default.level = level;
+}
+
+void CompressionPolicy::SetForExtension(const std::string& extension, int compression, int level)
+{
+	Choice choice;
+	choice.compression = compression;
+	choice.level = level;
+	m_extensions[ToLower(extension)] = choice;
+}
+
+void CompressionPolicy::StoreCompressedFormats()
+{
+	const char* extensions[] = {
+		".png", ".jpg", ".jpeg", ".gif", ".webp", ".avif", ".ktx2", ".basis",
+		".ogg", ".opus", ".mp3", ".aac", ".m4a", ".flac",
+		".mp4", ".m4v", ".webm", ".mkv", ".mov", ".avi", ".bik",
+		".zip", ".gz", ".xz", ".bz2", ".7z", ".rar", ".zst", ".lz4"
+	};
+	for (const char* extension: extensions)
+	{
+		SetForExtension(extension, ZIP_COMPRESSION::NONE, 0);
+	}
+}
+
+void CompressionPolicy::SetProbeSize(size_t size)
+{
+	m_probeSize = size;
+}
+
+void CompressionPolicy::SetMinSaving(double fraction)
+{
+	m_minSaving = fraction;
+}
+
+double CompressionPolicy::GetMinSaving() const
+{
+	return m_minSaving;
+}
+
+CompressionPolicy::Choice CompressionPolicy::Choose(const fs::path& path, const File& file) const
+{
+	auto it = m_extensions.find(ToLower(path.extension().u8string()));
+	if (it != m_extensions.end())
+	{
+		return it->second;
+	}
+	if (m_default.compression != ZIP_COMPRESSION::NONE && m_probeSize != 0 && Probe(file) < m_minSaving)
+	{
+		Choice choice;
+		choice.compression = ZIP_COMPRESSION::NONE;
+		choice.level = 0;
+		return choice;
+	}
+	return m_default;
+}
+
+double CompressionPolicy::Probe(const File& file) const
+{
+	size_t size = file.GetSize();
+	size_t sampleSize = std::min(size, m_probeSize);
+	if (sampleSize == 0 || sampleSize > LZ4_MAX_INPUT_SIZE)
+	{
+		return 1.0;
+	}
+
+	// Headers of files are often more compressible than the rest, so half of the sample is taken from the middle
+	size_t head = sampleSize / 2;
+	size_t middle = sampleSize - head;
+	size_t middleOffset = std::max(head, size / 2 - std::min(size / 2, middle / 2));
+
+	std::unique_ptr<uint8_t[]> sample(new uint8_t[sampleSize]);
+	const uint8_t* data = file.GetDataPointer();
+	if (data != nullptr)
+	{
+		memcpy(sample.get(), data, head);
+		memcpy(sample.get() + head, data + middleOffset, middle);
+	}
+	else
+	{
+		size_t bytesRead = 0;
+		file.Seek(0);
+		file.Read(sample.get(), head, &bytesRead);
+		size_t total = bytesRead;
+		file.Seek(middleOffset);
+		file.Read(sample.get() + head, middle, &bytesRead);
+		total += bytesRead;
+		if (total != sampleSize)
+		{
+			return 1.0;
+		}
+	}
+
+	std::vector<char> compressed(LZ4_compressBound((int)sampleSize));
+	int compressedSize = LZ4_compress_default((const char*)sample.get(), compressed.data(), (int)sampleSize, (int)compressed.size());
+	if (compressedSize <= 0)
+	{
+		return 0.0;
+	}
+	return 1.0 - (double)compressedSize / sampleSize;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "fsal_common.h"
+#include "File.h"
+#include "ZipArchive.h"
+
+#include <map>
+#include <string>
+
+namespace fsal
+{
+	// Chooses compression method and level for entries, that are added to ZipWriter with ZIP_COMPRESSION::AUTO.
+	// Method is looked up by extension first. Otherwise, if probe is enabled, a sample of the entry is compressed with
+	// fast LZ4, and the entry is stored if the sample does not compress well. Entries, that turn out to be compressed
+	// by less than the minimal saving, are stored as well.
+	class CompressionPolicy
+	{
+	public:
+		struct Choice
+		{
+			int compression;
+
+			// Negative value means the level, that is set in the writer for the method
+			int level;
+		};
+
+		explicit CompressionPolicy(int compression = ZIP_COMPRESSION::DEFLATE, int level = -1);
+
+		virtual ~CompressionPolicy() = default;
+
+		// Extension includes the dot, for example ".png". Case is ignored.
+		void SetForExtension(const std::string& extension, int compression, int level = -1);
+
+		// Stores files of common formats, that are compressed already: images, audio, video and archives.
+		void StoreCompressedFormats();
+
+		// Size of the sample for the probe. Zero disables the probe (default).
+		void SetProbeSize(size_t size);
+
+		// Fraction of the size, that compression has to save, for the entry not to be stored. Default is 0.05.
+		void SetMinSaving(double fraction);
+
+		double GetMinSaving() const;
+
+		virtual Choice Choose(const fs::path& path, const File& file) const;
+
+	private:
+		// Returns fraction of the sample size, that fast compression saves.
+		double Probe(const File& file) const;
+
+		Choice m_default;
+		std::map<std::string, Choice> m_extensions;
+		size_t m_probeSize;
+		double m_minSaving;
+	};
+}
@@ -0,0 +1,238 @@
+#include "Crc32.h"
+
+#include <zlib.h>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define FSAL_CRC32_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define FSAL_CRC32_ARM
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#undef CreateDirectory
+#endif
+#endif
+
+using namespace fsal;
+
+namespace
+{
+	uint32_t Crc32Zlib(uint32_t crc, const uint8_t* data, size_t size)
+	{
+		return (uint32_t)crc32_z(crc, data, size);
+	}
+
+#ifdef FSAL_CRC32_X86
+#ifdef _MSC_VER
+#define FSAL_TARGET_PCLMUL
+#else
+#define FSAL_TARGET_PCLMUL __attribute__((target("pclmul,sse4.1")))
+#endif
+
+	bool HasPclmul()
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 1);
+		unsigned ecx = (unsigned)info[2];
+#else
+		unsigned eax, ebx, ecx, edx;
+		if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		{
+			return false;
+		}
+#endif
+		// PCLMULQDQ and SSE4.1
+		return (ecx & (1u << 1)) && (ecx & (1u << 19));
+	}
+
+	// Folds 64 byte blocks with carry-less multiplication, then reduces the result with Barrett reduction.
+	// See "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction", Intel, 2009.
+	// Takes and returns inverted crc. Size must be at least 64 and a multiple of 16.
+	FSAL_TARGET_PCLMUL uint32_t Crc32FoldPclmul(uint32_t crc, const uint8_t* data, size_t size)
+	{
+		alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+		alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+		alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+		alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+
+		__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+		x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+		x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+		x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+		x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+
+		x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+		x0 = _mm_load_si128((const __m128i*)k1k2);
+
+		data += 64;
+		size -= 64;
+
+		while (size >= 64)
+		{
+			x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+			x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+			x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+			x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+			x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+			x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+			y5 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+			y6 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+			y7 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+			y8 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+
+			x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+			x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+			x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+			x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+			data += 64;
+			size -= 64;
+		}
+
+		// Folding four 128 bit values into one
+		x0 = _mm_load_si128((const __m128i*)k3k4);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+		while (size >= 16)
+		{
+			x2 = _mm_loadu_si128((const __m128i*)data);
+
+			x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+			x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+			data += 16;
+			size -= 16;
+		}
+
+		// Folding 128 bits to 64
+		x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+		x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+		x1 = _mm_srli_si128(x1, 8);
+		x1 = _mm_xor_si128(x1, x2);
+
+		x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+
+		x2 = _mm_srli_si128(x1, 4);
+		x1 = _mm_and_si128(x1, x3);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_xor_si128(x1, x2);
+
+		// Barrett reduction to 32 bits
+		x0 = _mm_load_si128((const __m128i*)poly);
+
+		x2 = _mm_and_si128(x1, x3);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+		x2 = _mm_and_si128(x2, x3);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x1 = _mm_xor_si128(x1, x2);
+
+		return (uint32_t)_mm_extract_epi32(x1, 1);
+	}
+
+	uint32_t Crc32Pclmul(uint32_t crc, const uint8_t* data, size_t size)
+	{
+		if (size >= 64)
+		{
+			size_t folded = size & ~(size_t)15;
+			crc = ~Crc32FoldPclmul(~crc, data, folded);
+			data += folded;
+			size -= folded;
+		}
+		return Crc32Zlib(crc, data, size);
+	}
+#endif
+
+#ifdef FSAL_CRC32_ARM
+#if defined(__GNUC__) && !defined(__ARM_FEATURE_CRC32)
+#define FSAL_TARGET_CRC __attribute__((target("+crc")))
+#else
+#define FSAL_TARGET_CRC
+#endif
+
+	bool HasArmCrc()
+	{
+#if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__)
+		return true;
+#elif defined(__linux__)
+		return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#elif defined(_WIN32)
+		return IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE) != 0;
+#else
+		return false;
+#endif
+	}
+
+	FSAL_TARGET_CRC uint32_t Crc32Arm(uint32_t crc, const uint8_t* data, size_t size)
+	{
+		crc = ~crc;
+		while (size >= 8)
+		{
+			uint64_t value;
+			memcpy(&value, data, sizeof(value));
+			crc = __crc32d(crc, value);
+			data += 8;
+			size -= 8;
+		}
+		while (size > 0)
+		{
+			crc = __crc32b(crc, *data);
+			++data;
+			--size;
+		}
+		return ~crc;
+	}
+#endif
+
+	typedef uint32_t (*Crc32Func)(uint32_t crc, const uint8_t* data, size_t size);
+
+	Crc32Func SelectCrc32()
+	{
+#if defined(FSAL_CRC32_X86)
+		if (HasPclmul())
+		{
+			return Crc32Pclmul;
+		}
+#elif defined(FSAL_CRC32_ARM)
+		if (HasArmCrc())
+		{
+			return Crc32Arm;
+		}
+#endif
+		return Crc32Zlib;
+	}
+}
+
+uint32_t fsal::Crc32(uint32_t crc, const uint8_t* data, size_t size)
+{
+	static const Crc32Func func = SelectCrc32();
+	return func(crc, data, size);
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include "fsal_common.h"
+
+namespace fsal
+{
+	// CRC-32 (ISO-HDLC, as used by ZIP and zlib). Continues from the given crc, pass zero for the first call.
+	// Uses PCLMULQDQ folding on x86 and CRC32 instructions on ARMv8, if they are supported by CPU, and zlib otherwise.
+	uint32_t Crc32(uint32_t crc, const uint8_t* data, size_t size);
+}
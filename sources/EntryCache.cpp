@@ -0,0 +1,77 @@
+#include "EntryCache.h"
+
+using namespace fsal;
+
+EntryCache::EntryCache(size_t budget): m_budget(budget), m_size(0)
+{
+}
+
+std::shared_ptr<uint8_t> EntryCache::Get(int64_t key, size_t& size)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_index.find(key);
+	if (it == m_index.end())
+	{
+		return nullptr;
+	}
+	m_items.splice(m_items.begin(), m_items, it->second);
+	size = it->second->size;
+	return it->second->buffer;
+}
+
+void EntryCache::Put(int64_t key, std::shared_ptr<uint8_t> buffer, size_t size)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (size > m_budget)
+	{
+		return;
+	}
+	auto it = m_index.find(key);
+	if (it != m_index.end())
+	{
+		// Concurrent opens of the same entry may race to put it
+		m_size -= it->second->size;
+		m_items.erase(it->second);
+		m_index.erase(it);
+	}
+	TrimLocked(m_budget - size);
+	m_items.push_front(Item{key, std::move(buffer), size});
+	m_index[key] = m_items.begin();
+	m_size += size;
+}
+
+void EntryCache::Trim(size_t size)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	TrimLocked(size);
+}
+
+void EntryCache::TrimLocked(size_t size)
+{
+	while (m_size > size)
+	{
+		Item& item = m_items.back();
+		m_size -= item.size;
+		m_index.erase(item.key);
+		m_items.pop_back();
+	}
+}
+
+void EntryCache::SetBudget(size_t budget)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_budget = budget;
+	TrimLocked(budget);
+}
+
+size_t EntryCache::GetBudget() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_budget;
+}
+
+size_t EntryCache::GetSize() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_size;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "fsal_common.h"
+
+#include <memory>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+
+namespace fsal
+{
+	// Cache of decompressed archive entries, limited by the total size of the cached data. When the limit is exceeded,
+	// least recently used entries are evicted. Buffers are shared, so an evicted entry stays valid while it is in use.
+	class EntryCache
+	{
+	public:
+		explicit EntryCache(size_t budget = 0);
+
+		// Returns cached buffer and sets its size, or returns nullptr.
+		std::shared_ptr<uint8_t> Get(int64_t key, size_t& size);
+
+		// Entries larger than the budget are not cached.
+		void Put(int64_t key, std::shared_ptr<uint8_t> buffer, size_t size);
+
+		// Evicts least recently used entries until the total size is not greater than the given one.
+		void Trim(size_t size = 0);
+
+		void SetBudget(size_t budget);
+
+		size_t GetBudget() const;
+
+		// Total size of cached entries.
+		size_t GetSize() const;
+
+	private:
+		struct Item
+		{
+			int64_t key;
+			std::shared_ptr<uint8_t> buffer;
+			size_t size;
+		};
+
+		void TrimLocked(size_t size);
+
+		// Most recently used first
+		std::list<Item> m_items;
+		std::unordered_map<int64_t, std::list<Item>::iterator> m_index;
+		size_t m_budget;
+		size_t m_size;
+		mutable std::mutex m_mutex;
+	};
+}
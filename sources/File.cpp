@@ -1,6 +1,15 @@
 #include "fsal.h"
 #include "FileInterface.h"
 #include "LockableFiles.h"
+#include "AsyncIO.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <limits>
 
 using namespace fsal;
 
@@ -41,6 +50,59 @@ Status File::Read(uint8_t* destanation, size_t size, size_t* readBytes) const
 	return m_file->ReadData(destanation, size, readBytes);
 }
 
+Status File::ReadAt(size_t offset, uint8_t* destanation, size_t size, size_t* readBytes) const
+{
+	return m_file->ReadDataAt(offset, destanation, size, readBytes);
+}
+
+Status File::ReadRanges(ReadRange* ranges, size_t count) const
+{
+	return m_file->ReadDataRanges(ranges, count);
+}
+
+AsyncResult<size_t> File::ReadAsync(size_t offset, uint8_t* destanation, size_t size) const
+{
+	return AsyncEngine::GetDefault().Read(*this, offset, destanation, size);
+}
+
+void File::Prefetch(size_t offset, size_t size) const
+{
+#ifndef _WIN32
+	const uint8_t* mapped = m_file->GetDataPointer();
+	if (mapped != nullptr)
+	{
+		size_t fileSize = m_file->GetSize();
+		if (offset >= fileSize)
+		{
+			return;
+		}
+		size = std::min(size, fileSize - offset);
+
+		// Address has to be aligned to the page
+		size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+		size_t shift = (uintptr_t)(mapped + offset) % pageSize;
+		madvise((void*)(mapped + offset - shift), size + shift, MADV_WILLNEED);
+		return;
+	}
+
+#ifdef POSIX_FADV_WILLNEED
+	int fd = -1;
+	size_t base = 0;
+	size_t limit = 0;
+	if (m_file->GetDescriptor(fd, base, limit) && offset < limit)
+	{
+		// Zero length advises up to the end of the file, which is used when the range is not bounded
+		size_t length = std::min(size, limit - offset);
+		if (length > (size_t)std::numeric_limits<off_t>::max() - (base + offset))
+		{
+			length = 0;
+		}
+		posix_fadvise(fd, (off_t)(base + offset), (off_t)length, POSIX_FADV_WILLNEED);
+	}
+#endif
+#endif
+}
+
 Status File::Write(const uint8_t* source, size_t size)
 {
 	return m_file->WriteData(source, size);
@@ -95,6 +157,11 @@ uint8_t* File::GetDataPointer()
 	return m_file->GetDataPointer();
 }
 
-File::LockGuard::LockGuard(const FileInterface* file): guard(*file->GetMutex())
+File::LockGuard::LockGuard(const FileInterface* file)
 {
+	std::mutex* mutex = file->GetMutex();
+	if (mutex != nullptr)
+	{
+		guard = std::unique_lock<std::mutex>(*mutex);
+	}
 }
@@ -12,6 +12,8 @@ namespace fsal
 {
 	class FileInterface;
 	class File;
+	struct ReadRange;
+	template<typename T> class AsyncResult;
 
 	class File
 	{
@@ -21,7 +23,8 @@ namespace fsal
 		public:
 			explicit LockGuard(const FileInterface* file);
 		private:
-			std::lock_guard<std::mutex> guard;
+			// Files that are not lockable (e.g. memory mapped) do not need guarding, so lock is optional.
+			std::unique_lock<std::mutex> guard;
 		};
 
 		enum Origin
@@ -47,6 +50,20 @@ namespace fsal
 
 		Status Read(uint8_t* destanation, size_t size, size_t* readBytes = nullptr) const;
 
+		// Reads at the offset and leaves the position unchanged. Safe to call concurrently on the same file.
+		Status ReadAt(size_t offset, uint8_t* destanation, size_t size, size_t* readBytes = nullptr) const;
+
+		// Reads several ranges at once. Adjacent ranges of disk files are read with a single system call.
+		Status ReadRanges(ReadRange* ranges, size_t count) const;
+
+		// Reads on the default AsyncEngine. Result is the number of bytes read. Destination must stay valid until the
+		// read is completed.
+		AsyncResult<size_t> ReadAsync(size_t offset, uint8_t* destanation, size_t size) const;
+
+		// Hints, that the range will be read soon, so the system starts reading it in the background. Disk files are
+		// advised with posix_fadvise and mapped files with madvise, other files ignore the hint.
+		void Prefetch(size_t offset = 0, size_t size = SIZE_MAX) const;
+
 		Status Write(const uint8_t* source, size_t size);
 
 		Status Seek(ptrdiff_t offset, Origin origin = Beginning) const;
@@ -2,8 +2,20 @@
 #include "fsal_common.h"
 #include "Status.h"
 
+#include <mutex>
+
 namespace fsal
 {
+	struct ReadRange
+	{
+		size_t offset;
+		uint8_t* dst;
+		size_t size;
+
+		// Set by the read, may be less than size at the end of file
+		size_t bytesRead;
+	};
+
 	class FileInterface
 	{
 	public:
@@ -18,6 +30,43 @@ namespace fsal
 
 		virtual Status ReadData(uint8_t* dst, size_t size, size_t* bytesRead) = 0;
 
+		// Reads at the given offset without using the position of the file, so it can be called from several threads.
+		// Files, that can not read at an offset, seek and read under their mutex, which moves the position.
+		virtual Status ReadDataAt(size_t offset, uint8_t* dst, size_t size, size_t* bytesRead)
+		{
+			std::unique_lock<std::mutex> guard;
+			if (GetMutex() != nullptr)
+			{
+				guard = std::unique_lock<std::mutex>(*GetMutex());
+			}
+			if (!SetPosition(offset))
+			{
+				return false;
+			}
+			return ReadData(dst, size, bytesRead);
+		}
+
+		// True if ReadDataAt does not use the position of the file, so concurrent reads do not need the mutex
+		virtual bool ReadsAtOffset() const { return false; };
+
+		// Reads several ranges, which may come in any order. Result is failed if any of the reads failed, and EOF if any
+		// of the ranges was read partially.
+		virtual Status ReadDataRanges(ReadRange* ranges, size_t count)
+		{
+			Status status = true;
+			for (size_t i = 0; i < count; ++i)
+			{
+				ranges[i].bytesRead = 0;
+				Status result = ReadDataAt(ranges[i].offset, ranges[i].dst, ranges[i].size, &ranges[i].bytesRead);
+				status.state |= result.state;
+				if (ranges[i].bytesRead != ranges[i].size)
+				{
+					status.state |= Status::kEOF;
+				}
+			}
+			return status;
+		}
+
 		virtual Status WriteData(const uint8_t* src, size_t size) = 0;
 				
 		virtual Status SetPosition(size_t position) const = 0;
@@ -31,6 +80,10 @@ namespace fsal
 		virtual uint64_t GetLastWriteTime() const = 0;
 
 		virtual std::mutex* GetMutex() const { return nullptr; };
+
+		// Descriptor, that reads of the file can be submitted to directly. Offset of the file data in the descriptor is
+		// written to base, and number of bytes available from base to limit. Files without one return false.
+		virtual bool GetDescriptor(int& fd, size_t& base, size_t& limit) const { return false; };
 		
 		virtual const uint8_t* GetDataPointer() const = 0;
 
@@ -1,10 +1,14 @@
 #pragma once
 #include "fsal_common.h"
 #include "FastPathNormalization.h"
+#include "File.h"
 #include <vector>
 #include <string>
 #include <algorithm>
 #include <mutex>
+#include <memory>
+#include <cstring>
+#include <type_traits>
 
 namespace fsal
 {
@@ -55,6 +59,43 @@ namespace fsal
 		return *(unsigned char *)l - *(unsigned char *)r;
 	}
 
+	// Identifies the archive, that an index of FileList was built for
+	struct FileListKey
+	{
+		uint64_t size;
+		uint64_t lastWriteTime;
+		uint64_t hash;
+	};
+
+	// Layout of the index file, see FileList::SaveIndex. Sections follow the header, each one is aligned to 8 bytes:
+	// depth table (int32_t), entries (FileListIndexEntry), paths (null terminated). Byte order is native.
+	struct FileListIndexHeader
+	{
+		enum
+		{
+			kMagic = 0x494c5346, // "FSLI"
+			kVersion = 1
+		};
+
+		uint32_t magic;
+		uint32_t version;
+		FileListKey key;
+		uint32_t dataSize;
+		uint32_t depthTableSize;
+		uint64_t entryCount;
+		uint64_t pathsSize;
+	};
+
+	template<typename UserData>
+	struct FileListIndexEntry
+	{
+		uint64_t pathOffset;
+		uint32_t pathSize;
+		int32_t filenamePos;
+		int32_t depth;
+		UserData data;
+	};
+
 	template<typename UserData>
 	class FileList
 	{
@@ -66,7 +107,7 @@ namespace fsal
 			int index = GetIndex(key).first;
 			if (index != -1)
 			{
-				return m_fileList[index].data;
+				return GetData(index);
 			}
 			return UserData();
 		}
@@ -78,13 +119,14 @@ namespace fsal
 				std::lock_guard<std::mutex> lock(m_table_modification);
 				std::sort(m_fileList.begin(), m_fileList.end());
 				int depth = 0;
-				depthTable.push_back(0);
+				depthTable.assign(1, 0);
 				for (int i = 0, l = (int)m_fileList.size(); i != l; ++i)
 				{
 					if (depth != m_fileList[i].depth)
 					{
 						int newDepth = m_fileList[i].depth;
-						depthTable.resize(newDepth + 1, depthTable[depth]);
+						// Depths without entries get empty ranges
+						depthTable.resize(newDepth + 1, i);
 						depthTable[newDepth] = i;
 						depth = newDepth;
 					}
@@ -98,6 +140,11 @@ namespace fsal
 				return std::make_pair(-1, -1);
 			}
 
+			if (m_indexEntries != nullptr)
+			{
+				return GetIndexInTable(key, getLowerBound);
+			}
+
 			size_t right = depthTable[key.depth + 1];
 			size_t left = depthTable[key.depth];
 			size_t it = 0;
@@ -105,7 +152,7 @@ namespace fsal
 			// Searching for lower bound
 			size_t count = right - left;
 			if (count == 0)
-				return std::make_pair(left, right);
+				return getLowerBound ? std::make_pair((int)left, (int)right) : std::make_pair(-1, -1);
 
 			const char* key_cstr = key.path.c_str();
 			int start_compare_from = 0;
@@ -150,6 +197,59 @@ namespace fsal
 			return std::make_pair(-1, -1);
 		}
 
+		// Same search as above, over the entries of the loaded index
+		std::pair<int, int> GetIndexInTable(const FileEntry<UserData>& key, bool getLowerBound)
+		{
+			size_t right = depthTable[key.depth + 1];
+			size_t left = depthTable[key.depth];
+
+			size_t count = right - left;
+			if (count == 0)
+				return getLowerBound ? std::make_pair((int)left, (int)right) : std::make_pair(-1, -1);
+
+			const char* key_cstr = key.path.c_str();
+			int start_compare_from = 0;
+			int start_compare_from_l = 0;
+			int start_compare_from_r = 0;
+
+			const FileListIndexEntry<UserData>* __restrict entries = m_indexEntries;
+			const char* __restrict paths = m_indexPaths;
+			const char* end = key_cstr;
+
+			while (count > 0)
+			{
+				size_t it = left;
+				size_t step = count / 2;
+				it += step;
+
+				int res = strcmpl(paths + entries[it].pathOffset + start_compare_from, key_cstr + start_compare_from, end);
+				if (res == 0)
+				{
+					return std::make_pair(it, it);
+				}
+
+				if (res < 0)
+				{
+					left = ++it;
+					count -= step + 1;
+					start_compare_from_l = end - key_cstr;
+				}
+				else
+				{
+					count = step;
+					start_compare_from_r = end - key_cstr;
+				}
+				start_compare_from = std::min(start_compare_from_l, start_compare_from_r);
+			}
+
+			if (getLowerBound)
+			{
+				return std::make_pair(left, right);
+			}
+
+			return std::make_pair(-1, -1);
+		}
+
 		bool Exists(const FileEntry<UserData>& key)
 		{
 			auto index = GetIndex(key).first;
@@ -158,6 +258,7 @@ namespace fsal
 
 		void Add(const UserData& data, const std::string& path)
 		{
+			UnloadIndex();
 			FileEntry<UserData> entry(path, data);
 			m_fileList.push_back(entry);
 			sorted = false;
@@ -176,22 +277,254 @@ namespace fsal
 			size_t key_size = u8path.size();
 
 			// Starting from the obtained low bound, we are going to grab all paths that start with given path.
-			while(index != -1 && index < lastIndex && m_fileList[index].path.compare(0, key_size, u8path) == 0)
+			while(index != -1 && index < lastIndex && strncmp(GetPath(index), u8path.c_str(), key_size) == 0)
 			{
-				const FileEntry<UserData>& entry = m_fileList[index];
-				std::string filename(entry.path.begin() + entry.filenamePos, entry.path.end());
-				result.push_back(filename);
+				result.push_back(GetPath(index) + GetFilenamePos(index));
 				++index;
 			}
 
 			return result;
 		}
 
+		// Calls f(path, data) for each entry
+		template<typename F>
+		void ForEach(F f) const
+		{
+			if (m_indexEntries != nullptr)
+			{
+				std::string path;
+				for (uint64_t i = 0; i < m_indexEntryCount; ++i)
+				{
+					path.assign(m_indexPaths + m_indexEntries[i].pathOffset, m_indexEntries[i].pathSize);
+					f(path, m_indexEntries[i].data);
+				}
+				return;
+			}
+			for (const auto& entry: m_fileList)
+			{
+				f(entry.path, entry.data);
+			}
+		}
+
+		size_t GetSize() const
+		{
+			return m_indexEntries != nullptr ? (size_t)m_indexEntryCount : m_fileList.size();
+		}
+
+		// Writes sorted table of entries, that LoadIndex can use in place, without parsing, normalizing and sorting.
+		Status SaveIndex(File file, const FileListKey& key)
+		{
+			static_assert(std::is_trivially_copyable<UserData>::value, "Entries of index are copied as bytes");
+
+			FileEntry<UserData> root("");
+			GetIndex(root);
+
+			size_t count = GetSize();
+			std::vector<FileListIndexEntry<UserData> > entries(count);
+			std::string paths;
+			for (size_t i = 0; i < count; ++i)
+			{
+				FileListIndexEntry<UserData>& entry = entries[i];
+				memset((void*)&entry, 0, sizeof(entry));
+				entry.pathOffset = paths.size();
+				entry.pathSize = (uint32_t)strlen(GetPath(i));
+				entry.filenamePos = GetFilenamePos(i);
+				entry.depth = GetDepth(i);
+				entry.data = GetData(i);
+				paths.append(GetPath(i), entry.pathSize + 1);
+			}
+
+			FileListIndexHeader header;
+			memset(&header, 0, sizeof(header));
+			header.magic = FileListIndexHeader::kMagic;
+			header.version = FileListIndexHeader::kVersion;
+			header.key = key;
+			header.dataSize = sizeof(UserData);
+			header.depthTableSize = (uint32_t)depthTable.size();
+			header.entryCount = count;
+			header.pathsSize = paths.size();
+
+			std::vector<int32_t> depths(depthTable.begin(), depthTable.end());
+			const uint8_t zeros[8] = {0};
+
+			bool result = file.Seek(0);
+			result = result && file.Write((const uint8_t*)&header, sizeof(header));
+			result = result && file.Write(zeros, Padding(sizeof(header)));
+			result = result && file.Write((const uint8_t*)depths.data(), depths.size() * sizeof(int32_t));
+			result = result && file.Write(zeros, Padding(depths.size() * sizeof(int32_t)));
+			result = result && file.Write((const uint8_t*)entries.data(), entries.size() * sizeof(entries[0]));
+			result = result && file.Write(zeros, Padding(entries.size() * sizeof(entries[0])));
+			result = result && file.Write((const uint8_t*)paths.data(), paths.size());
+			return result;
+		}
+
+		// Uses the table written by SaveIndex, if it was written for the same key. Table of a mapped file is used in
+		// place, so its pages are shared by processes, that mount the same archive. Otherwise it is read to memory.
+		Status LoadIndex(File file, const FileListKey& key)
+		{
+			return LoadIndex(std::move(file), key, [](const UserData&, uint64_t){ return true; });
+		}
+
+		// Same as above, table is rejected if isValid(data, entryCount) returns false for the data of any entry
+		template<typename F>
+		Status LoadIndex(File file, const FileListKey& key, F isValid)
+		{
+			if (!file)
+			{
+				return false;
+			}
+
+			size_t size = file.GetSize();
+			std::shared_ptr<const uint8_t> data(file.GetInterface(), file.GetDataPointer());
+			if (!data)
+			{
+				std::shared_ptr<uint8_t> buffer(new uint8_t[size], std::default_delete<uint8_t[]>());
+				size_t bytesRead = 0;
+				file.Seek(0);
+				file.Read(buffer.get(), size, &bytesRead);
+				if (bytesRead != size)
+				{
+					return false;
+				}
+				data = buffer;
+			}
+
+			FileListIndexHeader header;
+			if (size < sizeof(header))
+			{
+				return false;
+			}
+			memcpy(&header, data.get(), sizeof(header));
+			if (header.magic != FileListIndexHeader::kMagic || header.version != FileListIndexHeader::kVersion
+				|| header.dataSize != sizeof(UserData) || header.key.size != key.size
+				|| header.key.lastWriteTime != key.lastWriteTime || header.key.hash != key.hash
+				|| header.depthTableSize < 2 || header.entryCount > size || header.pathsSize > size)
+			{
+				return false;
+			}
+
+			size_t depthsOffset = sizeof(header) + Padding(sizeof(header));
+			size_t depthsSize = header.depthTableSize * sizeof(int32_t);
+			size_t entriesOffset = depthsOffset + depthsSize + Padding(depthsSize);
+			size_t entriesSize = (size_t)header.entryCount * sizeof(FileListIndexEntry<UserData>);
+			size_t pathsOffset = entriesOffset + entriesSize + Padding(entriesSize);
+			if (pathsOffset + header.pathsSize != size || (uintptr_t)data.get() % 8 != 0)
+			{
+				return false;
+			}
+
+			std::vector<int> depths(header.depthTableSize);
+			const int32_t* storedDepths = (const int32_t*)(data.get() + depthsOffset);
+			for (size_t i = 0; i < depths.size(); ++i)
+			{
+				if (storedDepths[i] < 0 || (uint64_t)storedDepths[i] > header.entryCount || (i > 0 && storedDepths[i] < depths[i - 1]))
+				{
+					return false;
+				}
+				depths[i] = storedDepths[i];
+			}
+			if (depths[0] != 0 || (uint64_t)depths.back() != header.entryCount)
+			{
+				return false;
+			}
+
+			// Paths must be within the table and terminated, so they can be compared in place. Entries must be in the
+			// order of the sort, within the range of their depth, as lookups search them with binary search.
+			auto* entries = (const FileListIndexEntry<UserData>*)(data.get() + entriesOffset);
+			const char* paths = (const char*)(data.get() + pathsOffset);
+			size_t depth = 0;
+			for (uint64_t i = 0; i < header.entryCount; ++i)
+			{
+				const FileListIndexEntry<UserData>& entry = entries[i];
+				if (entry.pathOffset >= header.pathsSize || entry.pathSize >= header.pathsSize - entry.pathOffset
+					|| memchr(paths + entry.pathOffset, 0, entry.pathSize + 1) != paths + entry.pathOffset + entry.pathSize
+					|| entry.filenamePos < 0 || (uint32_t)entry.filenamePos > entry.pathSize)
+				{
+					return false;
+				}
+				while ((uint64_t)depths[depth + 1] <= i)
+				{
+					++depth;
+				}
+				if (entry.depth != (int32_t)depth || !isValid(entry.data, header.entryCount))
+				{
+					return false;
+				}
+				if (i > (uint64_t)depths[depth] && strcmp(paths + entries[i - 1].pathOffset, paths + entry.pathOffset) >= 0)
+				{
+					return false;
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(m_table_modification);
+			m_fileList.clear();
+			depthTable = std::move(depths);
+			m_index = std::move(data);
+			m_indexEntries = entries;
+			m_indexPaths = paths;
+			m_indexEntryCount = header.entryCount;
+			sorted = true;
+			return true;
+		}
+
 		std::mutex m_table_modification;
 
 	private:
+		static size_t Padding(size_t size)
+		{
+			return (8 - size % 8) % 8;
+		}
+
+		const char* GetPath(size_t i) const
+		{
+			return m_indexEntries != nullptr ? m_indexPaths + m_indexEntries[i].pathOffset : m_fileList[i].path.c_str();
+		}
+
+		int GetFilenamePos(size_t i) const
+		{
+			return m_indexEntries != nullptr ? m_indexEntries[i].filenamePos : m_fileList[i].filenamePos;
+		}
+
+		int GetDepth(size_t i) const
+		{
+			return m_indexEntries != nullptr ? m_indexEntries[i].depth : m_fileList[i].depth;
+		}
+
+		const UserData& GetData(size_t i) const
+		{
+			return m_indexEntries != nullptr ? m_indexEntries[i].data : m_fileList[i].data;
+		}
+
+		// Copies entries of the loaded index to the list, so it can be modified
+		void UnloadIndex()
+		{
+			if (m_indexEntries == nullptr)
+			{
+				return;
+			}
+			m_fileList.resize((size_t)m_indexEntryCount);
+			for (size_t i = 0; i < m_fileList.size(); ++i)
+			{
+				FileEntry<UserData>& entry = m_fileList[i];
+				entry.path.assign(GetPath(i), m_indexEntries[i].pathSize);
+				entry.filenamePos = m_indexEntries[i].filenamePos;
+				entry.depth = m_indexEntries[i].depth;
+				entry.data = m_indexEntries[i].data;
+			}
+			m_indexEntries = nullptr;
+			m_indexPaths = nullptr;
+			m_indexEntryCount = 0;
+			m_index.reset();
+		}
+
 		std::vector<int> depthTable;
 		std::vector<FileEntry<UserData> > m_fileList;
 		bool sorted = false;
+
+		// Loaded index, see LoadIndex
+		std::shared_ptr<const uint8_t> m_index;
+		const FileListIndexEntry<UserData>* m_indexEntries = nullptr;
+		const char* m_indexPaths = nullptr;
+		uint64_t m_indexEntryCount = 0;
 	};
 }
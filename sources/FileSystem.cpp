@@ -1,18 +1,67 @@
 #include "fsal.h"
 #include "StdFile.h"
+#include "MmapFile.h"
 #include "LockableFiles.h"
 #include "FastPathNormalization.h"
 #include "ZipArchive.h"
 
+#include <algorithm>
 #include <vector>
 #include <functional>
+#include <memory>
 #include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 
+namespace fsal
+{
+	struct MountedArchive
+	{
+		Archive archive;
+
+		// Increases with each mount, archives mounted earlier take precedence
+		uint64_t order;
+
+		// Normalized paths of the entries, used to hand them over on unmount. Null if the archive can not enumerate
+		// its entries, such archive is searched with Exists.
+		std::unique_ptr<const std::unordered_set<std::string>> entries;
+	};
+
+	typedef std::shared_ptr<const MountedArchive> MountedArchivePtr;
+
+	struct MountTable
+	{
+		// In the order of mounting
+		std::vector<MountedArchivePtr> archives;
+
+		// Normalized path of each entry to the first archive, that contains it
+		std::unordered_map<std::string, MountedArchivePtr> index;
+
+		// Archives, that can not enumerate their entries, in the order of mounting
+		std::vector<MountedArchivePtr> unindexed;
+	};
+
+	typedef std::vector<path> SearchPaths;
+}
+
+// Mount table and search paths are immutable snapshots. Lookups take the current snapshot with atomic load and never
+// block, while changes copy the snapshot, modify the copy and publish it with atomic store. Changes are serialized by
+// the mutexes, so none of them is lost. Snapshots, that are still used by lookups, are kept alive by the shared_ptr.
+// Mount table is rebuilt outside of the lock, and published only if no other change was published meanwhile.
 struct fsal::FsalImplementation
 {
-	std::vector<Archive> archives;
-	std::vector<path> searchPaths;
+	std::shared_ptr<const MountTable> mounts = std::make_shared<MountTable>();
+	std::mutex mountsMutex;
+	uint64_t mountOrder = 0;
+
+	std::shared_ptr<const SearchPaths> searchPaths = std::make_shared<SearchPaths>();
 	std::mutex searchPathsMutex;
+
+	// Created on the first asynchronous open. Pool is separate from the default one, so opens are not queued behind
+	// compression or other work.
+	std::unique_ptr<ThreadPool> asyncPool;
+	std::unique_ptr<AsyncEngine> asyncEngine;
+	std::once_flag asyncOnce;
 };
 
 using namespace fsal;
@@ -36,32 +85,145 @@ FileSystem::FileSystem()
 void fsal::FileSystem::PushSearchPath(const Location& location)
 {
 	std::lock_guard<std::mutex> lock(m_impl->searchPathsMutex);
-	m_impl->searchPaths.push_back(NormalizePath(location.GetFullPath()));
+	auto searchPaths = std::make_shared<SearchPaths>(*m_impl->searchPaths);
+	searchPaths->push_back(NormalizePath(location.GetFullPath()));
+	std::atomic_store(&m_impl->searchPaths, std::shared_ptr<const SearchPaths>(std::move(searchPaths)));
 }
 
 void fsal::FileSystem::PopSearchPath()
 {
 	std::lock_guard<std::mutex> lock(m_impl->searchPathsMutex);
-	if (!m_impl->searchPaths.empty())
+	if (!m_impl->searchPaths->empty())
 	{
-		m_impl->searchPaths.pop_back();
+		auto searchPaths = std::make_shared<SearchPaths>(*m_impl->searchPaths);
+		searchPaths->pop_back();
+		std::atomic_store(&m_impl->searchPaths, std::shared_ptr<const SearchPaths>(std::move(searchPaths)));
 	}
 }
 
 void fsal::FileSystem::ClearSearchPaths()
 {
 	std::lock_guard<std::mutex> lock(m_impl->searchPathsMutex);
-	m_impl->searchPaths.clear();
+	std::atomic_store(&m_impl->searchPaths, std::shared_ptr<const SearchPaths>(std::make_shared<SearchPaths>()));
 }
 
 Status fsal::FileSystem::MountArchive(const Archive& archive)
 {
-	if (archive.Valid())
+	if (!archive.Valid())
 	{
-		m_impl->archives.push_back(archive);
-		return true;
+		return false;
+	}
+
+	// Entries are enumerated before taking the lock, so other changes do not wait for it
+	auto mounted = std::make_shared<MountedArchive>();
+	mounted->archive = archive;
+	std::unique_ptr<std::unordered_set<std::string>> entries(new std::unordered_set<std::string>());
+	if (mounted->archive.ForEachEntry([&entries](const std::string& path)
+	{
+		entries->insert(path);
+	}))
+	{
+		mounted->entries = std::move(entries);
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_impl->mountsMutex);
+		mounted->order = m_impl->mountOrder++;
+	}
+
+	for (;;)
+	{
+		std::shared_ptr<const MountTable> current = std::atomic_load(&m_impl->mounts);
+		auto mounts = std::make_shared<MountTable>(*current);
+
+		// Mount order is taken before the rebuild, so a concurrent mount, that is published first, is placed before
+		auto position = std::find_if(mounts->archives.begin(), mounts->archives.end(), [&mounted](const MountedArchivePtr& x)
+		{
+			return x->order > mounted->order;
+		});
+		mounts->archives.insert(position, mounted);
+		if (mounted->entries)
+		{
+			for (auto& path: *mounted->entries)
+			{
+				// Entries of archives mounted earlier take precedence
+				auto it = mounts->index.emplace(path, mounted).first;
+				if (it->second->order > mounted->order)
+				{
+					it->second = mounted;
+				}
+			}
+		}
+		else
+		{
+			auto unindexed = std::find_if(mounts->unindexed.begin(), mounts->unindexed.end(), [&mounted](const MountedArchivePtr& x)
+			{
+				return x->order > mounted->order;
+			});
+			mounts->unindexed.insert(unindexed, mounted);
+		}
+
+		std::lock_guard<std::mutex> lock(m_impl->mountsMutex);
+		if (m_impl->mounts == current)
+		{
+			std::atomic_store(&m_impl->mounts, std::shared_ptr<const MountTable>(std::move(mounts)));
+			return true;
+		}
+	}
+}
+
+Status fsal::FileSystem::UnmountArchive(const Archive& archive)
+{
+	for (;;)
+	{
+		std::shared_ptr<const MountTable> current = std::atomic_load(&m_impl->mounts);
+		auto it = std::find_if(current->archives.begin(), current->archives.end(), [&archive](const MountedArchivePtr& mounted)
+		{
+			return mounted->archive == archive;
+		});
+		if (it == current->archives.end())
+		{
+			return false;
+		}
+		MountedArchivePtr removed = *it;
+
+		auto mounts = std::make_shared<MountTable>(*current);
+		mounts->archives.erase(mounts->archives.begin() + (it - current->archives.begin()));
+		if (removed->entries)
+		{
+			// Entries, that the archive provided, are taken over by the next archive, that has them
+			for (auto& path: *removed->entries)
+			{
+				auto entry = mounts->index.find(path);
+				if (entry == mounts->index.end() || entry->second != removed)
+				{
+					continue;
+				}
+				auto next = std::find_if(mounts->archives.begin(), mounts->archives.end(), [&removed, &path](const MountedArchivePtr& x)
+				{
+					return x->order > removed->order && x->entries && x->entries->count(path) != 0;
+				});
+				if (next != mounts->archives.end())
+				{
+					entry->second = *next;
+				}
+				else
+				{
+					mounts->index.erase(entry);
+				}
+			}
+		}
+		else
+		{
+			mounts->unindexed.erase(std::find(mounts->unindexed.begin(), mounts->unindexed.end(), removed));
+		}
+
+		std::lock_guard<std::mutex> lock(m_impl->mountsMutex);
+		if (m_impl->mounts == current)
+		{
+			std::atomic_store(&m_impl->mounts, std::shared_ptr<const MountTable>(std::move(mounts)));
+			return true;
+		}
 	}
-	return false;
 }
 
 static bool CheckAttributes(PathType type, LinkType link, const path& fullPath)
@@ -115,8 +277,8 @@ Status fsal::FileSystem::Find(const Location& location, path& absolutePath, Path
 	// Second check. Search paths
 	if (location.m_relartiveTo == Location::kCurrentDirectory || location.m_relartiveTo == Location::kSearchPaths || location.m_relartiveTo == Location::kSearchPathsAndArchives)
 	{
-		std::lock_guard<std::mutex> lock(m_impl->searchPathsMutex);
-		for (std::vector<path>::iterator it = m_impl->searchPaths.begin(), end = m_impl->searchPaths.end(); it != end; ++it)
+		std::shared_ptr<const SearchPaths> searchPaths = std::atomic_load(&m_impl->searchPaths);
+		for (SearchPaths::const_iterator it = searchPaths->begin(), end = searchPaths->end(); it != end; ++it)
 		{
 			fsal::Location absoluteLocation(location);
 			absoluteLocation.m_filepath = *it / location.m_filepath;
@@ -140,18 +302,45 @@ Status fsal::FileSystem::Find(const Location& location, path& absolutePath, Path
 	// Third check. Archives
 	if (location.m_relartiveTo == Location::kArchives || location.m_relartiveTo == Location::kSearchPathsAndArchives)
 	{
-		std::lock_guard<std::mutex> lock(m_impl->searchPathsMutex);
-		for (auto it = m_impl->archives.begin(), end = m_impl->archives.end(); it != end; ++it)
+		// Same key, that archives look up in their file lists
+		std::string key = location.m_filepath.u8string();
+		if (location.m_type == kDirectory && !key.empty() && key.back() != '/')
+		{
+			key += '/';
+		}
+		key = NormalizePath(key);
+
+		std::shared_ptr<const MountTable> mounts = std::atomic_load(&m_impl->mounts);
+		const MountedArchive* found = nullptr;
+		auto it = mounts->index.find(key);
+		if (it != mounts->index.end())
+		{
+			found = it->second.get();
+		}
+
+		// Only archives mounted before the one found can take precedence
+		for (auto& mounted: mounts->unindexed)
 		{
-			if (it->Exists(location.m_filepath, location.m_type))
+			if (found != nullptr && mounted->order > found->order)
 			{
-				type = location.m_type;
-				absolutePath = location.m_filepath;
-				archive = *it;
-				return true;
+				break;
+			}
+			// Exists is not const, so the archive is copied
+			if (Archive(mounted->archive).Exists(location.m_filepath, location.m_type))
+			{
+				found = mounted.get();
+				break;
 			}
 		}
 
+		if (found != nullptr)
+		{
+			type = location.m_type;
+			absolutePath = location.m_filepath;
+			archive = found->archive;
+			return true;
+		}
+
 		absolutePath = "";
 		archive = Archive();
 		return false;
@@ -160,7 +349,7 @@ Status fsal::FileSystem::Find(const Location& location, path& absolutePath, Path
 	return false;
 }
 
-File fsal::FileSystem::Open(const Location& location, Mode mode, bool lockable)
+File fsal::FileSystem::Open(const Location& location, Mode mode, bool lockable, bool mapped)
 {
 	PathType type;
 	path absolutePath;
@@ -200,26 +389,154 @@ File fsal::FileSystem::Open(const Location& location, Mode mode, bool lockable)
 	}
 	else
 	{
-		FileInterface* stdf = nullptr;
-		if (lockable)
+		return OpenFromDisk(absolutePath, mode, lockable, mapped);
+	}
+}
+
+File fsal::FileSystem::OpenFromDisk(const path& absolutePath, Mode mode, bool lockable, bool mapped)
+{
+	FileInterface* stdf = nullptr;
+	if (mapped && mode == kRead)
+	{
+		stdf = new MmapFile();
+	}
+	else if (lockable)
+	{
+		stdf = new LStdFile();
+	}
+	else
+	{
+		stdf = new StdFile();
+	}
+
+	stdf->Open(absolutePath, mode);
+	if (stdf->ok())
+	{
+		return File(stdf);
+	}
+	else
+	{
+		delete stdf;
+		return File();
+	}
+}
+
+AsyncResult<File> fsal::FileSystem::OpenAsync(const Location& location, bool mapped)
+{
+	AsyncEngine& engine = GetAsyncEngine();
+	AsyncResult<File> result;
+
+	// Copy of the file system keeps the implementation alive until the lookup is done
+	FileSystem fs(*this);
+	engine.GetThreadPool().Push([fs, location, mapped, result, &engine]() mutable
+	{
+		PathType type;
+		path absolutePath;
+		Archive archive;
+		if (result.Cancelled() || !fs.Find(location, absolutePath, type, archive) || type == kDirectory)
 		{
-			stdf = new LStdFile();
+			result.Complete(false, File());
+			return;
 		}
-		else
+
+		if (!archive.Valid())
 		{
-			stdf = new StdFile();
+			File file = OpenFromDisk(absolutePath, kRead, false, mapped);
+			result.Complete(file ? Status(true) : Status(false), file);
+			return;
 		}
 
-		stdf->Open(absolutePath, mode);
-		if (stdf->ok())
+		AsyncResult<File> entry = archive.OpenFileAsync(absolutePath, engine);
+		if (result.Cancelled())
 		{
-			return File(stdf);
+			entry.Cancel();
 		}
-		else
+		entry.Then([result](Status status, const File& file)
 		{
-			return File();
+			result.Complete(status, file);
+		});
+	});
+	return result;
+}
+
+AsyncResult<size_t> fsal::FileSystem::Prefetch(const std::vector<Location>& locations, bool decompress)
+{
+	AsyncEngine& engine = GetAsyncEngine();
+	AsyncResult<size_t> result;
+
+	FileSystem fs(*this);
+	engine.GetThreadPool().Push([fs, locations, decompress, result]() mutable
+	{
+		std::vector<path> files;
+		std::vector<std::pair<Archive, std::vector<path>>> archives;
+		for (auto& location: locations)
+		{
+			if (result.Cancelled())
+			{
+				result.Complete(false, 0);
+				return;
+			}
+			PathType type;
+			path absolutePath;
+			Archive archive;
+			if (!fs.Find(location, absolutePath, type, archive) || type == kDirectory)
+			{
+				continue;
+			}
+			if (!archive.Valid())
+			{
+				files.push_back(absolutePath);
+				continue;
+			}
+			auto group = std::find_if(archives.begin(), archives.end(), [&archive](const std::pair<Archive, std::vector<path>>& x)
+			{
+				return x.first == archive;
+			});
+			if (group == archives.end())
+			{
+				archives.emplace_back(archive, std::vector<path>());
+				group = archives.end() - 1;
+			}
+			group->second.push_back(absolutePath);
 		}
-	}
+
+		size_t found = 0;
+		for (auto& filepath: files)
+		{
+			File file = OpenFromDisk(filepath, kRead, false, false);
+			if (file)
+			{
+				file.Prefetch();
+				++found;
+			}
+		}
+		for (auto& group: archives)
+		{
+			if (result.Cancelled())
+			{
+				result.Complete(false, found);
+				return;
+			}
+			found += group.first.Prefetch(group.second, decompress);
+		}
+		result.Complete(true, found);
+	});
+	return result;
+}
+
+void fsal::FileSystem::SetAsyncThreadCount(size_t threadCount)
+{
+	std::call_once(m_impl->asyncOnce, [this, threadCount]()
+	{
+		m_impl->asyncPool.reset(new ThreadPool(threadCount));
+		m_impl->asyncEngine.reset(new AsyncEngine(256, m_impl->asyncPool.get()));
+	});
+}
+
+AsyncEngine& fsal::FileSystem::GetAsyncEngine()
+{
+	SetAsyncThreadCount(0);
+	return *m_impl->asyncEngine;
 }
 
 
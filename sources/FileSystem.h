@@ -4,6 +4,7 @@
 #include "Location.h"
 #include "File.h"
 #include "Archive.h"
+#include "AsyncIO.h"
 
 namespace fsal
 {
@@ -14,7 +15,24 @@ namespace fsal
 	public:
 		FileSystem();
 
-		File Open(const Location& location, Mode mode = kRead, bool lockable = false);
+		// If mapped is true and mode is kRead, the file is memory mapped. Mapped files do not need locking and
+		// provide data pointer, so archives opened from them return stored entries without copying.
+		File Open(const Location& location, Mode mode = kRead, bool lockable = false, bool mapped = false);
+
+		// Lookup, reading and decompression are done on a pool of the file system, and entries of archives are read
+		// with its AsyncEngine. Cancellation is checked after the lookup and between the stages of opening an entry.
+		AsyncResult<File> OpenAsync(const Location& location, bool mapped = false);
+
+		// Number of threads of the pool for asynchronous opens. Takes effect only before the first of them, zero means
+		// number of hardware threads (default).
+		void SetAsyncThreadCount(size_t threadCount);
+
+		AsyncEngine& GetAsyncEngine();
+
+		// Hints, that the files will be opened soon. Lookup and prefetching are done on the pool for asynchronous opens.
+		// Files on disk are prefetched whole, entries of archives are grouped by archive, which prefetches them in the
+		// order of their offsets, see ArchiveReaderInterface::Prefetch. Result is the number of files found.
+		AsyncResult<size_t> Prefetch(const std::vector<Location>& locations, bool decompress = false);
 
 		bool Exists(const Location& location);
 
@@ -30,12 +48,19 @@ namespace fsal
 
 		void ClearSearchPaths();
 
+		// Mounted archives are searched in the order they were mounted. Entries of archives, that can enumerate them,
+		// are added to a merged index, so a lookup does not depend on the number of mounted archives.
 		Status MountArchive(const Archive& archive);
 
+		Status UnmountArchive(const Archive& archive);
+
 		static path GetSystemPath(const Location::Options& options);
 
 	private:
 		Status Find(const Location& location, path& absolutePath, PathType& type, Archive& archive);
+
+		static File OpenFromDisk(const path& absolutePath, Mode mode, bool lockable, bool mapped);
+
 		std::shared_ptr<FsalImplementation> m_impl;
 	};
 }
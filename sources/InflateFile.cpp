@@ -0,0 +1,277 @@
+#include "fsal.h"
+#include "InflateFile.h"
+
+#include <algorithm>
+#include <climits>
+
+using namespace fsal;
+
+DeflateIndex::DeflateIndex(size_t span): m_span(span)
+{
+}
+
+size_t DeflateIndex::GetSpan() const
+{
+	return m_span;
+}
+
+DeflateIndex::CheckpointPtr DeflateIndex::Find(size_t position) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = std::upper_bound(m_checkpoints.begin(), m_checkpoints.end(), (uint64_t)position,
+			[](uint64_t position, const CheckpointPtr& checkpoint){ return position < checkpoint->out; });
+	if (it == m_checkpoints.begin())
+	{
+		return nullptr;
+	}
+	return *(it - 1);
+}
+
+bool DeflateIndex::NeedsCheckpoint(size_t position) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	uint64_t last = m_checkpoints.empty() ? 0 : m_checkpoints.back()->out;
+	return position >= last + m_span;
+}
+
+void DeflateIndex::Add(CheckpointPtr checkpoint)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	// Checkpoints are only appended, so index stays sorted. Concurrent readers may race to add the same one.
+	uint64_t last = m_checkpoints.empty() ? 0 : m_checkpoints.back()->out;
+	if (checkpoint->out >= last + m_span)
+	{
+		m_checkpoints.push_back(std::move(checkpoint));
+	}
+}
+
+std::vector<DeflateIndex::CheckpointPtr> DeflateIndex::GetCheckpoints() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_checkpoints;
+}
+
+InflateFile::InflateFile(File source, size_t sizeUncompressed, DeflateIndexPtr index):
+	m_source(std::move(source)), m_ok(false), m_streamEnd(false), m_input(new uint8_t[kInputBufferSize]),
+	m_index(std::move(index)), m_compressedPosition(0), m_size(sizeUncompressed), m_position(0), m_pointer(0)
+{
+	m_stream = z_stream();
+	m_stream.zalloc = (alloc_func)nullptr;
+	m_stream.zfree = (free_func)nullptr;
+	m_ok = m_source && inflateInit2(&m_stream, -MAX_WBITS) == Z_OK;
+	m_source.Seek(0);
+}
+
+InflateFile::~InflateFile()
+{
+	if (m_ok)
+	{
+		inflateEnd(&m_stream);
+	}
+}
+
+bool InflateFile::ok() const
+{
+	return m_ok;
+}
+
+path InflateFile::GetPath() const
+{
+	return m_source.GetPath();
+}
+
+bool InflateFile::Reset()
+{
+	m_stream.next_in = nullptr;
+	m_stream.avail_in = 0;
+	m_position = 0;
+	m_compressedPosition = 0;
+	m_streamEnd = false;
+	m_ok = inflateReset(&m_stream) == Z_OK;
+	m_source.Seek(0);
+	return m_ok;
+}
+
+bool InflateFile::Restore(const DeflateIndex::Checkpoint& checkpoint)
+{
+	if (!Reset())
+	{
+		return false;
+	}
+
+	if (checkpoint.bits != 0)
+	{
+		// Checkpoint is in the middle of a byte, so the remaining bits of it are fed to the decompressor
+		uint8_t byte = 0;
+		m_source.Seek(checkpoint.in - 1);
+		m_source.Read(byte);
+		m_ok = inflatePrime(&m_stream, checkpoint.bits, byte >> (8 - checkpoint.bits)) == Z_OK;
+	}
+	else
+	{
+		m_source.Seek(checkpoint.in);
+	}
+
+	m_ok = m_ok && inflateSetDictionary(&m_stream, checkpoint.window.data(), (uInt)checkpoint.window.size()) == Z_OK;
+	m_position = checkpoint.out;
+	m_compressedPosition = checkpoint.in;
+	return m_ok;
+}
+
+void InflateFile::AddCheckpoint(size_t position)
+{
+	if (!m_index->NeedsCheckpoint(position))
+	{
+		return;
+	}
+	auto* checkpoint = new DeflateIndex::Checkpoint();
+	checkpoint->out = position;
+	checkpoint->in = m_compressedPosition;
+	checkpoint->bits = m_stream.data_type & 7;
+	checkpoint->window.resize(32768);
+	uInt windowSize = 0;
+	inflateGetDictionary(&m_stream, checkpoint->window.data(), &windowSize);
+	checkpoint->window.resize(windowSize);
+	m_index->Add(DeflateIndex::CheckpointPtr(checkpoint));
+}
+
+bool InflateFile::Inflate(uint8_t* dst, size_t size)
+{
+	uint8_t skipBuffer[kSkipBufferSize];
+
+	while (size > 0)
+	{
+		size_t chunk = dst == nullptr ? std::min(size, (size_t)kSkipBufferSize) : std::min(size, (size_t)UINT_MAX);
+
+		m_stream.next_out = dst == nullptr ? skipBuffer : dst;
+		m_stream.avail_out = (uInt)chunk;
+
+		while (m_stream.avail_out > 0)
+		{
+			if (m_streamEnd)
+			{
+				// Stream is shorter than declared size of the entry
+				return false;
+			}
+			if (m_stream.avail_in == 0)
+			{
+				size_t bytesRead = 0;
+				m_source.Read(m_input.get(), kInputBufferSize, &bytesRead);
+				m_stream.next_in = m_input.get();
+				m_stream.avail_in = (uInt)bytesRead;
+			}
+
+			// With index, decompressor stops at the end of each block, so checkpoints can be placed there
+			uInt availIn = m_stream.avail_in;
+			int err = inflate(&m_stream, m_index ? Z_BLOCK : Z_NO_FLUSH);
+			m_compressedPosition += availIn - m_stream.avail_in;
+
+			if (m_index && err == Z_OK && (m_stream.data_type & 128) && !(m_stream.data_type & 64))
+			{
+				AddCheckpoint(m_position + chunk - m_stream.avail_out);
+			}
+
+			if (err == Z_STREAM_END)
+			{
+				m_streamEnd = true;
+			}
+			else if (err != Z_OK)
+			{
+				// Z_BUF_ERROR here means that there is no more input, so data is truncated
+				return false;
+			}
+		}
+
+		size_t produced = chunk - m_stream.avail_out;
+		m_position += produced;
+		size -= produced;
+		if (dst != nullptr)
+		{
+			dst += produced;
+		}
+	}
+	return true;
+}
+
+Status InflateFile::ReadData(uint8_t* dst, size_t size, size_t* bytesRead)
+{
+	if (bytesRead != nullptr)
+	{
+		*bytesRead = 0;
+	}
+	if (!m_ok)
+	{
+		return false;
+	}
+
+	Status status = true;
+	if (m_size <= m_pointer)
+	{
+		return Status::kEOF;
+	}
+	else if (m_size < m_pointer + size)
+	{
+		size = m_size - m_pointer;
+		status.state |= Status::kEOF;
+	}
+
+	if (m_pointer < m_position || (m_index && m_pointer - m_position > m_index->GetSpan()))
+	{
+		DeflateIndex::CheckpointPtr checkpoint = m_index ? m_index->Find(m_pointer) : nullptr;
+
+		if (checkpoint && (m_pointer < m_position || checkpoint->out > m_position))
+		{
+			if (!Restore(*checkpoint))
+			{
+				return false;
+			}
+		}
+		else if (m_pointer < m_position && !Reset())
+		{
+			return false;
+		}
+	}
+	if (m_pointer > m_position && !Inflate(nullptr, m_pointer - m_position))
+	{
+		m_ok = false;
+		return false;
+	}
+	if (!Inflate(dst, size))
+	{
+		m_ok = false;
+		return false;
+	}
+	m_pointer += size;
+
+	if (bytesRead != nullptr)
+	{
+		*bytesRead = size;
+	}
+	return status;
+}
+
+Status InflateFile::WriteData(const uint8_t* src, size_t size)
+{
+	return false;
+}
+
+Status InflateFile::SetPosition(size_t position) const
+{
+	m_pointer = position;
+	return true;
+}
+
+size_t InflateFile::GetPosition() const
+{
+	return m_pointer;
+}
+
+size_t InflateFile::GetSize() const
+{
+	return m_size;
+}
+
+Status InflateFile::FlushBuffer() const
+{
+	return true;
+}
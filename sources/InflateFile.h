@@ -0,0 +1,132 @@
+#pragma once
+#include "fsal_common.h"
+#include "FileInterface.h"
+#include "File.h"
+
+#include <zlib.h>
+#include <memory>
+#include <vector>
+#include <mutex>
+
+namespace fsal
+{
+	// Random access index of a raw DEFLATE stream. Holds checkpoints, that store state of the decompressor (position
+	// in the compressed stream and the last 32KiB of the output) roughly every 'span' bytes of uncompressed data,
+	// so decompression can be started from the nearest checkpoint instead of the beginning of the stream.
+	// Index is filled by InflateFile as the stream is being read and can be shared between files of the same entry.
+	class DeflateIndex
+	{
+	public:
+		struct Checkpoint
+		{
+			// Position in the uncompressed data
+			uint64_t out = 0;
+
+			// Position of the first full byte in the compressed data
+			uint64_t in = 0;
+
+			// Number of bits of the byte at in - 1, that belong to the stream after the checkpoint
+			int32_t bits = 0;
+
+			// Last 32KiB of uncompressed data before the checkpoint
+			std::vector<uint8_t> window;
+		};
+
+		typedef std::shared_ptr<const Checkpoint> CheckpointPtr;
+
+		explicit DeflateIndex(size_t span);
+
+		size_t GetSpan() const;
+
+		// Returns the nearest checkpoint, that is not greater than the given uncompressed position, or nullptr.
+		CheckpointPtr Find(size_t position) const;
+
+		// True if a checkpoint at the given position would extend the index.
+		bool NeedsCheckpoint(size_t position) const;
+
+		void Add(CheckpointPtr checkpoint);
+
+		std::vector<CheckpointPtr> GetCheckpoints() const;
+
+	private:
+		size_t m_span;
+		mutable std::mutex m_mutex;
+		std::vector<CheckpointPtr> m_checkpoints;
+	};
+
+	typedef std::shared_ptr<DeflateIndex> DeflateIndexPtr;
+
+	// Read-only file, that decompresses raw DEFLATE stream on demand.
+	// Compressed data is read from the source file sequentially in chunks of fixed size, so memory usage does not
+	// depend on the size of the entry. Seeking forward inflates and discards data, seeking backward restarts the stream.
+	// If index is given, seeking restarts decompression from the nearest checkpoint, and new checkpoints are added
+	// to the index while the stream is being decompressed.
+	class InflateFile : public FileInterface
+	{
+	public:
+		enum
+		{
+			kInputBufferSize = 64 * 1024,
+			kSkipBufferSize = 32 * 1024,
+		};
+
+		// source - file that contains compressed data only, starting at position zero.
+		InflateFile(File source, size_t sizeUncompressed, DeflateIndexPtr index = nullptr);
+
+		~InflateFile() override;
+
+		bool ok() const override;
+
+		path GetPath() const override;
+
+		Status Open(path filepath, Mode mode) override { return false; };
+
+		Status ReadData(uint8_t* dst, size_t size, size_t* bytesRead) override;
+
+		Status WriteData(const uint8_t* src, size_t size)  override;
+
+		Status SetPosition(size_t position) const  override;
+
+		size_t GetPosition() const  override;
+
+		size_t GetSize() const  override;
+
+		Status FlushBuffer() const override;
+
+		uint64_t GetLastWriteTime() const override { return m_source.GetLastWriteTime(); }
+
+		const uint8_t* GetDataPointer() const  override { return nullptr; };
+
+		uint8_t* GetDataPointer()  override { return nullptr; };
+
+	private:
+		bool Reset();
+
+		bool Restore(const DeflateIndex::Checkpoint& checkpoint);
+
+		void AddCheckpoint(size_t position);
+
+		// Inflates exactly size bytes to dst. If dst is nullptr, data is discarded.
+		bool Inflate(uint8_t* dst, size_t size);
+
+		File m_source;
+		z_stream m_stream;
+		bool m_ok;
+		bool m_streamEnd;
+
+		std::unique_ptr<uint8_t[]> m_input;
+
+		DeflateIndexPtr m_index;
+
+		// Position of the compressed stream
+		size_t m_compressedPosition;
+
+		size_t m_size;
+
+		// Position of the decompressed stream
+		size_t m_position;
+
+		// Position requested by the user. Stream catches up with it on the next read
+		mutable size_t m_pointer;
+	};
+}
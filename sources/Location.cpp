@@ -16,7 +16,7 @@ using namespace fsal;
 
 path Location::GetCurrentDirectory()
 {
-	static char cCurrentPath[FILENAME_MAX];
+	char cCurrentPath[FILENAME_MAX];
 	GetCurrentDir(cCurrentPath, sizeof(cCurrentPath));
 	cCurrentPath[sizeof(cCurrentPath) - 1] = '\0';
 	return cCurrentPath;
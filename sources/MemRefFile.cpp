@@ -31,7 +31,7 @@ MemRefFile::MemRefFile(uint8_t* data, size_t size, bool copy): m_data(data), m_s
 	}
 }
 
-MemRefFile::MemRefFile(std::shared_ptr<uint8_t> data, size_t size) : m_data(data.get()), m_sharedData(data), m_size(size), m_offset(0), m_hasOwnership(false), m_reserved(size)
+MemRefFile::MemRefFile(std::shared_ptr<uint8_t> data, size_t size, bool readOnly) : m_data(data.get()), m_sharedData(data), m_size(size), m_offset(0), m_hasOwnership(false), m_readOnly(readOnly), m_reserved(size)
 {
 }
 
@@ -85,9 +85,35 @@ Status MemRefFile::ReadData(uint8_t* dst, size_t size, size_t* pbytesRead)
 	return status;
 }
 
+Status MemRefFile::ReadDataAt(size_t offset, uint8_t* dst, size_t size, size_t* bytesRead)
+{
+	Status status = true;
+	if (m_size <= offset)
+	{
+		size = 0;
+		status = Status::kEOF;
+	}
+	else if (m_size - offset < size)
+	{
+		size = m_size - offset;
+		status.state |= Status::kEOF;
+	}
+
+	if (size != 0)
+	{
+		memcpy(dst, m_data + offset, size);
+	}
+
+	if (bytesRead != nullptr)
+	{
+		*bytesRead = size;
+	}
+	return status;
+}
+
 Status MemRefFile::WriteData(const uint8_t* src, size_t size)
 {
-	if (Resize(size + m_offset))
+	if (!m_readOnly && Resize(size + m_offset))
 	{
 		memcpy(m_data + m_offset, src, size);
 		m_offset += size;
@@ -129,7 +155,11 @@ uint8_t* MemRefFile::GetDataPointer()
 
 bool MemRefFile::Resize(size_t newSize)
 {
-	if (!m_hasOwnership)
+	if (m_readOnly)
+	{
+		return m_size == newSize;
+	}
+	else if (!m_hasOwnership)
 	{
 		return m_size >= newSize;
 	}
@@ -14,7 +14,8 @@ namespace fsal
 
 		MemRefFile(uint8_t* data, size_t size, bool copy);
 
-		MemRefFile(std::shared_ptr<uint8_t> data, size_t size);
+		// Read-only file rejects writes, so data, that is shared with other files, is not modified through it
+		MemRefFile(std::shared_ptr<uint8_t> data, size_t size, bool readOnly = false);
 
 		~MemRefFile() override;
 
@@ -26,6 +27,10 @@ namespace fsal
 
 		Status ReadData(uint8_t* dst, size_t size, size_t* bytesRead) override;
 
+		Status ReadDataAt(size_t offset, uint8_t* dst, size_t size, size_t* bytesRead) override;
+
+		bool ReadsAtOffset() const override { return true; };
+
 		Status WriteData(const uint8_t* src, size_t size)  override;
 
 		Status SetPosition(size_t position) const  override;
@@ -52,6 +57,7 @@ namespace fsal
 		mutable size_t m_offset;
 
 		bool m_hasOwnership;
+		bool m_readOnly = false;
 
 		size_t m_reserved;
 	};
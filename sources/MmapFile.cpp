@@ -0,0 +1,233 @@
+#include "fsal.h"
+#include "MmapFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#undef CreateDirectory
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <cstring>
+#include <algorithm>
+
+using namespace fsal;
+
+MmapFile::MmapFile(): m_data(nullptr), m_size(0), m_offset(0), m_isOpen(false)
+#ifdef _WIN32
+	, m_file(INVALID_HANDLE_VALUE), m_mapping(nullptr)
+#endif
+{
+}
+
+MmapFile::~MmapFile()
+{
+	Close();
+}
+
+void MmapFile::Close()
+{
+#ifdef _WIN32
+	if (m_data != nullptr)
+	{
+		UnmapViewOfFile(m_data);
+	}
+	if (m_mapping != nullptr)
+	{
+		CloseHandle(m_mapping);
+	}
+	if (m_file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_file);
+	}
+	m_mapping = nullptr;
+	m_file = INVALID_HANDLE_VALUE;
+#else
+	if (m_data != nullptr)
+	{
+		munmap(m_data, m_size);
+	}
+#endif
+	m_data = nullptr;
+	m_size = 0;
+	m_offset = 0;
+	m_isOpen = false;
+}
+
+bool MmapFile::ok() const
+{
+	return m_isOpen;
+}
+
+path MmapFile::GetPath() const
+{
+	return m_path;
+}
+
+Status MmapFile::Open(path filepath, Mode mode)
+{
+	// Mapping is read-only.
+	if (mode != kRead)
+	{
+		return false;
+	}
+
+	Close();
+	m_path = fs::absolute(filepath);
+
+#ifdef _WIN32
+	m_file = CreateFileW(m_path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_file, &size))
+	{
+		Close();
+		return false;
+	}
+	m_size = static_cast<size_t>(size.QuadPart);
+	if (m_size != 0)
+	{
+		m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (m_mapping == nullptr)
+		{
+			Close();
+			return false;
+		}
+		m_data = static_cast<uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+		if (m_data == nullptr)
+		{
+			Close();
+			return false;
+		}
+	}
+#else
+	int fd = ::open(m_path.string().c_str(), O_RDONLY);
+	if (fd == -1)
+	{
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		::close(fd);
+		return false;
+	}
+	m_size = static_cast<size_t>(st.st_size);
+	if (m_size != 0)
+	{
+		void* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED)
+		{
+			::close(fd);
+			m_size = 0;
+			return false;
+		}
+		m_data = static_cast<uint8_t*>(data);
+	}
+	// The mapping stays valid after the descriptor is closed.
+	::close(fd);
+#endif
+	m_isOpen = true;
+	return true;
+}
+
+Status MmapFile::ReadData(uint8_t* dst, size_t size, size_t* bytesRead)
+{
+	Status status = true;
+	if (m_size <= m_offset)
+	{
+		if (bytesRead != nullptr)
+		{
+			*bytesRead = 0;
+		}
+		return Status::kEOF;
+	}
+	else if (m_size < m_offset + size)
+	{
+		size = m_size - m_offset;
+		status.state |= Status::kEOF;
+	}
+
+	memcpy(dst, m_data + m_offset, size);
+	m_offset += size;
+
+	if (bytesRead != nullptr)
+	{
+		*bytesRead = size;
+	}
+	return status;
+}
+
+Status MmapFile::ReadDataAt(size_t offset, uint8_t* dst, size_t size, size_t* bytesRead)
+{
+	Status status = true;
+	if (m_size <= offset)
+	{
+		size = 0;
+		status = Status::kEOF;
+	}
+	else if (m_size - offset < size)
+	{
+		size = m_size - offset;
+		status.state |= Status::kEOF;
+	}
+
+	if (size != 0)
+	{
+		memcpy(dst, m_data + offset, size);
+	}
+
+	if (bytesRead != nullptr)
+	{
+		*bytesRead = size;
+	}
+	return status;
+}
+
+Status MmapFile::WriteData(const uint8_t* src, size_t size)
+{
+	return false;
+}
+
+Status MmapFile::SetPosition(size_t position) const
+{
+	m_offset = position;
+	return true;
+}
+
+size_t MmapFile::GetPosition() const
+{
+	return m_offset;
+}
+
+size_t MmapFile::GetSize() const
+{
+	return m_size;
+}
+
+Status MmapFile::FlushBuffer() const
+{
+	return true;
+}
+
+uint64_t MmapFile::GetLastWriteTime() const
+{
+	return fs::file_time_type::clock::to_time_t(fs::last_write_time(m_path));
+}
+
+const uint8_t* MmapFile::GetDataPointer() const
+{
+	return m_data;
+}
+
+uint8_t* MmapFile::GetDataPointer()
+{
+	return m_data;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include "fsal_common.h"
+#include "FileInterface.h"
+
+namespace fsal
+{
+	// Read-only file, mapped to the address space of the process.
+	// GetDataPointer returns pointer to the beginning of the mapping, so readers can access content directly.
+	class MmapFile : public FileInterface
+	{
+	public:
+		MmapFile();
+
+		~MmapFile() override;
+
+		bool ok() const override;
+
+		path GetPath() const override;
+
+		Status Open(path filepath, Mode mode) override;
+
+		Status ReadData(uint8_t* dst, size_t size, size_t* bytesRead) override;
+
+		Status ReadDataAt(size_t offset, uint8_t* dst, size_t size, size_t* bytesRead) override;
+
+		bool ReadsAtOffset() const override { return true; };
+
+		Status WriteData(const uint8_t* src, size_t size)  override;
+
+		Status SetPosition(size_t position) const  override;
+
+		size_t GetPosition() const  override;
+
+		size_t GetSize() const  override;
+
+		Status FlushBuffer() const override;
+
+		uint64_t GetLastWriteTime() const override;
+
+		const uint8_t* GetDataPointer() const  override;
+
+		uint8_t* GetDataPointer()  override;
+
+	private:
+		void Close();
+
+		uint8_t* m_data;
+		size_t m_size;
+		mutable size_t m_offset;
+		bool m_isOpen;
+		path m_path;
+#ifdef _WIN32
+		void* m_file;
+		void* m_mapping;
+#endif
+	};
+}
@@ -3,9 +3,21 @@
 
 #include <cstdio>
 
+#ifndef _WIN32
+#include <unistd.h>
+#include <cerrno>
+#endif
+#ifdef __linux
+#include <sys/uio.h>
+#include <climits>
+#include <algorithm>
+#include <numeric>
+#include <vector>
+#endif
+
 using namespace fsal;
 
-StdFile::StdFile(): m_file(nullptr)
+StdFile::StdFile(): m_file(nullptr), m_mode(kRead)
 {
 
 }
@@ -54,6 +66,7 @@ Status StdFile::Open(path filepath, Mode mode)
 		break;
 	}
 
+	m_mode = mode;
 	m_path = fs::absolute(filepath);
 #ifdef WIN32
 	std::wstring wmodeStr;
@@ -82,6 +95,147 @@ Status StdFile::ReadData(uint8_t* dst, size_t size, size_t* bytesRead)
 	return (error ? Status::kFailed: Status::kOk) | (eof ? Status::kEOF: Status::kOk);
 }
 
+Status StdFile::ReadDataAt(size_t offset, uint8_t* dst, size_t size, size_t* bytesRead)
+{
+#ifdef _WIN32
+	return FileInterface::ReadDataAt(offset, dst, size, bytesRead);
+#else
+	if (m_mode != kRead)
+	{
+		// Data, that is buffered by stdio, is not visible to pread until flushed
+		std::fflush(m_file);
+	}
+	int fd = fileno(m_file);
+	Status status = true;
+	size_t total = 0;
+	while (total < size)
+	{
+#ifdef __linux
+		ssize_t result = pread64(fd, dst + total, size - total, (off64_t)(offset + total));
+#else
+		ssize_t result = pread(fd, dst + total, size - total, (off_t)(offset + total));
+#endif
+		if (result < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			status = false;
+			break;
+		}
+		if (result == 0)
+		{
+			status = Status::kEOF;
+			break;
+		}
+		total += (size_t)result;
+	}
+	if (bytesRead != nullptr)
+	{
+		*bytesRead = total;
+	}
+	return status;
+#endif
+}
+
+bool StdFile::ReadsAtOffset() const
+{
+#ifdef _WIN32
+	return false;
+#else
+	return true;
+#endif
+}
+
+Status StdFile::ReadDataRanges(ReadRange* ranges, size_t count)
+{
+#ifdef __linux
+	if (m_mode != kRead)
+	{
+		std::fflush(m_file);
+	}
+	int fd = fileno(m_file);
+
+	// Ranges are read in the order of offsets, so that adjacent ones are merged into one preadv
+	std::vector<size_t> order(count);
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [ranges](size_t a, size_t b)
+	{
+		return ranges[a].offset < ranges[b].offset;
+	});
+
+	Status status = true;
+	std::vector<iovec> iov;
+	size_t i = 0;
+	while (i < count)
+	{
+		size_t first = i;
+		size_t start = ranges[order[i]].offset;
+		size_t end = start;
+		iov.clear();
+		while (i < count && ranges[order[i]].offset == end && iov.size() < IOV_MAX)
+		{
+			ReadRange& range = ranges[order[i]];
+			if (range.size != 0)
+			{
+				iov.push_back(iovec{range.dst, range.size});
+			}
+			end += range.size;
+			++i;
+		}
+
+		size_t total = 0;
+		size_t index = 0;
+		while (index < iov.size())
+		{
+			ssize_t result = preadv64(fd, iov.data() + index, (int)(iov.size() - index), (off64_t)(start + total));
+			if (result < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				status.state |= Status::kFailed;
+				break;
+			}
+			if (result == 0)
+			{
+				break;
+			}
+			total += (size_t)result;
+
+			// Short read, continue from the first buffer, that is not filled
+			size_t consumed = (size_t)result;
+			while (index < iov.size() && consumed >= iov[index].iov_len)
+			{
+				consumed -= iov[index].iov_len;
+				++index;
+			}
+			if (consumed != 0)
+			{
+				iov[index].iov_base = (uint8_t*)iov[index].iov_base + consumed;
+				iov[index].iov_len -= consumed;
+			}
+		}
+
+		for (size_t j = first; j < i; ++j)
+		{
+			ReadRange& range = ranges[order[j]];
+			size_t begin = range.offset - start;
+			range.bytesRead = total > begin ? std::min(total - begin, range.size) : 0;
+			if (range.bytesRead != range.size)
+			{
+				status.state |= Status::kEOF;
+			}
+		}
+	}
+	return status;
+#else
+	return FileInterface::ReadDataRanges(ranges, count);
+#endif
+}
+
 Status StdFile::WriteData(const uint8_t* src, size_t size)
 {
 	size_t writeSize = std::fwrite(src, 1, size, m_file);
@@ -126,6 +280,23 @@ size_t StdFile::GetSize() const
 	return size;
 }
 
+bool StdFile::GetDescriptor(int& fd, size_t& base, size_t& limit) const
+{
+#ifdef _WIN32
+	return false;
+#else
+	// Writes, that are buffered by stdio, would not be visible to reads of the descriptor
+	if (m_file == nullptr || m_mode != kRead)
+	{
+		return false;
+	}
+	fd = fileno(m_file);
+	base = 0;
+	limit = SIZE_MAX;
+	return true;
+#endif
+}
+
 Status StdFile::FlushBuffer() const
 {
 	return std::fflush(m_file) == 0;
@@ -149,4 +320,5 @@ uint8_t* StdFile::GetDataPointer()
 void StdFile::AssignFile(FILE* file)
 {
 	m_file = file;
+	m_mode = kReadUpdate;
 }
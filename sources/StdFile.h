@@ -21,6 +21,12 @@ namespace fsal
 
 		Status ReadData(uint8_t* dst, size_t size, size_t* bytesRead) override;
 
+		Status ReadDataAt(size_t offset, uint8_t* dst, size_t size, size_t* bytesRead) override;
+
+		Status ReadDataRanges(ReadRange* ranges, size_t count) override;
+
+		bool ReadsAtOffset() const override;
+
 		Status WriteData(const uint8_t* src, size_t size)  override;
 
 		Status SetPosition(size_t position) const  override;
@@ -31,6 +37,8 @@ namespace fsal
 
 		Status FlushBuffer() const override;
 
+		bool GetDescriptor(int& fd, size_t& base, size_t& limit) const override;
+
 		uint64_t GetLastWriteTime() const override;
 
 		const uint8_t* GetDataPointer() const  override;
@@ -41,5 +49,6 @@ namespace fsal
 	private:
 		FILE* m_file;
 		path m_path;
+		Mode m_mode;
 	};
 }
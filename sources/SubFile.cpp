@@ -7,13 +7,15 @@ typedef SSIZE_T ssize_t;
 #endif
 
 #include <cstdio>
+#include <vector>
 #include <assert.h>
 
 using namespace fsal;
 
 SubFile::SubFile(std::shared_ptr<FileInterface> file, size_t size, size_t offset): m_file(std::move(file)), m_size(size), m_offset(offset), m_pointer(0)
 {
-	assert(m_file->GetMutex() != nullptr);
+	// Subfiles of the same parent are read concurrently. Parent, that seeks to read at an offset, has to be lockable.
+	assert(m_file->GetMutex() != nullptr || m_file->ReadsAtOffset());
 }
 
 SubFile::~SubFile()
@@ -35,17 +37,52 @@ Status SubFile::ReadData(uint8_t* dst, size_t size, size_t* bytesRead)
 	{
 		return Status::kEOF;
 	}
-	File::LockGuard guard(m_file.get());
-	m_file->SetPosition(m_pointer + m_offset);
 	size_t _bytesRead = 0;
 	size_t* read = bytesRead == nullptr ? &_bytesRead : bytesRead;
 	ssize_t _size = std::min(m_pointer + size, m_size) - m_pointer;
-	auto tmp = m_file->ReadData(dst, _size, read);
+	auto tmp = m_file->ReadDataAt(m_pointer + m_offset, dst, _size, read);
 	m_pointer += *read;
 	tmp.state |= (m_pointer + size > m_size) ? Status::kEOF: Status::kOk;
 	return tmp;
 }
 
+Status SubFile::ReadDataAt(size_t offset, uint8_t* dst, size_t size, size_t* bytesRead)
+{
+	if (offset >= m_size)
+	{
+		if (bytesRead != nullptr)
+		{
+			*bytesRead = 0;
+		}
+		return Status::kEOF;
+	}
+	size_t _size = std::min(size, m_size - offset);
+	auto tmp = m_file->ReadDataAt(m_offset + offset, dst, _size, bytesRead);
+	tmp.state |= (_size < size) ? Status::kEOF: Status::kOk;
+	return tmp;
+}
+
+Status SubFile::ReadDataRanges(ReadRange* ranges, size_t count)
+{
+	// Ranges are clipped to the subfile and passed to the parent at once, so it can merge them
+	std::vector<ReadRange> clipped(ranges, ranges + count);
+	for (auto& range: clipped)
+	{
+		range.size = range.offset < m_size ? std::min(range.size, m_size - range.offset) : 0;
+		range.offset = m_offset + std::min(range.offset, m_size);
+	}
+	Status status = m_file->ReadDataRanges(clipped.data(), count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		ranges[i].bytesRead = clipped[i].bytesRead;
+		if (ranges[i].bytesRead != ranges[i].size)
+		{
+			status.state |= Status::kEOF;
+		}
+	}
+	return status;
+}
+
 Status SubFile::WriteData(const uint8_t* src, size_t size)
 {
 	if (m_pointer >= m_size)
@@ -77,6 +114,17 @@ size_t SubFile::GetSize() const
 	return m_size;
 }
 
+bool SubFile::GetDescriptor(int& fd, size_t& base, size_t& limit) const
+{
+	if (!m_file->GetDescriptor(fd, base, limit) || limit < m_offset)
+	{
+		return false;
+	}
+	base += m_offset;
+	limit = std::min(limit - m_offset, m_size);
+	return true;
+}
+
 Status SubFile::FlushBuffer() const
 {
 	return m_file->FlushBuffer();
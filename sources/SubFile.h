@@ -22,6 +22,12 @@ namespace fsal
 
 		Status ReadData(uint8_t* dst, size_t size, size_t* bytesRead) override;
 
+		Status ReadDataAt(size_t offset, uint8_t* dst, size_t size, size_t* bytesRead) override;
+
+		Status ReadDataRanges(ReadRange* ranges, size_t count) override;
+
+		bool ReadsAtOffset() const override { return m_file->ReadsAtOffset(); };
+
 		Status WriteData(const uint8_t* src, size_t size)  override;
 
 		Status SetPosition(size_t position) const  override;
@@ -32,6 +38,8 @@ namespace fsal
 
 		Status FlushBuffer() const override;
 
+		bool GetDescriptor(int& fd, size_t& base, size_t& limit) const override;
+
 		uint64_t GetLastWriteTime() const override { return m_file->GetLastWriteTime(); }
 
 		const uint8_t* GetDataPointer() const  override { return nullptr; };
@@ -0,0 +1,119 @@
+#include "ThreadPool.h"
+
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+using namespace fsal;
+
+ThreadPool::ThreadPool(size_t threadCount): m_stop(false)
+{
+	if (threadCount == 0)
+	{
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	}
+	for (size_t i = 0; i < threadCount; ++i)
+	{
+		m_threads.emplace_back(&ThreadPool::WorkerLoop, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_condition.notify_all();
+	for (auto& thread: m_threads)
+	{
+		thread.join();
+	}
+}
+
+void ThreadPool::WorkerLoop()
+{
+	while (true)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_condition.wait(lock, [this]{ return m_stop || !m_tasks.empty(); });
+			if (m_tasks.empty())
+			{
+				return;
+			}
+			task = std::move(m_tasks.front());
+			m_tasks.pop_front();
+		}
+		task();
+	}
+}
+
+void ThreadPool::Push(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_tasks.push_back(std::move(task));
+	}
+	m_condition.notify_one();
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t index)>& f)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	struct State
+	{
+		std::atomic<size_t> next;
+		size_t done = 0;
+		std::mutex mutex;
+		std::condition_variable condition;
+	};
+	auto state = std::make_shared<State>();
+	state->next = 0;
+
+	// Helpers may start after all the work is taken, so they only touch f if they claim an index.
+	auto work = [state, count, &f]()
+	{
+		size_t finished = 0;
+		for (size_t i = state->next++; i < count; i = state->next++)
+		{
+			f(i);
+			++finished;
+		}
+		if (finished != 0)
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->done += finished;
+			if (state->done == count)
+			{
+				state->condition.notify_all();
+			}
+		}
+	};
+
+	size_t helpers = std::min(count, m_threads.size() + 1) - 1;
+	for (size_t i = 0; i < helpers; ++i)
+	{
+		Push(work);
+	}
+	work();
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->condition.wait(lock, [&state, count]{ return state->done == count; });
+}
+
+size_t ThreadPool::GetThreadCount() const
+{
+	return m_threads.size();
+}
+
+ThreadPool& ThreadPool::GetDefault()
+{
+	static ThreadPool pool;
+	return pool;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "fsal_common.h"
+
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+namespace fsal
+{
+	// Fixed set of worker threads, that run pushed tasks in FIFO order.
+	class ThreadPool
+	{
+	public:
+		// Zero means number of hardware threads.
+		explicit ThreadPool(size_t threadCount = 0);
+
+		// Waits for queued tasks to finish.
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		void Push(std::function<void()> task);
+
+		// Calls f for each index in [0, count) and returns when all calls are done. Calling thread takes part
+		// in the work, so it is safe to call from a task of the same pool.
+		void ParallelFor(size_t count, const std::function<void(size_t index)>& f);
+
+		size_t GetThreadCount() const;
+
+		// Pool, shared by all readers and writers, that were not given a pool explicitly.
+		static ThreadPool& GetDefault();
+
+	private:
+		void WorkerLoop();
+
+		std::vector<std::thread> m_threads;
+		std::deque<std::function<void()>> m_tasks;
+		std::mutex m_mutex;
+		std::condition_variable m_condition;
+		bool m_stop;
+	};
+}
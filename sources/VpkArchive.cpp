@@ -6,6 +6,7 @@
 #include "SubFile.h"
 #include <cassert>
 #include <zlib.h>
+#include <xxhash.h>
 
 
 using namespace fsal;
@@ -34,11 +35,24 @@ static std::string read_string(const fsal::File& file)
 
 Status VPKReader::OpenArchive(FileSystem fs, Location directory, const std::string& formatString)
 {
+	return OpenArchive(std::move(fs), std::move(directory), formatString, File());
+}
+
+Status VPKReader::OpenArchive(FileSystem fs, Location directory, const std::string& formatString, File indexFile)
+{
+	m_fs = fs;
 	m_formatString = formatString;
 	m_directory = std::move(directory);
+	m_indexed = false;
 	char buff[2048];
 	sprintf(buff, m_formatString.c_str(), "dir");
-	m_index = fs.Open(m_directory / buff);
+
+	// Preload bytes are read from the directory file on open, in place if it is mapped
+	m_index = fs.Open(m_directory / buff, Mode::kRead, true, true);
+	if (!m_index)
+	{
+		return false;
+	}
 
 	VPKHeader_v2 header;
 
@@ -57,6 +71,14 @@ Status VPKReader::OpenArchive(FileSystem fs, Location directory, const std::stri
 	printf( "Directory length: %d\n", header.TreeSize);
 
 	size_t tree_begin_ptr = m_index.Tell();
+	m_treeOffset = tree_begin_ptr;
+	m_treeSize = header.TreeSize;
+
+	if (indexFile && filelist.LoadIndex(indexFile, GetIndexKey()))
+	{
+		m_indexed = true;
+		return true;
+	}
 
 	while (true)
 	{
@@ -98,12 +120,11 @@ Status VPKReader::OpenArchive(FileSystem fs, Location directory, const std::stri
 				entry.ArchiveIndex = entryHeader.ArchiveIndex;
 				entry.EntryOffset = entryHeader.EntryOffset;
 				entry.EntryLength = entryHeader.EntryLength;
-				entry.preloadData = nullptr;
+				entry.PreloadOffset = (uint32_t)m_index.Tell();
 
 				if (entryHeader.PreloadBytes > 0)
 				{
-					entry.preloadData = (uint8_t*) malloc(entryHeader.PreloadBytes);
-					m_index.Read(entry.preloadData, entryHeader.PreloadBytes);
+					m_index.Seek(entry.PreloadOffset + entryHeader.PreloadBytes);
 				}
 				//printf("%s/%s.%s\n", path.c_str(), name.c_str(), ext.c_str());
 
@@ -118,8 +139,62 @@ Status VPKReader::OpenArchive(FileSystem fs, Location directory, const std::stri
 	return true;
 }
 
+FileListKey VPKReader::GetIndexKey()
+{
+	FileListKey key;
+	key.size = m_index.GetSize();
+	key.lastWriteTime = m_index.GetLastWriteTime();
+	key.hash = 0;
+
+	size_t size = std::min(m_treeSize, m_index.GetSize() - std::min(m_treeOffset, m_index.GetSize()));
+	const uint8_t* mapped = m_index.GetDataPointer();
+	if (mapped != nullptr)
+	{
+		key.hash = XXH64(mapped + m_treeOffset, size, 0);
+	}
+	else
+	{
+		std::vector<uint8_t> tree(size);
+		m_index.ReadAt(m_treeOffset, tree.data(), size);
+		key.hash = XXH64(tree.data(), size, 0);
+	}
+	return key;
+}
+
+Status VPKReader::SaveIndex(File indexFile)
+{
+	return filelist.SaveIndex(std::move(indexFile), GetIndexKey());
+}
+
+bool VPKReader::IsIndexed() const
+{
+	return m_indexed;
+}
+
+bool VPKReader::ReadPreload(const VpkEntryData& entry, uint8_t* dst)
+{
+	if (entry.PreloadBytes == 0)
+	{
+		return true;
+	}
+	if ((size_t)entry.PreloadOffset + entry.PreloadBytes > m_index.GetSize())
+	{
+		return false;
+	}
+	const uint8_t* mapped = m_index.GetDataPointer();
+	if (mapped != nullptr)
+	{
+		memcpy(dst, mapped + entry.PreloadOffset, entry.PreloadBytes);
+		return true;
+	}
+	size_t bytesRead = 0;
+	m_index.ReadAt(entry.PreloadOffset, dst, entry.PreloadBytes, &bytesRead);
+	return bytesRead == entry.PreloadBytes;
+}
+
 File VPKReader::OpenPak(int index)
 {
+	std::lock_guard<std::mutex> lock(m_pakFilesMutex);
 	auto it = m_pak_files.find(index);
 	if (it != m_pak_files.end())
 	{
@@ -129,7 +204,7 @@ File VPKReader::OpenPak(int index)
 	char buff2[32];
 	sprintf(buff2, "%03d", index);
 	sprintf(buff, m_formatString.c_str(), buff2);
-	File file = m_fs.Open(m_directory / buff, Mode::kRead, true);
+	File file = m_fs.Open(m_directory / buff, Mode::kRead, true, true);
 	m_pak_files[index] = file;
 	return file;
 }
@@ -152,19 +227,45 @@ File VPKReader::OpenFile(const fs::path& filepath)
 
 	if (entry.PreloadBytes != 0 || entry.EntryOffset != 0)
 	{
-		if (entry.PreloadBytes != 0 || entry.PreloadBytes + entry.EntryLength < 1024 * 16)
+		const uint8_t* mapped = file.GetDataPointer();
+
+		// Mapping is accessed directly, so the entry must not point past its end
+		if (mapped != nullptr && entry.EntryLength != 0 && (size_t)entry.EntryOffset + entry.EntryLength > file.GetSize())
+		{
+			return File();
+		}
+
+		if (entry.PreloadBytes == 0 && mapped != nullptr)
+		{
+			// Pak is mapped to memory. Return a view, that shares ownership of the mapping, and is read-only as the
+			// mapping is.
+			std::shared_ptr<uint8_t> view(file.GetInterface(), const_cast<uint8_t*>(mapped) + offset);
+			return new MemRefFile(view, entry.EntryLength, true);
+		}
+		else if (entry.PreloadBytes != 0 || entry.PreloadBytes + entry.EntryLength < 1024 * 16)
 		{
 			auto* memfile = new MemRefFile();
 			memfile->Resize(entry.PreloadBytes + entry.EntryLength);
 			auto* data = memfile->GetDataPointer();
-			memcpy(data, entry.preloadData, entry.PreloadBytes);
+			if (!ReadPreload(entry, data))
+			{
+				delete memfile;
+				return File();
+			}
 
-			if (entry.EntryLength > 0)
+			if (entry.EntryLength > 0 && mapped != nullptr)
+			{
+				memcpy(data + entry.PreloadBytes, mapped + offset, entry.EntryLength);
+			}
+			else if (entry.EntryLength > 0)
 			{
-				m_fileMutex.lock();
-				file.Seek(offset, File::Beginning);
-				file.Read((uint8_t*) data + entry.PreloadBytes, entry.EntryLength);
-				m_fileMutex.unlock();
+				size_t bytesRead = 0;
+				file.ReadAt(offset, (uint8_t*) data + entry.PreloadBytes, entry.EntryLength, &bytesRead);
+				if (bytesRead != entry.EntryLength)
+				{
+					delete memfile;
+					return File();
+				}
 			}
 			return memfile;
 		}
@@ -178,6 +279,78 @@ File VPKReader::OpenFile(const fs::path& filepath)
 	return File();
 }
 
+bool VPKReader::FindEntry(const fs::path& filepath, VpkEntryData& entry)
+{
+	FileEntry<VpkEntryData> key(filepath.u8string());
+	int index = filelist.GetIndex(key).first;
+	if (index == -1)
+	{
+		return false;
+	}
+	entry = filelist.FindEntry(filepath);
+	return true;
+}
+
+void* VPKReader::OpenFile(const fs::path& filepath, std::function<void*(size_t size)> alloc)
+{
+	size_t size = 0;
+	if (!GetFileSize(filepath, size))
+	{
+		return nullptr;
+	}
+	auto* data = alloc(size);
+	return ReadFile(filepath, (uint8_t*)data, size) ? data : nullptr;
+}
+
+Status VPKReader::GetFileSize(const fs::path& filepath, size_t& size)
+{
+	VpkEntryData entry;
+	if (!FindEntry(filepath, entry))
+	{
+		return false;
+	}
+	size = (size_t)entry.PreloadBytes + entry.EntryLength;
+	return true;
+}
+
+Status VPKReader::ReadFile(const fs::path& filepath, uint8_t* dst, size_t size)
+{
+	VpkEntryData entry;
+	if (!FindEntry(filepath, entry) || (size_t)entry.PreloadBytes + entry.EntryLength > size)
+	{
+		return false;
+	}
+
+	if (!ReadPreload(entry, dst))
+	{
+		return false;
+	}
+	if (entry.EntryLength == 0)
+	{
+		return true;
+	}
+
+	File file = entry.ArchiveIndex == 0x7fff ? m_index : OpenPak(entry.ArchiveIndex);
+	if (!file)
+	{
+		return false;
+	}
+
+	const uint8_t* mapped = file.GetDataPointer();
+	if (mapped != nullptr)
+	{
+		if ((size_t)entry.EntryOffset + entry.EntryLength > file.GetSize())
+		{
+			return false;
+		}
+		memcpy(dst + entry.PreloadBytes, mapped + entry.EntryOffset, entry.EntryLength);
+		return true;
+	}
+
+	size_t bytesRead = 0;
+	file.ReadAt(entry.EntryOffset, dst + entry.PreloadBytes, entry.EntryLength, &bytesRead);
+	return bytesRead == entry.EntryLength;
+}
 
 bool VPKReader::Exists(const fs::path& filepath, PathType type)
 {
@@ -196,3 +369,12 @@ std::vector<std::string> VPKReader::ListDirectory(const fs::path& path)
 {
 	return filelist.ListDirectory(path);
 }
+
+bool VPKReader::ForEachEntry(const std::function<void(const std::string& path)>& f)
+{
+	filelist.ForEach([&f](const std::string& path, const VpkEntryData&)
+	{
+		f(path);
+	});
+	return true;
+}
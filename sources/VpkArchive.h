@@ -58,7 +58,8 @@ namespace fsal
 		uint16_t ArchiveIndex;
 		uint32_t EntryOffset;
 		uint32_t EntryLength;
-		uint8_t* preloadData;
+		// Offset of preload bytes in the directory file
+		uint32_t PreloadOffset;
 	};
 
 #pragma pack(pop)
@@ -68,24 +69,52 @@ namespace fsal
 	public:
 		Status OpenArchive(FileSystem fs, Location directory, const std::string& formatString = "pak01_%s.vpk");
 
+		// Takes entries from the index, saved with SaveIndex, if it was saved for this archive (same size, modification
+		// time and hash of the directory tree). Otherwise the tree is parsed. Index file should be mapped, so it is used
+		// in place.
+		Status OpenArchive(FileSystem fs, Location directory, const std::string& formatString, File indexFile);
+
+		// Writes sorted entries of the archive, so the next OpenArchive does not need to parse them.
+		Status SaveIndex(File indexFile);
+
+		// Returns true if entries were taken from the index.
+		bool IsIndexed() const;
+
 		File OpenFile(const fs::path& filepath) override;
 
-		void* OpenFile(const fs::path& filepath, std::function<void*(size_t size)> alloc_func) override { return nullptr; };
+		void* OpenFile(const fs::path& filepath, std::function<void*(size_t size)> alloc_func) override;
+
+		Status GetFileSize(const fs::path& filepath, size_t& size) override;
+
+		Status ReadFile(const fs::path& filepath, uint8_t* dst, size_t size) override;
 
 		bool Exists(const fs::path& filepath, PathType type = kFile | kDirectory) override;
 
 		std::vector<std::string> ListDirectory(const fs::path& path) override;
 
+		bool ForEachEntry(const std::function<void(const std::string& path)>& f) override;
+
 	private:
 		File OpenPak(int index);
 
+		// Returns false if there is no such entry.
+		bool FindEntry(const fs::path& filepath, VpkEntryData& entry);
+
+		// Copies preload bytes of the entry from the directory file.
+		bool ReadPreload(const VpkEntryData& entry, uint8_t* dst);
+
+		FileListKey GetIndexKey();
+
 		FileList<VpkEntryData> filelist;
 		File m_index;
-		std::mutex m_fileMutex;
+		size_t m_treeOffset = 0;
+		size_t m_treeSize = 0;
+		bool m_indexed = false;
 		FileSystem m_fs;
 		std::string m_formatString;
 		Location m_directory;
 		std::map<int, File> m_pak_files;
+		std::mutex m_pakFilesMutex;
 	};
 
 	inline Archive OpenVpkArchive(FileSystem fs, Location directory, const std::string& formatString = "pak01_%s.vpk")
@@ -4,11 +4,19 @@
 #include "FileStream.h"
 #include "MemRefFile.h"
 #include "SubFile.h"
+#include "InflateFile.h"
+#include "ThreadPool.h"
+#include "Crc32.h"
+#include "CompressionPolicy.h"
 #include <cassert>
 #include <stddef.h>
+#include <climits>
+#include <algorithm>
 #include <lz4.h>
-#include <lz4hc.h>
+#include <lz4frame.h>
+#include <zstd.h>
 #include <zlib.h>
+#include <xxhash.h>
 
 
 using namespace fsal;
@@ -54,6 +62,28 @@ namespace bfio
 		io & x.ZIPFileCommentLength;
 	}
 	template<class RW>
+	inline void Serialize(RW& io, Zip64EndOfCentralDirectoryRecord& x)
+	{
+		io & x.zip64EndOfCentralDirSignature;
+		io & x.sizeOfZip64EndOfCentralDirectoryRecord;
+		io & x.versionMadeBy;
+		io & x.versionNeededToExtract;
+		io & x.numberOfThisDisk;
+		io & x.numberOfTheDiskWithTheStartOfTheCentralDirectory;
+		io & x.totalNumberOfEntriesInTheCentralDirectoryOnThisDisk;
+		io & x.totalNumberOfEntriesInTheCentralDirectory;
+		io & x.sizeOfTheCentralDirectory;
+		io & x.offsetOfStartOfCentralDirectory;
+	}
+	template<class RW>
+	inline void Serialize(RW& io, Zip64EndOfCentralDirectoryLocator& x)
+	{
+		io & x.zip64EndOfCentralDirLocatorSignature;
+		io & x.numberOfTheDiskWithTheStartOfTheZip64EndOfCentralDirectory;
+		io & x.relativeOffsetOfTheZip64EndOfCentralDirectoryRecord;
+		io & x.totalNumberOfDisks;
+	}
+	template<class RW>
 	inline void Serialize(RW& io, LocalFileHeader& x)
 	{
 		io & x.localFileHeaderSignature;
@@ -68,333 +98,1670 @@ namespace bfio
 	}
 }
 
-Status ZipReader::OpenArchive(File file_)
+// End of central directory record is followed by a comment of variable length, so it has to be searched for.
+static bool FindEndOfCentralDirectory(File& file, size_t& position)
 {
-	file = std::move(file_);
+	size_t fileSize = file.GetSize();
+	size_t sizeOfECDR = sizeof(EndOfCentralDirectoryRecord);
 
+	if (fileSize < sizeOfECDR)
+	{
+		return false;
+	}
+
+	// Most of archives do not have a comment, so record is checked at the very end first
+	uint32_t signature = 0;
+	file.Seek(fileSize - sizeOfECDR);
+	file.Read(signature);
+	if (signature == ZIP_SIGNATURES::END_OF_CENTRAL_DIRECTORY_SIGN)
+	{
+		position = fileSize - sizeOfECDR;
+		return true;
+	}
+
+	size_t tailSize = std::min(fileSize, sizeOfECDR + ZIP_LIMITS::MAX_16);
+	std::vector<uint8_t> tail(tailSize);
+	file.Seek(fileSize - tailSize);
+	file.Read(tail.data(), tailSize);
+
+	for (size_t i = tailSize - sizeOfECDR + 1; i-- > 0;)
+	{
+		memcpy(&signature, &tail[i], sizeof(signature));
+		if (signature == ZIP_SIGNATURES::END_OF_CENTRAL_DIRECTORY_SIGN)
+		{
+			position = fileSize - tailSize + i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Finds offset and size of the central directory, taking ZIP64 end of central directory record into account.
+static bool FindCentralDirectory(File& file, uint64_t& offsetOfCD, uint64_t& sizeOfCD)
+{
 	FileStream stream(file);
 
-	ptrdiff_t sizeOfCDEND = bfio::SizeOf<EndOfCentralDirectoryRecord>();
+	size_t positionOfECDR = 0;
+
+	if (!FindEndOfCentralDirectory(file, positionOfECDR))
+	{
+		return false;
+	}
 
-	file.Seek(-sizeOfCDEND, File::End);
+	file.Seek(positionOfECDR, File::Beginning);
 
 	EndOfCentralDirectoryRecord ecdr;
 	stream >> ecdr;
 
-	if (ecdr.endOfCentralDirSignature != ZIP_SIGNATURES::END_OF_CENTRAL_DIRECTORY_SIGN)
+	sizeOfCD = ecdr.sizeOfTheCentralDirectory;
+	offsetOfCD = ecdr.offsetOfStartOfCentralDirectory;
+
+	// ZIP64 archives have locator of ZIP64 end of central directory record right before the regular one
+	if (positionOfECDR >= sizeof(Zip64EndOfCentralDirectoryLocator))
 	{
-		return false;
+		Zip64EndOfCentralDirectoryLocator locator;
+		file.Seek(positionOfECDR - sizeof(Zip64EndOfCentralDirectoryLocator), File::Beginning);
+		stream >> locator;
+
+		if (locator.zip64EndOfCentralDirLocatorSignature == ZIP_SIGNATURES::ZIP64_END_OF_CENTRAL_DIRECTORY_LOCATOR_SIGN)
+		{
+			Zip64EndOfCentralDirectoryRecord zip64ecdr;
+			file.Seek(locator.relativeOffsetOfTheZip64EndOfCentralDirectoryRecord, File::Beginning);
+			stream >> zip64ecdr;
+
+			if (zip64ecdr.zip64EndOfCentralDirSignature != ZIP_SIGNATURES::ZIP64_END_OF_CENTRAL_DIRECTORY_SIGN)
+			{
+				return false;
+			}
+			sizeOfCD = zip64ecdr.sizeOfTheCentralDirectory;
+			offsetOfCD = zip64ecdr.offsetOfStartOfCentralDirectory;
+		}
 	}
 
-	file.Seek(ecdr.offsetOfStartOfCentralDirectory, File::Beginning);
+	return offsetOfCD + sizeOfCD <= file.GetSize();
+}
 
-	std::string filename;
+// Reads values from ZIP64 extended information extra field. Only values, which fields in the central directory header
+// are set to 0xFFFFFFFF, are present in the extra field, in the fixed order.
+static bool ReadZip64ExtraField(const uint8_t* extraField, size_t size, const CentralDirectoryHeader& header, ZipEntryData& entry)
+{
+	for (size_t pos = 0; pos + sizeof(ExtraFieldHeader) <= size;)
+	{
+		ExtraFieldHeader fieldHeader;
+		memcpy(&fieldHeader, extraField + pos, sizeof(ExtraFieldHeader));
+		pos += sizeof(ExtraFieldHeader);
 
-	CentralDirectoryHeader header = {0};
-	LocalFileHeader fileHeader = {0};
+		if (pos + fieldHeader.dataSize > size)
+		{
+			return false;
+		}
+
+		if (fieldHeader.headerID == ZIP_EXTRA_FIELD::ZIP64)
+		{
+			const uint8_t* ptr = extraField + pos;
+			const uint8_t* end = ptr + fieldHeader.dataSize;
+
+			uint64_t value;
+			if (header.dataDescriptor.uncompressedSize == ZIP_LIMITS::MAX_32)
+			{
+				if (ptr + sizeof(value) > end) return false;
+				memcpy(&value, ptr, sizeof(value));
+				ptr += sizeof(value);
+				entry.sizeUncompressed = value;
+			}
+			if (header.dataDescriptor.compressedSize == ZIP_LIMITS::MAX_32)
+			{
+				if (ptr + sizeof(value) > end) return false;
+				memcpy(&value, ptr, sizeof(value));
+				ptr += sizeof(value);
+				entry.sizeCompressed = value;
+			}
+			if (header.relativeOffsetOfLocalHeader == ZIP_LIMITS::MAX_32)
+			{
+				if (ptr + sizeof(value) > end) return false;
+				memcpy(&value, ptr, sizeof(value));
+				entry.localHeaderOffset = value;
+			}
+			return true;
+		}
+		pos += fieldHeader.dataSize;
+	}
+	return true;
+}
+
+static void AppendZip64ExtraField(std::string& extraField, const std::vector<uint64_t>& values)
+{
+	ExtraFieldHeader fieldHeader;
+	fieldHeader.headerID = ZIP_EXTRA_FIELD::ZIP64;
+	fieldHeader.dataSize = (uint16_t)(values.size() * sizeof(uint64_t));
+	extraField.append((const char*)&fieldHeader, sizeof(fieldHeader));
+	extraField.append((const char*)values.data(), values.size() * sizeof(uint64_t));
+}
+
+Status ZipReader::OpenArchive(File file_)
+{
+	return OpenArchive(std::move(file_), File());
+}
+
+Status ZipReader::OpenArchive(File file_, File indexFile)
+{
+	file = std::move(file_);
+	m_indexed = false;
+	m_archiveSize = file.GetSize();
 
 	{
 		bfio::SizeCalculator s;
-		s << header;
-		assert(s.GetSize() == sizeof(header));
+		s << CentralDirectoryHeader();
+		assert(s.GetSize() == sizeof(CentralDirectoryHeader));
 	}
 	{
 		bfio::SizeCalculator s;
-		s << fileHeader;
-		assert(s.GetSize() == sizeof(fileHeader));
+		s << LocalFileHeader();
+		assert(s.GetSize() == sizeof(LocalFileHeader));
+	}
+
+	if (!FindCentralDirectory(file, m_offsetOfCD, m_sizeOfCD))
+	{
+		return false;
 	}
+	size_t sizeOfCD = (size_t)m_sizeOfCD;
 
-	for (int i = 0; (int32_t)file.Tell() - ecdr.offsetOfStartOfCentralDirectory < ecdr.sizeOfTheCentralDirectory; ++i)
+	// Whole central directory is read at once and parsed from memory. Local headers are not touched here,
+	// offsets of the entries data are resolved lazily on the first open, see ResolveDataOffset.
+	std::vector<uint8_t> buffer;
+	const uint8_t* cd = ReadCentralDirectory(buffer);
+	if (cd == nullptr)
 	{
-		file.Read(header);
+		return false;
+	}
 
-		assert(header.centralFileHeaderSignature == ZIP_SIGNATURES::CENTRAL_DIRECTORY_FILE_HEADER);
+	uint32_t index = 0;
 
-		size_t currPos = file.Tell();
+	// Indices of the entries address the table of data offsets, so each one must be within it and used once
+	std::vector<bool> seen;
+	auto isValid = [&seen](const ZipEntryData& entry, uint64_t entryCount)
+	{
+		seen.resize((size_t)entryCount);
+		if (entry.index >= entryCount || seen[entry.index])
+		{
+			return false;
+		}
+		seen[entry.index] = true;
+		return true;
+	};
+	if (indexFile && filelist.LoadIndex(indexFile, GetIndexKey(cd), isValid))
+	{
+		m_indexed = true;
+		index = (uint32_t)filelist.GetSize();
+	}
 
-		file.Seek(header.relativeOffsetOfLocalHeader, File::Beginning);
+	std::string filename;
 
-		file.Read(fileHeader);
+	for (size_t pos = 0; !m_indexed && pos + sizeof(CentralDirectoryHeader) <= sizeOfCD; ++index)
+	{
+		CentralDirectoryHeader header;
+		memcpy(&header, cd + pos, sizeof(CentralDirectoryHeader));
+		pos += sizeof(CentralDirectoryHeader);
 
-		assert(fileHeader.localFileHeaderSignature == ZIP_SIGNATURES::LOCAL_HEADER);
+		if (header.centralFileHeaderSignature != ZIP_SIGNATURES::CENTRAL_DIRECTORY_FILE_HEADER)
+		{
+			return false;
+		}
 
-		filename.resize(fileHeader.fileNameLength);
+		if (pos + header.fileNameLength + header.extraFieldLength > sizeOfCD)
+		{
+			return false;
+		}
 
-		file.Read((uint8_t*)&filename[0], fileHeader.fileNameLength);
+		filename.assign((const char*)cd + pos, header.fileNameLength);
 
 		ZipEntryData entry;
 		entry.compressionMethod = header.compressionMethod;
 		entry.generalPurposeBitFlag = header.generalPurposBbitFlag;
 		entry.sizeUncompressed = header.dataDescriptor.uncompressedSize;
 		entry.sizeCompressed = header.dataDescriptor.compressedSize;
-		entry.offset = header.relativeOffsetOfLocalHeader + sizeof(fileHeader) + fileHeader.fileNameLength + fileHeader.extraFieldLength;
+		entry.localHeaderOffset = header.relativeOffsetOfLocalHeader;
+		entry.crc32 = header.dataDescriptor.CRC32;
+		entry.index = index;
+
+		if (!ReadZip64ExtraField(cd + pos + header.fileNameLength, header.extraFieldLength, header, entry))
+		{
+			return false;
+		}
 
 		filelist.Add(entry, filename);
 
-		file.Seek(currPos + header.fileNameLength + header.extraFieldLength + header.fileCommentLength, File::Beginning);
+		pos += header.fileNameLength + header.extraFieldLength + header.fileCommentLength;
+	}
+
+	m_dataOffsets.reset(new std::atomic<int64_t>[index]);
+	for (uint32_t i = 0; i < index; ++i)
+	{
+		m_dataOffsets[i].store(-1, std::memory_order_relaxed);
 	}
+
 	FileEntry<ZipEntryData> key("");
 	filelist.GetIndex(key);
 
 	return true;
 }
 
-File ZipReader::OpenFile(const fs::path& filepath)
+const uint8_t* ZipReader::ReadCentralDirectory(std::vector<uint8_t>& buffer)
 {
-	ZipEntryData entry = filelist.FindEntry(filepath);
-
-	if (entry.offset != -1)
+	const uint8_t* cd = file.GetDataPointer();
+	if (cd != nullptr)
 	{
-		switch (entry.compressionMethod)
-		{
-			case ZIP_COMPRESSION::NONE:
-			{
-				return new SubFile(file.GetInterface(), entry.sizeUncompressed, entry.offset);
-			}
-
-			case ZIP_COMPRESSION::DEFLATE:
-			{
-				auto* memfile = new MemRefFile();
-				memfile->Resize(entry.sizeUncompressed);
-				auto* uncompressedBuffer = memfile->GetDataPointer();
-				char* compressedBuffer = new char[entry.sizeCompressed];
-
-				{
-					File::LockGuard lock(file.GetInterface().get());
-					file.Seek(entry.offset, File::Beginning);
-					file.Read((uint8_t*)compressedBuffer, entry.sizeCompressed);
-				}
-
-				z_stream stream = {nullptr};
-				int32_t err;
-				stream.next_in = (Bytef*)compressedBuffer;
-				stream.avail_in = (uInt)entry.sizeCompressed;
-				stream.next_out = (Bytef*)uncompressedBuffer;
-				stream.avail_out = entry.sizeUncompressed;
-				stream.zalloc = (alloc_func)nullptr;
-				stream.zfree = (free_func)nullptr;
-
-				err = inflateInit2(&stream, -MAX_WBITS);
-				if (err == Z_OK)
-				{
-					err = inflate(&stream, Z_FINISH);
-					inflateEnd(&stream);
-					if (err == Z_STREAM_END)
-					{
-						err = Z_OK;
-					}
-					inflateEnd(&stream);
-				}
-
-				if (err != Z_OK)
-				{
-					delete[] compressedBuffer;
-					delete memfile;
-					return File();
-				}
-				else
-				{
-					delete[] compressedBuffer;
-					return memfile;
-				}
-			}
-
-			case ZIP_COMPRESSION::LZ4:
-			{
-				auto* memfile = new MemRefFile();
-				memfile->Resize(entry.sizeUncompressed);
-				auto* uncompressedBuffer = memfile->GetDataPointer();
+		return cd + m_offsetOfCD;
+	}
+	buffer.resize((size_t)m_sizeOfCD);
+	file.Seek((size_t)m_offsetOfCD, File::Beginning);
+	size_t bytesRead = 0;
+	file.Read(buffer.data(), buffer.size(), &bytesRead);
+	return bytesRead == buffer.size() ? buffer.data() : nullptr;
+}
 
-				char* compressedBuffer = new char[entry.sizeCompressed];
+FileListKey ZipReader::GetIndexKey(const uint8_t* cd)
+{
+	FileListKey key;
+	key.size = file.GetSize();
+	key.lastWriteTime = file.GetLastWriteTime();
+	key.hash = XXH64(cd, (size_t)m_sizeOfCD, 0);
+	return key;
+}
 
-				{
-					File::LockGuard lock(file.GetInterface().get());
-					file.Seek(entry.offset, File::Beginning);
-					file.Read((uint8_t*) compressedBuffer, entry.sizeCompressed);
-				}
+Status ZipReader::SaveIndex(File indexFile)
+{
+	std::vector<uint8_t> buffer;
+	const uint8_t* cd = ReadCentralDirectory(buffer);
+	if (cd == nullptr)
+	{
+		return false;
+	}
+	return filelist.SaveIndex(std::move(indexFile), GetIndexKey(cd));
+}
 
-				int b = LZ4_decompress_fast((const char*)compressedBuffer, (char*)uncompressedBuffer, entry.sizeUncompressed);
+bool ZipReader::IsIndexed() const
+{
+	return m_indexed;
+}
 
-				if (b <= 0)
-				{
-					delete[] compressedBuffer;
-					delete memfile;
-					return File();
-				}
-				else
-				{
-					delete[] compressedBuffer;
-					return memfile;
-				}
-			}
+bool ZipReader::FindEntry(const fs::path& filepath, ZipEntryData& entry)
+{
+	entry = filelist.FindEntry(filepath);
 
-			default:
-			{
-				return File();
-			}
-		}
+	if (entry.localHeaderOffset == -1)
+	{
+		return false;
 	}
 
-	return File();
+	return ResolveDataOffset(entry);
 }
 
-void* ZipReader::OpenFile(const fs::path& filepath, std::function<void*(size_t size)> alloc)
+bool ZipReader::ResolveDataOffset(ZipEntryData& entry)
 {
-	ZipEntryData entry = filelist.FindEntry(filepath);
+	int64_t offset = m_dataOffsets[entry.index].load(std::memory_order_acquire);
 
-	if (entry.offset != -1)
+	if (offset == -1)
 	{
-		switch (entry.compressionMethod)
-		{
-			case ZIP_COMPRESSION::NONE:
-			{
-				auto* data = alloc(entry.sizeUncompressed);
-				File::LockGuard lock(file.GetInterface().get());
-				file.Seek(entry.offset, File::Beginning);
-				file.Read((uint8_t*)data, entry.sizeUncompressed);
-				return data;
-			}
+		LocalFileHeader fileHeader;
 
-			case ZIP_COMPRESSION::DEFLATE:
+		const uint8_t* mapped = file.GetDataPointer();
+		if (mapped != nullptr)
+		{
+			if ((uint64_t)entry.localHeaderOffset + sizeof(LocalFileHeader) > m_archiveSize)
 			{
-				auto* uncompressedBuffer = alloc(entry.sizeUncompressed);
-				char* compressedBuffer = new char[entry.sizeCompressed];
-
-				{
-					File::LockGuard lock(file.GetInterface().get());
-					file.Seek(entry.offset, File::Beginning);
-					file.Read((uint8_t*) compressedBuffer, entry.sizeCompressed);
-				}
-
-				z_stream stream = {0};
-				int32_t err;
-				stream.next_in = (Bytef*)compressedBuffer;
-				stream.avail_in = (uInt)entry.sizeCompressed;
-				stream.next_out = (Bytef*)uncompressedBuffer;
-				stream.avail_out = entry.sizeUncompressed;
-				stream.zalloc = (alloc_func)nullptr;
-				stream.zfree = (free_func)nullptr;
-
-				err = inflateInit2(&stream, -MAX_WBITS);
-				if (err == Z_OK)
-				{
-					err = inflate(&stream, Z_FINISH);
-					inflateEnd(&stream);
-					if (err == Z_STREAM_END)
-					{
-						err = Z_OK;
-					}
-					inflateEnd(&stream);
-				}
-
-				if (err != Z_OK)
-				{
-					delete[] compressedBuffer;
-					return nullptr;
-				}
-				else
-				{
-					delete[] compressedBuffer;
-					return uncompressedBuffer;
-				}
+				return false;
 			}
-			default:
+			memcpy(&fileHeader, mapped + entry.localHeaderOffset, sizeof(LocalFileHeader));
+		}
+		else
+		{
+			size_t bytesRead = 0;
+			file.ReadAt(entry.localHeaderOffset, (uint8_t*)&fileHeader, sizeof(LocalFileHeader), &bytesRead);
+			if (bytesRead != sizeof(LocalFileHeader))
 			{
-				return nullptr;
+				return false;
 			}
 		}
+
+		return SetDataOffset(entry, fileHeader);
 	}
 
-	return nullptr;
+	entry.offset = offset;
+	return true;
 }
 
-bool ZipReader::Exists(const fs::path& filepath, PathType type)
+bool ZipReader::SetDataOffset(ZipEntryData& entry, const LocalFileHeader& fileHeader)
 {
-	std::string path = filepath.u8string();
-	if (path.back() != '/' && type == PathType::kDirectory)
+	if (fileHeader.localFileHeaderSignature != ZIP_SIGNATURES::LOCAL_HEADER)
 	{
-		path += "/";
+		return false;
 	}
 
-	FileEntry<ZipEntryData> key(path);
+	// Extra field of the local header may differ from the one in central directory, so it has to be read.
+	int64_t offset = entry.localHeaderOffset + sizeof(LocalFileHeader) + fileHeader.fileNameLength + fileHeader.extraFieldLength;
 
-	return filelist.Exists(key);
+	// Data of mapped archives is accessed directly, so sizes from central directory must not point past the end.
+	// Stored entries are read with their uncompressed size.
+	if (entry.compressionMethod == ZIP_COMPRESSION::NONE && entry.sizeCompressed != entry.sizeUncompressed)
+	{
+		return false;
+	}
+	if ((uint64_t)offset > m_archiveSize || entry.sizeCompressed > m_archiveSize - (uint64_t)offset)
+	{
+		return false;
+	}
+	m_dataOffsets[entry.index].store(offset, std::memory_order_release);
+	entry.offset = offset;
+	return true;
 }
 
-std::vector<std::string> ZipReader::ListDirectory(const fs::path& path)
+File ZipReader::OpenRawData(size_t offset, size_t size)
 {
-	return filelist.ListDirectory(path);
+	const uint8_t* data = file.GetDataPointer();
+	if (data != nullptr)
+	{
+		// Archive is mapped to memory. Return a view, that shares ownership of the mapping, and is read-only as the
+		// mapping is.
+		std::shared_ptr<uint8_t> view(file.GetInterface(), const_cast<uint8_t*>(data) + offset);
+		return new MemRefFile(view, size, true);
+	}
+	return new SubFile(file.GetInterface(), size, offset);
 }
 
-ZipWriter::ZipWriter(const File& file): m_file(file), m_currOffset(0), m_sizeOfCD(0)
+namespace
 {
-	file.Seek(0);
-}
+	std::atomic<size_t> scratchBufferLimit(ZipReader::kDefaultScratchBufferLimit);
 
-Status ZipWriter::AddFile(const fs::path& path, File file, int compression)
-{
-	int level = 9;
-	bool encrypt = false;
+	// Decompression state, that is kept per thread and reused across opens, so opening of small entries does not
+	// allocate or initialize zlib each time.
+	class DecompressionContext
+	{
+	public:
+		DecompressionContext(): m_streamInitialized(false), m_zstdContext(nullptr), m_scratchCapacity(0)
+		{
+			m_stream = z_stream();
+		}
+
+		~DecompressionContext()
+		{
+			if (m_streamInitialized)
+			{
+				inflateEnd(&m_stream);
+			}
+			ZSTD_freeDCtx(m_zstdContext);
+		}
 
-	std::shared_ptr<uint8_t> dataPointer = std::shared_ptr<uint8_t>(file.GetDataPointer(), null_deleter<uint8_t>);
+		// Returns raw inflate stream, that is ready for decompression of a new entry.
+		z_stream* GetInflateStream()
+		{
+			if (m_streamInitialized)
+			{
+				m_streamInitialized = inflateReset(&m_stream) == Z_OK;
+			}
+			else
+			{
+				m_stream.zalloc = (alloc_func)nullptr;
+				m_stream.zfree = (free_func)nullptr;
+				m_stream.next_in = nullptr;
+				m_stream.avail_in = 0;
+				m_streamInitialized = inflateInit2(&m_stream, -MAX_WBITS) == Z_OK;
+			}
+			// Reset keeps buffers of the previous entry, which are left set if its decompression failed
+			m_stream.next_in = nullptr;
+			m_stream.avail_in = 0;
+			m_stream.next_out = nullptr;
+			m_stream.avail_out = 0;
+			return m_streamInitialized ? &m_stream : nullptr;
+		}
 
-	int uncompressedSize = static_cast<int>(file.GetSize());
-	int compressedSize = uncompressedSize;
+		ZSTD_DCtx* GetZstdContext()
+		{
+			if (m_zstdContext == nullptr)
+			{
+				m_zstdContext = ZSTD_createDCtx();
+			}
+			return m_zstdContext;
+		}
 
-	if (!dataPointer)
-	{
-		dataPointer.reset(new uint8_t[uncompressedSize]);
-		file.Read(dataPointer.get(), uncompressedSize);
-	}
+		// Returns buffer of at least the given size, or nullptr if size exceeds the limit. Buffer only grows,
+		// unless the limit was lowered since it was allocated.
+		uint8_t* GetScratchBuffer(size_t size)
+		{
+			size_t limit = scratchBufferLimit.load(std::memory_order_relaxed);
+			if (m_scratchCapacity > limit)
+			{
+				m_scratch.reset();
+				m_scratchCapacity = 0;
+			}
+			if (size > limit)
+			{
+				return nullptr;
+			}
+			if (size > m_scratchCapacity)
+			{
+				m_scratch.reset();
+				m_scratch.reset(new uint8_t[size]);
+				m_scratchCapacity = size;
+			}
+			return m_scratch.get();
+		}
+
+	private:
+		z_stream m_stream;
+		bool m_streamInitialized;
+		ZSTD_DCtx* m_zstdContext;
+		std::unique_ptr<uint8_t[]> m_scratch;
+		size_t m_scratchCapacity;
+	};
 
-	std::shared_ptr<uint8_t> dataPointerCompressed;
+	thread_local DecompressionContext decompressionContext;
 
-	if (compression == ZIP_COMPRESSION::LZ4)
+	bool InflateBuffer(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize)
 	{
-		int bound = LZ4_compressBound(uncompressedSize);
+		z_stream* stream = decompressionContext.GetInflateStream();
+		if (stream == nullptr)
+		{
+			return false;
+		}
 
-		dataPointerCompressed.reset(new uint8_t[bound]);
-		memset(dataPointerCompressed.get(), 0, bound);
-		if (uncompressedSize > 0)
+		// Sizes of zlib are 32 bit, so large buffers are fed in chunks
+		int err = Z_OK;
+		while (err == Z_OK)
 		{
-			compressedSize = LZ4_compressHC2((const char*)dataPointer.get(), (char*)dataPointerCompressed.get(), uncompressedSize, level);
+			if (stream->avail_in == 0)
+			{
+				stream->next_in = (Bytef*)src;
+				stream->avail_in = (uInt)std::min(srcSize, (size_t)UINT_MAX);
+				src += stream->avail_in;
+				srcSize -= stream->avail_in;
+			}
+			if (stream->avail_out == 0)
+			{
+				stream->next_out = (Bytef*)dst;
+				stream->avail_out = (uInt)std::min(dstSize, (size_t)UINT_MAX);
+				dst += stream->avail_out;
+				dstSize -= stream->avail_out;
+			}
+			err = inflate(stream, Z_NO_FLUSH);
+			if (err == Z_BUF_ERROR && ((stream->avail_in == 0 && srcSize != 0) || (stream->avail_out == 0 && dstSize != 0)))
+			{
+				// Next chunk is fed on the next iteration
+				err = Z_OK;
+			}
 		}
+		return err == Z_STREAM_END && dstSize == 0 && stream->avail_out == 0;
 	}
-	else if (compression == ZIP_COMPRESSION::DEFLATE)
+
+	enum : uint32_t
+	{
+		kLZ4FrameMagic = 0x184D2204,
+		kLZ4BlockUncompressedFlag = 0x80000000,
+		kLZ4DictionarySize = 64 * 1024
+	};
+
+	struct LZ4Block
 	{
-		z_stream stream;
+		const uint8_t* data;
+		uint32_t size;
+		bool compressed;
+	};
 
-		stream.next_in = (Bytef*)dataPointer.get();
-		stream.avail_in = (uInt)uncompressedSize;
-		stream.zalloc = (alloc_func)nullptr;
-		stream.zfree = (free_func)nullptr;
+	// Returns number of decoded bytes or negative value on error. Output is never written beyond capacity.
+	int DecodeLZ4Block(const LZ4Block& block, uint8_t* dst, size_t capacity, const uint8_t* dictionary = nullptr, size_t dictionarySize = 0)
+	{
+		capacity = std::min(capacity, (size_t)INT_MAX);
+		if (!block.compressed)
+		{
+			if (block.size > capacity)
+			{
+				return -1;
+			}
+			memcpy(dst, block.data, block.size);
+			return (int)block.size;
+		}
+		if (dictionarySize != 0)
+		{
+			return LZ4_decompress_safe_usingDict((const char*)block.data, (char*)dst, (int)block.size, (int)capacity, (const char*)dictionary, (int)dictionarySize);
+		}
+		return LZ4_decompress_safe((const char*)block.data, (char*)dst, (int)block.size, (int)capacity);
+	}
 
-		int err = deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, level, Z_DEFAULT_STRATEGY);
-		if (err != Z_OK)
+	bool DecompressZstd(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize)
+	{
+		ZSTD_DCtx* context = decompressionContext.GetZstdContext();
+		if (context == nullptr)
 		{
 			return false;
 		}
+		size_t result = ZSTD_decompressDCtx(context, dst, dstSize, src, srcSize);
+		return !ZSTD_isError(result) && result == dstSize;
+	}
 
-		int bound = deflateBound(&stream, uncompressedSize);
-		dataPointerCompressed.reset(new uint8_t[bound]);
-		memset(dataPointerCompressed.get(), 0, bound);
-		stream.next_out = (Bytef*)dataPointerCompressed.get();
-		stream.avail_out = bound;
-		err = deflate(&stream, Z_FINISH);
-		if (err != Z_STREAM_END)
+	// Decodes LZ4 frame. Content and block checksums are not verified, since entry has its own CRC32.
+	// Independent blocks of a frame are decoded in parallel, if all of them except the last one are full.
+	bool DecompressLZ4Frame(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize)
+	{
+		size_t pos = 4;
+		if (srcSize < pos + 3)
 		{
 			return false;
 		}
-		err = deflateEnd(&stream);
-		if (err != Z_OK)
+		uint8_t flags = src[pos];
+		uint8_t blockDescriptor = src[pos + 1];
+		pos += 2;
+
+		bool independent = (flags & 0x20) != 0;
+		bool blockChecksum = (flags & 0x10) != 0;
+		bool hasContentSize = (flags & 0x08) != 0;
+		bool hasDictionaryID = (flags & 0x01) != 0;
+		int blockSizeID = (blockDescriptor >> 4) & 7;
+		if ((flags >> 6) != 1 || hasDictionaryID || blockSizeID < 4)
 		{
 			return false;
 		}
-		compressedSize = stream.total_out;
-	}
+		size_t blockMax = (size_t)1 << (8 + 2 * blockSizeID);
 
-	CentralDirectoryHeader header = {0};
-	LocalFileHeader fileHeader = {0};
+		if (hasContentSize)
+		{
+			uint64_t contentSize = 0;
+			if (srcSize < pos + sizeof(contentSize) + 1)
+			{
+				return false;
+			}
+			memcpy(&contentSize, src + pos, sizeof(contentSize));
+			if (contentSize != dstSize)
+			{
+				return false;
+			}
+			pos += sizeof(contentSize);
+		}
+
+		// Header checksum
+		pos += 1;
+
+		std::vector<LZ4Block> blocks;
+		while (true)
+		{
+			uint32_t blockSize = 0;
+			if (srcSize - pos < sizeof(blockSize))
+			{
+				return false;
+			}
+			memcpy(&blockSize, src + pos, sizeof(blockSize));
+			pos += sizeof(blockSize);
+			if (blockSize == 0)
+			{
+				break;
+			}
+			LZ4Block block;
+			block.compressed = (blockSize & kLZ4BlockUncompressedFlag) == 0;
+			block.size = blockSize & ~kLZ4BlockUncompressedFlag;
+			block.data = src + pos;
+			size_t blockEnd = block.size + (blockChecksum ? 4 : 0);
+			if (block.size > blockMax || srcSize - pos < blockEnd)
+			{
+				return false;
+			}
+			pos += blockEnd;
+			blocks.push_back(block);
+		}
+
+		size_t count = blocks.size();
+		if (independent && count > 1 && (count - 1) * blockMax < dstSize && dstSize <= count * blockMax)
+		{
+			std::atomic<bool> ok(true);
+			ThreadPool::GetDefault().ParallelFor(count, [&](size_t i)
+			{
+				size_t offset = i * blockMax;
+				size_t expected = std::min(blockMax, dstSize - offset);
+				if (DecodeLZ4Block(blocks[i], dst + offset, expected) != (int)expected)
+				{
+					ok = false;
+				}
+			});
+			if (ok)
+			{
+				return true;
+			}
+			// Blocks are not full, so their output offsets are not known in advance. Falling back to sequential decoding.
+		}
+
+		size_t offset = 0;
+		for (const LZ4Block& block: blocks)
+		{
+			size_t capacity = std::min(blockMax, dstSize - offset);
+			size_t dictionarySize = independent ? 0 : std::min(offset, (size_t)kLZ4DictionarySize);
+			int decoded = DecodeLZ4Block(block, dst + offset, capacity, dst + offset - dictionarySize, dictionarySize);
+			if (decoded < 0)
+			{
+				return false;
+			}
+			offset += decoded;
+		}
+		return offset == dstSize;
+	}
+
+	// Entry data is either a frame, or a single raw LZ4 block, written by older versions. Raw block can not start
+	// with the frame magic number, since it would begin with a match, that references data before the output.
+	bool DecompressLZ4(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstSize)
+	{
+		uint32_t magic = 0;
+		if (srcSize >= sizeof(magic))
+		{
+			memcpy(&magic, src, sizeof(magic));
+		}
+		if (magic == kLZ4FrameMagic)
+		{
+			return DecompressLZ4Frame(src, srcSize, dst, dstSize);
+		}
+		if (srcSize > LZ4_MAX_INPUT_SIZE || dstSize > LZ4_MAX_INPUT_SIZE)
+		{
+			return false;
+		}
+		return LZ4_decompress_safe((const char*)src, (char*)dst, (int)srcSize, (int)dstSize) == (int)dstSize;
+	}
+}
+
+void ZipReader::SetScratchBufferLimit(size_t size)
+{
+	scratchBufferLimit.store(size, std::memory_order_relaxed);
+}
+
+const uint8_t* ZipReader::ReadCompressedData(const ZipEntryData& entry, std::unique_ptr<uint8_t[]>& buffer)
+{
+	const uint8_t* mapped = file.GetDataPointer();
+	if (mapped != nullptr)
+	{
+		return mapped + entry.offset;
+	}
+
+	uint8_t* data = decompressionContext.GetScratchBuffer(entry.sizeCompressed);
+	if (data == nullptr)
+	{
+		buffer.reset(new uint8_t[entry.sizeCompressed]);
+		data = buffer.get();
+	}
+	size_t bytesRead = 0;
+	file.ReadAt(entry.offset, data, entry.sizeCompressed, &bytesRead);
+	return bytesRead == entry.sizeCompressed ? data : nullptr;
+}
+
+bool ZipReader::Decompress(const ZipEntryData& entry, uint8_t* dst)
+{
+	std::unique_ptr<uint8_t[]> compressedBuffer;
+	const uint8_t* compressedData = ReadCompressedData(entry, compressedBuffer);
+	if (compressedData == nullptr)
+	{
+		return false;
+	}
+	return DecompressData(entry, compressedData, dst);
+}
+
+bool ZipReader::DecompressData(const ZipEntryData& entry, const uint8_t* compressedData, uint8_t* dst)
+{
+	bool result = false;
+	switch (entry.compressionMethod)
+	{
+		case ZIP_COMPRESSION::DEFLATE:
+			result = InflateBuffer(compressedData, entry.sizeCompressed, dst, entry.sizeUncompressed);
+			break;
+		case ZIP_COMPRESSION::LZ4:
+			result = DecompressLZ4(compressedData, entry.sizeCompressed, dst, entry.sizeUncompressed);
+			break;
+		case ZIP_COMPRESSION::ZSTD:
+			result = DecompressZstd(compressedData, entry.sizeCompressed, dst, entry.sizeUncompressed);
+			break;
+	}
+	return result && (!m_verifyCrc || Crc32(0, dst, entry.sizeUncompressed) == entry.crc32);
+}
+
+bool ZipReader::VerifyEntry(ZipEntryData entry)
+{
+	if (!ResolveDataOffset(entry))
+	{
+		return false;
+	}
+
+	const uint8_t* mapped = file.GetDataPointer();
+	if (entry.compressionMethod == ZIP_COMPRESSION::NONE && mapped != nullptr)
+	{
+		return Crc32(0, mapped + entry.offset, entry.sizeUncompressed) == entry.crc32;
+	}
+
+	if (entry.compressionMethod == ZIP_COMPRESSION::NONE || entry.compressionMethod == ZIP_COMPRESSION::DEFLATE)
+	{
+		// Read in chunks, so large entries do not have to fit in memory
+		File data = OpenRawData(entry.offset, entry.sizeCompressed);
+		if (entry.compressionMethod == ZIP_COMPRESSION::DEFLATE)
+		{
+			data = new InflateFile(data, entry.sizeUncompressed);
+		}
+		std::unique_ptr<uint8_t[]> buffer(new uint8_t[InflateFile::kInputBufferSize]);
+		uint32_t crc = 0;
+		for (size_t position = 0; position < entry.sizeUncompressed;)
+		{
+			size_t chunk = std::min(entry.sizeUncompressed - position, (size_t)InflateFile::kInputBufferSize);
+			size_t bytesRead = 0;
+			if (!data.Read(buffer.get(), chunk, &bytesRead) || bytesRead != chunk)
+			{
+				return false;
+			}
+			crc = Crc32(crc, buffer.get(), chunk);
+			position += chunk;
+		}
+		return crc == entry.crc32;
+	}
+
+	std::unique_ptr<uint8_t[]> buffer(new uint8_t[entry.sizeUncompressed]);
+	// Decompress verifies checksum itself, if verification on open is enabled
+	return Decompress(entry, buffer.get()) && (m_verifyCrc || Crc32(0, buffer.get(), entry.sizeUncompressed) == entry.crc32);
+}
+
+Status ZipReader::VerifyArchive(std::vector<std::string>* corruptedEntries)
+{
+	bool result = true;
+	filelist.ForEach([&](const std::string& path, const ZipEntryData& entry)
+	{
+		if (!VerifyEntry(entry))
+		{
+			result = false;
+			if (corruptedEntries != nullptr)
+			{
+				corruptedEntries->push_back(path);
+			}
+		}
+	});
+	return result;
+}
+
+void ZipReader::SetVerifyCrc(bool verify)
+{
+	m_verifyCrc = verify;
+}
+
+File ZipReader::OpenFile(const fs::path& filepath)
+{
+	ZipEntryData entry;
+
+	if (FindEntry(filepath, entry))
+	{
+		return OpenEntry(entry);
+	}
+
+	return File();
+}
+
+size_t ZipReader::Prefetch(const std::vector<fs::path>& paths, bool decompress)
+{
+	std::vector<ZipEntryData> entries;
+	entries.reserve(paths.size());
+	for (auto& filepath: paths)
+	{
+		ZipEntryData entry = filelist.FindEntry(filepath);
+		if (entry.localHeaderOffset != -1)
+		{
+			entries.push_back(entry);
+		}
+	}
+	std::sort(entries.begin(), entries.end(), [](const ZipEntryData& a, const ZipEntryData& b)
+	{
+		return a.localHeaderOffset < b.localHeaderOffset;
+	});
+	entries.erase(std::unique(entries.begin(), entries.end(), [](const ZipEntryData& a, const ZipEntryData& b)
+	{
+		return a.localHeaderOffset == b.localHeaderOffset;
+	}), entries.end());
+
+	// Reading a small gap costs less than a separate request, so entries, that are closer than that, are advised as
+	// one range. Until the local header is read, the name and the extra field are assumed to fit in the slack.
+	const size_t kMaxGap = 64 * 1024;
+	const size_t kHeaderSlack = 4 * 1024;
+	size_t rangeBegin = 0;
+	size_t rangeEnd = 0;
+	for (auto& entry: entries)
+	{
+		int64_t dataOffset = m_dataOffsets[entry.index].load(std::memory_order_acquire);
+		size_t begin = (size_t)entry.localHeaderOffset;
+		size_t end = (dataOffset != -1 ? (size_t)dataOffset : begin + sizeof(LocalFileHeader) + kHeaderSlack) + entry.sizeCompressed;
+		if (rangeEnd != rangeBegin && begin <= rangeEnd + kMaxGap)
+		{
+			rangeEnd = std::max(rangeEnd, end);
+			continue;
+		}
+		if (rangeEnd != rangeBegin)
+		{
+			file.Prefetch(rangeBegin, rangeEnd - rangeBegin);
+		}
+		rangeBegin = begin;
+		rangeEnd = end;
+	}
+	if (rangeEnd != rangeBegin)
+	{
+		file.Prefetch(rangeBegin, rangeEnd - rangeBegin);
+	}
+
+	std::vector<ZipEntryData> compressed;
+	size_t budget = m_cache.GetBudget();
+	for (auto& entry: entries)
+	{
+		if (!ResolveDataOffset(entry))
+		{
+			continue;
+		}
+		if (decompress && budget != 0 && entry.compressionMethod != ZIP_COMPRESSION::NONE && !IsStreamed(entry) && entry.sizeUncompressed <= budget)
+		{
+			compressed.push_back(entry);
+		}
+	}
+
+	// Opening puts the entry to the cache, or only touches it if it is cached already
+	ThreadPool::GetDefault().ParallelFor(compressed.size(), [this, &compressed](size_t i)
+	{
+		OpenEntry(compressed[i]);
+	});
+
+	return entries.size();
+}
+
+bool ZipReader::IsStreamed(const ZipEntryData& entry) const
+{
+	if (entry.compressionMethod != ZIP_COMPRESSION::DEFLATE)
+	{
+		return false;
+	}
+	bool indexed = m_checkpointSpan != 0 && entry.sizeUncompressed > m_checkpointSpan;
+	return entry.sizeUncompressed >= m_streamingThreshold || indexed;
+}
+
+File ZipReader::OpenEntry(const ZipEntryData& entry)
+{
+	switch (entry.compressionMethod)
+	{
+		case ZIP_COMPRESSION::NONE:
+		{
+			const uint8_t* mapped = file.GetDataPointer();
+			if (m_verifyCrc && mapped != nullptr && Crc32(0, mapped + entry.offset, entry.sizeUncompressed) != entry.crc32)
+			{
+				return File();
+			}
+			return OpenRawData(entry.offset, entry.sizeUncompressed);
+		}
+
+		case ZIP_COMPRESSION::DEFLATE:
+		{
+			if (IsStreamed(entry))
+			{
+				bool indexed = m_checkpointSpan != 0 && entry.sizeUncompressed > m_checkpointSpan;
+				DeflateIndexPtr index = indexed ? GetDeflateIndex(entry) : nullptr;
+				auto* inflatefile = new InflateFile(OpenRawData(entry.offset, entry.sizeCompressed), entry.sizeUncompressed, index);
+				if (!inflatefile->ok())
+				{
+					delete inflatefile;
+					return File();
+				}
+				return inflatefile;
+			}
+		}
+		// fallthrough
+		case ZIP_COMPRESSION::LZ4:
+		case ZIP_COMPRESSION::ZSTD:
+		{
+			size_t size = 0;
+			std::shared_ptr<uint8_t> cached = m_cache.Get(entry.localHeaderOffset, size);
+			if (cached)
+			{
+				// Buffer is shared by all opens of the entry
+				return new MemRefFile(cached, size, true);
+			}
+
+			std::unique_ptr<uint8_t[]> compressedBuffer;
+			const uint8_t* compressedData = ReadCompressedData(entry, compressedBuffer);
+			if (compressedData == nullptr)
+			{
+				return File();
+			}
+			return DecompressToMemory(entry, compressedData);
+		}
+
+		default:
+		{
+			return File();
+		}
+	}
+}
+
+File ZipReader::DecompressToMemory(const ZipEntryData& entry, const uint8_t* compressedData)
+{
+	size_t budget = m_cache.GetBudget();
+	if (budget != 0 && entry.sizeUncompressed <= budget)
+	{
+		std::shared_ptr<uint8_t> buffer(new uint8_t[entry.sizeUncompressed], std::default_delete<uint8_t[]>());
+		if (!DecompressData(entry, compressedData, buffer.get()))
+		{
+			return File();
+		}
+		m_cache.Put(entry.localHeaderOffset, buffer, entry.sizeUncompressed);
+		return new MemRefFile(buffer, entry.sizeUncompressed, true);
+	}
+
+	auto* memfile = new MemRefFile();
+	memfile->Resize(entry.sizeUncompressed);
+	if (!DecompressData(entry, compressedData, memfile->GetDataPointer()))
+	{
+		delete memfile;
+		return File();
+	}
+	return memfile;
+}
+
+AsyncResult<File> ZipReader::OpenFileAsync(const fs::path& filepath, AsyncEngine& engine)
+{
+	AsyncResult<File> result;
+
+	ZipEntryData entry = filelist.FindEntry(filepath);
+	if (entry.localHeaderOffset == -1)
+	{
+		result.Complete(false, File());
+		return result;
+	}
+
+	// Offset of the data is either cached or is taken from the mapping, so no read is needed
+	if (m_dataOffsets[entry.index].load(std::memory_order_acquire) != -1 || file.GetDataPointer() != nullptr)
+	{
+		if (!ResolveDataOffset(entry))
+		{
+			result.Complete(false, File());
+			return result;
+		}
+		OpenEntryAsync(entry, engine, result);
+		return result;
+	}
+
+	std::shared_ptr<LocalFileHeader> header = std::make_shared<LocalFileHeader>();
+	engine.Read(file, entry.localHeaderOffset, (uint8_t*)header.get(), sizeof(LocalFileHeader)).Then([this, entry, header, &engine, result](Status status, size_t bytesRead) mutable
+	{
+		if (result.Cancelled())
+		{
+			result.Complete(false, File());
+			return;
+		}
+		if (bytesRead != sizeof(LocalFileHeader) || !SetDataOffset(entry, *header))
+		{
+			result.Complete(false, File());
+			return;
+		}
+		OpenEntryAsync(entry, engine, result);
+	});
+	return result;
+}
+
+void ZipReader::OpenEntryAsync(const ZipEntryData& entry, AsyncEngine& engine, AsyncResult<File> result)
+{
+	ThreadPool& pool = engine.GetThreadPool();
+	bool mapped = file.GetDataPointer() != nullptr;
+	bool decompressed = entry.compressionMethod == ZIP_COMPRESSION::DEFLATE || entry.compressionMethod == ZIP_COMPRESSION::LZ4 || entry.compressionMethod == ZIP_COMPRESSION::ZSTD;
+
+	if (entry.compressionMethod == ZIP_COMPRESSION::NONE && !(m_verifyCrc && mapped))
+	{
+		// Stored entry is a view of the archive, reading it is up to the caller
+		File opened = OpenRawData(entry.offset, entry.sizeUncompressed);
+		result.Complete(true, opened);
+		return;
+	}
+
+	if (!decompressed || IsStreamed(entry) || mapped)
+	{
+		// Work is decompression or verification, or it is done on demand while the file is read
+		pool.Push([this, entry, result]()
+		{
+			if (result.Cancelled())
+			{
+				result.Complete(false, File());
+				return;
+			}
+			File opened = OpenEntry(entry);
+			result.Complete(opened ? Status(true) : Status(false), opened);
+		});
+		return;
+	}
+
+	size_t size = 0;
+	std::shared_ptr<uint8_t> cached = m_cache.Get(entry.localHeaderOffset, size);
+	if (cached)
+	{
+		result.Complete(true, File(new MemRefFile(cached, size, true)));
+		return;
+	}
+
+	// Compressed data is read asynchronously, and then decompressed on the pool
+	if (result.Cancelled())
+	{
+		result.Complete(false, File());
+		return;
+	}
+	std::shared_ptr<uint8_t> compressed(new uint8_t[entry.sizeCompressed], std::default_delete<uint8_t[]>());
+	engine.Read(file, entry.offset, compressed.get(), entry.sizeCompressed).Then([this, entry, compressed, &pool, result](Status status, size_t bytesRead)
+	{
+		if (result.Cancelled())
+		{
+			result.Complete(false, File());
+			return;
+		}
+		if (bytesRead != entry.sizeCompressed)
+		{
+			result.Complete(false, File());
+			return;
+		}
+		pool.Push([this, entry, compressed, result]()
+		{
+			if (result.Cancelled())
+			{
+				result.Complete(false, File());
+				return;
+			}
+			File opened = DecompressToMemory(entry, compressed.get());
+			result.Complete(opened ? Status(true) : Status(false), opened);
+		});
+	});
+}
+
+void* ZipReader::OpenFile(const fs::path& filepath, std::function<void*(size_t size)> alloc)
+{
+	size_t size = 0;
+	if (!GetFileSize(filepath, size))
+	{
+		return nullptr;
+	}
+	auto* data = alloc(size);
+	return ReadFile(filepath, (uint8_t*)data, size) ? data : nullptr;
+}
+
+Status ZipReader::GetFileSize(const fs::path& filepath, size_t& size)
+{
+	ZipEntryData entry = filelist.FindEntry(filepath);
+	if (entry.localHeaderOffset == -1)
+	{
+		return false;
+	}
+	size = entry.sizeUncompressed;
+	return true;
+}
+
+Status ZipReader::ReadFile(const fs::path& filepath, uint8_t* dst, size_t size)
+{
+	ZipEntryData entry;
+
+	if (!FindEntry(filepath, entry) || entry.sizeUncompressed > size)
+	{
+		return false;
+	}
+
+	switch (entry.compressionMethod)
+	{
+		case ZIP_COMPRESSION::NONE:
+		{
+			const uint8_t* mapped = file.GetDataPointer();
+			if (mapped != nullptr)
+			{
+				memcpy(dst, mapped + entry.offset, entry.sizeUncompressed);
+			}
+			else
+			{
+				size_t bytesRead = 0;
+				file.ReadAt(entry.offset, dst, entry.sizeUncompressed, &bytesRead);
+				if (bytesRead != entry.sizeUncompressed)
+				{
+					return false;
+				}
+			}
+			return !m_verifyCrc || Crc32(0, dst, entry.sizeUncompressed) == entry.crc32;
+		}
+
+		case ZIP_COMPRESSION::DEFLATE:
+		case ZIP_COMPRESSION::LZ4:
+		case ZIP_COMPRESSION::ZSTD:
+		{
+			size_t cachedSize = 0;
+			std::shared_ptr<uint8_t> cached = m_cache.Get(entry.localHeaderOffset, cachedSize);
+			if (cached)
+			{
+				memcpy(dst, cached.get(), cachedSize);
+				return true;
+			}
+			return Decompress(entry, dst);
+		}
+	}
+
+	return false;
+}
+
+bool ZipReader::Exists(const fs::path& filepath, PathType type)
+{
+	std::string path = filepath.u8string();
+	if (path.back() != '/' && type == PathType::kDirectory)
+	{
+		path += "/";
+	}
+
+	FileEntry<ZipEntryData> key(path);
+
+	return filelist.Exists(key);
+}
+
+std::vector<std::string> ZipReader::ListDirectory(const fs::path& path)
+{
+	return filelist.ListDirectory(path);
+}
+
+bool ZipReader::ForEachEntry(const std::function<void(const std::string& path)>& f)
+{
+	filelist.ForEach([&f](const std::string& path, const ZipEntryData&)
+	{
+		f(path);
+	});
+	return true;
+}
+
+void ZipReader::SetStreamingThreshold(size_t size)
+{
+	m_streamingThreshold = size;
+}
+
+void ZipReader::SetCacheBudget(size_t size)
+{
+	m_cache.SetBudget(size);
+}
+
+void ZipReader::TrimCache(size_t size)
+{
+	m_cache.Trim(size);
+}
+
+void ZipReader::SetCheckpointSpan(size_t span)
+{
+	m_checkpointSpan = span;
+}
+
+DeflateIndexPtr ZipReader::GetDeflateIndex(const ZipEntryData& entry)
+{
+	std::lock_guard<std::mutex> lock(m_deflateIndicesMutex);
+	auto it = m_deflateIndices.find(entry.localHeaderOffset);
+	if (it != m_deflateIndices.end()
+		&& it->second.sizeCompressed == entry.sizeCompressed
+		&& it->second.sizeUncompressed == entry.sizeUncompressed)
+	{
+		return it->second.index;
+	}
+	DeflateIndexEntry& indexEntry = m_deflateIndices[entry.localHeaderOffset];
+	indexEntry.sizeCompressed = entry.sizeCompressed;
+	indexEntry.sizeUncompressed = entry.sizeUncompressed;
+	indexEntry.index = std::make_shared<DeflateIndex>(m_checkpointSpan);
+	return indexEntry.index;
+}
+
+namespace
+{
+	enum
+	{
+		kDeflateIndexMagic = 0x49444d46, // "FMDI"
+		kDeflateIndexVersion = 2
+	};
+}
+
+Status ZipReader::SaveDeflateIndex(File indexFile)
+{
+	std::vector<uint8_t> buffer;
+	const uint8_t* cd = ReadCentralDirectory(buffer);
+	if (cd == nullptr)
+	{
+		return false;
+	}
+	FileListKey key = GetIndexKey(cd);
+
+	FileStream stream(indexFile);
+
+	std::lock_guard<std::mutex> lock(m_deflateIndicesMutex);
+
+	uint32_t magic = kDeflateIndexMagic;
+	uint32_t version = kDeflateIndexVersion;
+	uint64_t count = m_deflateIndices.size();
+	stream << magic;
+	stream << version;
+	stream << key.size;
+	stream << key.lastWriteTime;
+	stream << key.hash;
+	stream << count;
+
+	for (auto& it: m_deflateIndices)
+	{
+		uint64_t localHeaderOffset = it.first;
+		uint64_t sizeCompressed = it.second.sizeCompressed;
+		uint64_t sizeUncompressed = it.second.sizeUncompressed;
+		uint64_t span = it.second.index->GetSpan();
+		auto checkpoints = it.second.index->GetCheckpoints();
+		uint64_t checkpointCount = checkpoints.size();
+
+		stream << localHeaderOffset;
+		stream << sizeCompressed;
+		stream << sizeUncompressed;
+		stream << span;
+		stream << checkpointCount;
+		for (auto& checkpoint: checkpoints)
+		{
+			stream << checkpoint->out;
+			stream << checkpoint->in;
+			stream << checkpoint->bits;
+			uint32_t windowSize = (uint32_t)checkpoint->window.size();
+			stream << windowSize;
+			indexFile.Write(checkpoint->window.data(), windowSize);
+		}
+	}
+	return indexFile.Flush();
+}
+
+Status ZipReader::LoadDeflateIndex(File indexFile)
+{
+	std::vector<uint8_t> buffer;
+	const uint8_t* cd = ReadCentralDirectory(buffer);
+	if (cd == nullptr)
+	{
+		return false;
+	}
+	FileListKey expectedKey = GetIndexKey(cd);
+
+	// Counts are checked against the rest of the file, so a truncated or corrupted index fails instead of being
+	// read as zeros
+	size_t remaining = indexFile.GetSize() - std::min(indexFile.Tell(), indexFile.GetSize());
+	auto read = [&indexFile, &remaining](void* dst, size_t size)
+	{
+		if (size > remaining)
+		{
+			return false;
+		}
+		size_t bytesRead = 0;
+		indexFile.Read((uint8_t*)dst, size, &bytesRead);
+		remaining -= std::min(bytesRead, remaining);
+		return bytesRead == size;
+	};
+
+	uint32_t magic = 0;
+	uint32_t version = 0;
+	FileListKey key;
+	uint64_t count = 0;
+	bool ok = read(&magic, sizeof(magic)) && read(&version, sizeof(version));
+	ok = ok && read(&key.size, sizeof(key.size)) && read(&key.lastWriteTime, sizeof(key.lastWriteTime)) && read(&key.hash, sizeof(key.hash));
+	ok = ok && read(&count, sizeof(count));
+
+	if (!ok || magic != kDeflateIndexMagic || version != kDeflateIndexVersion)
+	{
+		return false;
+	}
+	if (key.size != expectedKey.size || key.lastWriteTime != expectedKey.lastWriteTime || key.hash != expectedKey.hash)
+	{
+		return false;
+	}
+
+	// Smallest records, that an entry and a checkpoint take in the file
+	const size_t kEntrySize = 5 * sizeof(uint64_t);
+	const size_t kCheckpointSize = 2 * sizeof(uint64_t) + sizeof(int32_t) + sizeof(uint32_t);
+	if (count > remaining / kEntrySize)
+	{
+		return false;
+	}
+
+	std::map<int64_t, DeflateIndexEntry> indices;
+
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		uint64_t localHeaderOffset = 0;
+		uint64_t sizeCompressed = 0;
+		uint64_t sizeUncompressed = 0;
+		uint64_t span = 0;
+		uint64_t checkpointCount = 0;
+		ok = read(&localHeaderOffset, sizeof(localHeaderOffset)) && read(&sizeCompressed, sizeof(sizeCompressed));
+		ok = ok && read(&sizeUncompressed, sizeof(sizeUncompressed)) && read(&span, sizeof(span));
+		ok = ok && read(&checkpointCount, sizeof(checkpointCount));
+
+		if (!ok || localHeaderOffset > key.size || checkpointCount > sizeUncompressed / std::max(span, (uint64_t)1) + 1)
+		{
+			return false;
+		}
+		if (checkpointCount > remaining / kCheckpointSize)
+		{
+			return false;
+		}
+
+		DeflateIndexEntry& indexEntry = indices[localHeaderOffset];
+		indexEntry.sizeCompressed = sizeCompressed;
+		indexEntry.sizeUncompressed = sizeUncompressed;
+		indexEntry.index = std::make_shared<DeflateIndex>(span);
+
+		for (uint64_t j = 0; j < checkpointCount; ++j)
+		{
+			auto checkpoint = std::make_shared<DeflateIndex::Checkpoint>();
+			uint32_t windowSize = 0;
+			ok = read(&checkpoint->out, sizeof(checkpoint->out)) && read(&checkpoint->in, sizeof(checkpoint->in));
+			ok = ok && read(&checkpoint->bits, sizeof(checkpoint->bits)) && read(&windowSize, sizeof(windowSize));
+			if (!ok || checkpoint->bits < 0 || checkpoint->bits > 7 || windowSize > 32768)
+			{
+				return false;
+			}
+			checkpoint->window.resize(windowSize);
+			if (!read(checkpoint->window.data(), windowSize))
+			{
+				return false;
+			}
+			indexEntry.index->Add(checkpoint);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(m_deflateIndicesMutex);
+	for (auto& it: indices)
+	{
+		m_deflateIndices[it.first] = it.second;
+	}
+	return true;
+}
+
+namespace
+{
+	// Incremental compressor with fixed size output buffer. Compress consumes all input and calls write for each
+	// produced chunk of output. Finish flushes the rest of the stream.
+	class StreamCompressor
+	{
+	public:
+		enum
+		{
+			kOutputBufferSize = 256 * 1024
+		};
+
+		typedef std::function<bool(const uint8_t* data, size_t size)> WriteFunc;
+
+		StreamCompressor(int compression, int level, uint64_t uncompressedSize):
+			m_compression(compression), m_ok(false), m_lz4(nullptr), m_zstd(nullptr)
+		{
+			m_deflate = z_stream();
+			if (compression == ZIP_COMPRESSION::NONE)
+			{
+				m_ok = true;
+			}
+			else if (compression == ZIP_COMPRESSION::DEFLATE)
+			{
+				m_ok = deflateInit2(&m_deflate, level, Z_DEFLATED, -MAX_WBITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK;
+				m_output.resize(kOutputBufferSize);
+			}
+			else if (compression == ZIP_COMPRESSION::LZ4)
+			{
+				m_lz4Preferences = LZ4F_INIT_PREFERENCES;
+				m_lz4Preferences.frameInfo.blockSizeID = LZ4F_max1MB;
+				m_lz4Preferences.frameInfo.blockMode = LZ4F_blockIndependent;
+				m_lz4Preferences.frameInfo.contentSize = uncompressedSize;
+				m_lz4Preferences.compressionLevel = level;
+				m_ok = !LZ4F_isError(LZ4F_createCompressionContext(&m_lz4, LZ4F_VERSION));
+				// Buffer must hold output of the largest update, that is given at most kChunkSize bytes
+				m_output.resize(LZ4F_compressBound(kChunkSize, &m_lz4Preferences) + LZ4F_HEADER_SIZE_MAX);
+				if (m_ok)
+				{
+					size_t size = LZ4F_compressBegin(m_lz4, m_output.data(), m_output.size(), &m_lz4Preferences);
+					m_ok = !LZ4F_isError(size);
+					m_header.assign(m_output.data(), m_output.data() + (m_ok ? size : 0));
+				}
+			}
+			else if (compression == ZIP_COMPRESSION::ZSTD)
+			{
+				m_zstd = ZSTD_createCCtx();
+				m_ok = m_zstd != nullptr
+					&& !ZSTD_isError(ZSTD_CCtx_setParameter(m_zstd, ZSTD_c_compressionLevel, level))
+					&& !ZSTD_isError(ZSTD_CCtx_setPledgedSrcSize(m_zstd, uncompressedSize));
+				m_output.resize(ZSTD_CStreamOutSize());
+			}
+		}
+
+		~StreamCompressor()
+		{
+			if (m_compression == ZIP_COMPRESSION::DEFLATE && m_ok)
+			{
+				deflateEnd(&m_deflate);
+			}
+			LZ4F_freeCompressionContext(m_lz4);
+			ZSTD_freeCCtx(m_zstd);
+		}
+
+		enum
+		{
+			// Largest input, that can be given to Compress at once
+			kChunkSize = 1024 * 1024
+		};
+
+		bool ok() const
+		{
+			return m_ok;
+		}
+
+		bool Compress(const uint8_t* data, size_t size, const WriteFunc& write)
+		{
+			return Process(data, size, false, write);
+		}
+
+		bool Finish(const WriteFunc& write)
+		{
+			return Process(nullptr, 0, true, write);
+		}
+
+	private:
+		bool Process(const uint8_t* data, size_t size, bool last, const WriteFunc& write)
+		{
+			if (!m_ok)
+			{
+				return false;
+			}
+			if (!m_header.empty())
+			{
+				m_ok = write(m_header.data(), m_header.size());
+				m_header.clear();
+			}
+			switch (m_compression)
+			{
+				case ZIP_COMPRESSION::NONE:
+					m_ok = m_ok && (size == 0 || write(data, size));
+					break;
+
+				case ZIP_COMPRESSION::DEFLATE:
+				{
+					m_deflate.next_in = (Bytef*)data;
+					m_deflate.avail_in = (uInt)size;
+					int err = Z_OK;
+					do
+					{
+						m_deflate.next_out = m_output.data();
+						m_deflate.avail_out = (uInt)m_output.size();
+						err = deflate(&m_deflate, last ? Z_FINISH : Z_NO_FLUSH);
+						size_t produced = m_output.size() - m_deflate.avail_out;
+						m_ok = m_ok && err != Z_STREAM_ERROR && (produced == 0 || write(m_output.data(), produced));
+					}
+					while (m_ok && (m_deflate.avail_out == 0 || (last && err != Z_STREAM_END)));
+					break;
+				}
+
+				case ZIP_COMPRESSION::LZ4:
+				{
+					size_t produced = last
+						? LZ4F_compressEnd(m_lz4, m_output.data(), m_output.size(), nullptr)
+						: LZ4F_compressUpdate(m_lz4, m_output.data(), m_output.size(), data, size, nullptr);
+					m_ok = m_ok && !LZ4F_isError(produced) && (produced == 0 || write(m_output.data(), produced));
+					break;
+				}
+
+				case ZIP_COMPRESSION::ZSTD:
+				{
+					ZSTD_inBuffer input = {data, size, 0};
+					size_t remaining = 0;
+					do
+					{
+						ZSTD_outBuffer output = {m_output.data(), m_output.size(), 0};
+						remaining = ZSTD_compressStream2(m_zstd, &output, &input, last ? ZSTD_e_end : ZSTD_e_continue);
+						m_ok = m_ok && !ZSTD_isError(remaining) && (output.pos == 0 || write(m_output.data(), output.pos));
+					}
+					while (m_ok && (last ? remaining != 0 : input.pos != input.size));
+					break;
+				}
+
+				default:
+					m_ok = false;
+			}
+			return m_ok;
+		}
+
+		int m_compression;
+		bool m_ok;
+		z_stream m_deflate;
+		LZ4F_cctx* m_lz4;
+		LZ4F_preferences_t m_lz4Preferences;
+		ZSTD_CCtx* m_zstd;
+		std::vector<uint8_t> m_output;
+		std::vector<uint8_t> m_header;
+	};
+}
+
+ZipWriter::ZipWriter(const File& file): m_file(file), m_currOffset(0), m_sizeOfCD(0)
+{
+	file.Seek(0);
+	m_compressionLevels[ZIP_COMPRESSION::DEFLATE] = 9;
+	m_compressionLevels[ZIP_COMPRESSION::LZ4] = 9;
+	m_compressionLevels[ZIP_COMPRESSION::ZSTD] = 19;
+}
+
+void ZipWriter::SetCompressionLevel(int compression, int level)
+{
+	m_compressionLevels[compression] = level;
+}
+
+int ZipWriter::GetCompressionLevel(int compression) const
+{
+	auto it = m_compressionLevels.find(compression);
+	return it != m_compressionLevels.end() ? it->second : 0;
+}
+
+Status ZipWriter::Append()
+{
+	if (!m_headers.empty() || m_currOffset != 0)
+	{
+		return false;
+	}
+
+	m_valid = false;
+
+	uint64_t offsetOfCD = 0;
+	uint64_t sizeOfCD = 0;
+	if (!FindCentralDirectory(m_file, offsetOfCD, sizeOfCD))
+	{
+		return false;
+	}
+
+	std::vector<uint8_t> cd(sizeOfCD);
+	size_t bytesRead = 0;
+	m_file.Seek(offsetOfCD);
+	m_file.Read(cd.data(), sizeOfCD, &bytesRead);
+	if (bytesRead != sizeOfCD)
+	{
+		return false;
+	}
+
+	std::vector<CentralDirectoryRecord> headers;
+	uint64_t sizeOfRecords = 0;
+	for (size_t pos = 0; pos + sizeof(CentralDirectoryHeader) <= sizeOfCD;)
+	{
+		CentralDirectoryRecord record;
+		memcpy(&record.header, &cd[pos], sizeof(CentralDirectoryHeader));
+		pos += sizeof(CentralDirectoryHeader);
+
+		const CentralDirectoryHeader& header = record.header;
+		if (header.centralFileHeaderSignature != ZIP_SIGNATURES::CENTRAL_DIRECTORY_FILE_HEADER
+			|| pos + header.fileNameLength + header.extraFieldLength + header.fileCommentLength > sizeOfCD)
+		{
+			return false;
+		}
+		record.filename.assign((const char*)&cd[pos], header.fileNameLength);
+		pos += header.fileNameLength;
+		record.extraField.assign((const char*)&cd[pos], header.extraFieldLength);
+		pos += header.extraFieldLength + header.fileCommentLength;
+
+		// Comments are dropped, writer does not keep them
+		record.header.fileCommentLength = 0;
+
+		sizeOfRecords += sizeof(CentralDirectoryHeader) + record.filename.size() + record.extraField.size();
+		headers.push_back(std::move(record));
+	}
+
+	m_headers = std::move(headers);
+	for (size_t i = 0; i < m_headers.size(); ++i)
+	{
+		m_existingRecords[m_headers[i].filename] = i;
+	}
+	m_sizeOfCD = sizeOfRecords;
+	m_currOffset = offsetOfCD;
+	m_minSize = m_file.GetSize();
+	m_valid = (bool)m_file.Seek(offsetOfCD);
+	return m_valid;
+}
+
+void ZipWriter::SetCompressionPolicy(std::shared_ptr<const CompressionPolicy> policy)
+{
+	m_compressionPolicy = std::move(policy);
+}
+
+Status ZipWriter::SetAlignment(size_t alignment)
+{
+	if (alignment == 0 || alignment > 32768 || (alignment & (alignment - 1)) != 0)
+	{
+		return false;
+	}
+	m_alignment = alignment;
+	return true;
+}
+
+void ZipWriter::SetDeduplication(bool enable)
+{
+	Flush();
+	m_deduplicate = enable;
+}
+
+void ZipWriter::SetThreadPool(ThreadPool* pool, size_t maxPendingEntries)
+{
+	Flush();
+	m_pool = pool;
+	m_maxPendingEntries = maxPendingEntries != 0 || pool == nullptr ? maxPendingEntries : pool->GetThreadCount() * 2;
+}
+
+Status ZipWriter::AddFile(const fs::path& path, File file, int compression)
+{
+	if (!m_valid)
+	{
+		return false;
+	}
+
+	bool encrypt = false;
+
+	int level = -1;
+	double minSaving = -1.0;
+	if (compression == ZIP_COMPRESSION::AUTO)
+	{
+		compression = ZIP_COMPRESSION::DEFLATE;
+		if (m_compressionPolicy)
+		{
+			CompressionPolicy::Choice choice = m_compressionPolicy->Choose(path, file);
+			compression = choice.compression;
+			level = choice.level;
+			minSaving = m_compressionPolicy->GetMinSaving();
+		}
+	}
+	if (level < 0)
+	{
+		level = GetCompressionLevel(compression);
+	}
+
+	LocalFileHeader fileHeader = LocalFileHeader();
 
 	fileHeader.localFileHeaderSignature = ZIP_SIGNATURES::LOCAL_HEADER;
 	fileHeader.versionNeededToExtract = ZIP_SIGNATURES::VERSION;
@@ -414,64 +1781,451 @@ Status ZipWriter::AddFile(const fs::path& path, File file, int compression)
 			| (((uint32_t)tm_time->tm_min & 0b00111111U) << 5U)
 			| (((uint32_t)(tm_time->tm_hour - 80) & 0b00011111U) << 11U);
 
-	fileHeader.dataDescriptor.CRC32 = crc32(0, dataPointer.get(), uncompressedSize);
-	fileHeader.dataDescriptor.compressedSize = compressedSize;
-	fileHeader.dataDescriptor.uncompressedSize = uncompressedSize;
-	fileHeader.fileNameLength = path.string().size();
-	fileHeader.extraFieldLength = 0;
+	bool deduplicate = m_deduplicate && file.GetSize() != 0;
 
-	header.centralFileHeaderSignature = ZIP_SIGNATURES::CENTRAL_DIRECTORY_FILE_HEADER;
+	if (m_pool == nullptr || file.GetSize() > kMaxParallelEntrySize)
+	{
+		// Entries are compressed in chunks while being written, so memory usage does not depend on their size
+		Status status = WritePending(true);
+		if (!deduplicate)
+		{
+			return StreamEntry(path.string(), fileHeader, file, compression, level, minSaving) && status;
+		}
+		DedupKey key;
+		if (!ComputeDedupKey(file, key))
+		{
+			return false;
+		}
+		if (WriteDuplicate(path.string(), fileHeader, key))
+		{
+			return status;
+		}
+		return StreamEntry(path.string(), fileHeader, file, compression, level, minSaving, &key) && status;
+	}
+
+	auto entry = std::make_shared<PendingEntry>();
+	entry->filename = path.string();
+	entry->header = fileHeader;
+	entry->compression = compression;
+	entry->level = level;
+	entry->minSaving = minSaving;
+	entry->deduplicate = deduplicate;
+	entry->source = file;
+	entry->uncompressedSize = file.GetSize();
+	entry->data = std::shared_ptr<uint8_t>(file.GetDataPointer(), null_deleter<uint8_t>);
+
+	if (!entry->data)
+	{
+		entry->data.reset(new uint8_t[entry->uncompressedSize], std::default_delete<uint8_t[]>());
+		size_t bytesRead = 0;
+		file.Seek(0);
+		file.Read(entry->data.get(), entry->uncompressedSize, &bytesRead);
+		if (bytesRead != entry->uncompressedSize)
+		{
+			// Entries, that were added before, are still written
+			WritePending(false);
+			return false;
+		}
+	}
+
+	m_pending.push_back(entry);
+	m_pool->Push([this, entry]()
+	{
+		Status status = CompressEntry(*entry);
+		// Notifying under the lock, so the writer can not be destroyed in between
+		std::lock_guard<std::mutex> lock(m_pendingMutex);
+		entry->status = status;
+		entry->ready = true;
+		m_pendingCondition.notify_all();
+	});
+	return WritePending(false);
+}
+
+Status ZipWriter::CompressEntry(PendingEntry& entry)
+{
+	const uint8_t* data = entry.data.get();
+	size_t uncompressedSize = entry.uncompressedSize;
+
+	entry.header.dataDescriptor.CRC32 = Crc32(0, data, uncompressedSize);
+
+	if (entry.deduplicate)
+	{
+		entry.key.size = uncompressedSize;
+		entry.key.crc32 = entry.header.dataDescriptor.CRC32;
+		entry.key.hash = XXH64(data, uncompressedSize, 0);
+	}
+
+	if (entry.compression == ZIP_COMPRESSION::NONE)
+	{
+		entry.compressedData = entry.data;
+		entry.compressedSize = uncompressedSize;
+		return true;
+	}
+
+	// Same compressor as for streamed entries, so output does not depend on the mode
+	StreamCompressor compressor(entry.compression, entry.level, uncompressedSize);
+	auto output = std::make_shared<std::vector<uint8_t>>();
+	auto write = [&output](const uint8_t* data, size_t size)
+	{
+		output->insert(output->end(), data, data + size);
+		return true;
+	};
+
+	for (size_t position = 0; position < uncompressedSize; position += StreamCompressor::kChunkSize)
+	{
+		size_t chunk = std::min(uncompressedSize - position, (size_t)StreamCompressor::kChunkSize);
+		if (!compressor.Compress(data + position, chunk, write))
+		{
+			return false;
+		}
+	}
+	if (!compressor.Finish(write))
+	{
+		return false;
+	}
+
+	if (entry.minSaving >= 0.0 && (double)output->size() > (double)uncompressedSize * (1.0 - entry.minSaving))
+	{
+		entry.header.compressionMethod = ZIP_COMPRESSION::NONE;
+		entry.compressedData = entry.data;
+		entry.compressedSize = uncompressedSize;
+		return true;
+	}
+
+	entry.compressedData = std::shared_ptr<uint8_t>(output, output->data());
+	entry.compressedSize = output->size();
+	return true;
+}
+
+Status ZipWriter::WritePending(bool wait)
+{
+	std::unique_lock<std::mutex> lock(m_pendingMutex);
+	while (!m_pending.empty())
+	{
+		PendingEntryPtr entry = m_pending.front();
+		if (!entry->ready)
+		{
+			if (!wait && m_pending.size() <= m_maxPendingEntries)
+			{
+				break;
+			}
+			m_pendingCondition.wait(lock, [&entry]{ return entry->ready; });
+		}
+		m_pending.pop_front();
+		lock.unlock();
+		Status status = entry->status;
+		if (status && !(entry->deduplicate && WriteDuplicate(entry->filename, entry->header, entry->key)))
+		{
+			const DedupKey* key = entry->deduplicate ? &entry->key : nullptr;
+			status = WriteEntry(entry->filename, entry->header, entry->compressedData.get(), entry->compressedSize, entry->uncompressedSize, key);
+		}
+		lock.lock();
+		if (!status)
+		{
+			m_pendingStatus = false;
+		}
+	}
+	// Error is reported once, by the first call after it happened
+	Status status = m_pendingStatus;
+	m_pendingStatus = true;
+	return status;
+}
+
+Status ZipWriter::Flush()
+{
+	return WritePending(true);
+}
+
+Status ZipWriter::ComputeDedupKey(const File& file, DedupKey& key)
+{
+	key.size = file.GetSize();
+
+	const uint8_t* mapped = file.GetDataPointer();
+	if (mapped != nullptr)
+	{
+		key.crc32 = Crc32(0, mapped, key.size);
+		key.hash = XXH64(mapped, key.size, 0);
+		return true;
+	}
 
+	std::unique_ptr<XXH64_state_t, XXH_errorcode(*)(XXH64_state_t*)> state(XXH64_createState(), XXH64_freeState);
+	if (!state || XXH64_reset(state.get(), 0) != XXH_OK)
+	{
+		return false;
+	}
+	std::unique_ptr<uint8_t[]> buffer(new uint8_t[StreamCompressor::kChunkSize]);
+	uint32_t crc = 0;
+	file.Seek(0);
+	for (uint64_t position = 0; position < key.size;)
+	{
+		size_t chunk = (size_t)std::min(key.size - position, (uint64_t)StreamCompressor::kChunkSize);
+		size_t bytesRead = 0;
+		file.Read(buffer.get(), chunk, &bytesRead);
+		if (bytesRead != chunk)
+		{
+			return false;
+		}
+		crc = Crc32(crc, buffer.get(), chunk);
+		XXH64_update(state.get(), buffer.get(), chunk);
+		position += chunk;
+	}
+	key.crc32 = crc;
+	key.hash = XXH64_digest(state.get());
+	return true;
+}
+
+bool ZipWriter::WriteDuplicate(const std::string& filename, const LocalFileHeader& fileHeader, const DedupKey& key)
+{
+	auto it = m_dedupEntries.find(key);
+	if (it == m_dedupEntries.end())
+	{
+		return false;
+	}
+	const DedupEntry& original = it->second;
+
+	// Data is described by the local header of the original, only modification time is of the duplicate
+	LocalFileHeader header = original.header;
+	header.lastModFileDate = fileHeader.lastModFileDate;
+	header.lastModFileTime = fileHeader.lastModFileTime;
+	AddCentralDirectoryRecord(filename, header, original.compressedSize, key.size, original.offset);
+	return true;
+}
+
+Status ZipWriter::WriteEntry(const std::string& filename, LocalFileHeader fileHeader, const uint8_t* data, uint64_t compressedSize, uint64_t uncompressedSize, const DedupKey* key)
+{
+	uint64_t offset = m_currOffset;
+	bool zip64Sizes = compressedSize >= ZIP_LIMITS::MAX_32 || uncompressedSize >= ZIP_LIMITS::MAX_32;
+
+	fileHeader.dataDescriptor.compressedSize = (uint32_t)std::min(compressedSize, (uint64_t)ZIP_LIMITS::MAX_32);
+	fileHeader.dataDescriptor.uncompressedSize = (uint32_t)std::min(uncompressedSize, (uint64_t)ZIP_LIMITS::MAX_32);
+
+	if (!WriteLocalHeader(filename, fileHeader, compressedSize, uncompressedSize, zip64Sizes))
+	{
+		return false;
+	}
+	if (compressedSize > 0 && !m_file.Write(data, compressedSize))
+	{
+		return false;
+	}
+	m_currOffset += compressedSize;
+	AddCentralDirectoryRecord(filename, fileHeader, compressedSize, uncompressedSize, offset);
+	if (key != nullptr)
+	{
+		m_dedupEntries[*key] = DedupEntry{fileHeader, compressedSize, offset};
+	}
+	return true;
+}
+
+Status ZipWriter::WriteLocalHeader(const std::string& filename, LocalFileHeader fileHeader, uint64_t compressedSize, uint64_t uncompressedSize, bool zip64Sizes)
+{
+	if (filename.size() > ZIP_LIMITS::MAX_16)
+	{
+		return false;
+	}
+
+	std::string localExtraField;
+	if (zip64Sizes)
+	{
+		// Local header must contain both sizes
+		fileHeader.dataDescriptor.compressedSize = ZIP_LIMITS::MAX_32;
+		fileHeader.dataDescriptor.uncompressedSize = ZIP_LIMITS::MAX_32;
+		AppendZip64ExtraField(localExtraField, {uncompressedSize, compressedSize});
+	}
+	if (m_alignment > 1 && fileHeader.compressionMethod == ZIP_COMPRESSION::NONE && uncompressedSize != 0)
+	{
+		// Field holds the alignment, followed by zeros
+		uint64_t dataOffset = m_currOffset + sizeof(LocalFileHeader) + filename.size() + localExtraField.size() + sizeof(ExtraFieldHeader) + sizeof(uint16_t);
+		size_t padding = (size_t)((m_alignment - dataOffset % m_alignment) % m_alignment);
+
+		ExtraFieldHeader fieldHeader;
+		fieldHeader.headerID = ZIP_EXTRA_FIELD::ALIGNMENT;
+		fieldHeader.dataSize = (uint16_t)(sizeof(uint16_t) + padding);
+		uint16_t alignment = (uint16_t)m_alignment;
+		localExtraField.append((const char*)&fieldHeader, sizeof(fieldHeader));
+		localExtraField.append((const char*)&alignment, sizeof(alignment));
+		localExtraField.append(padding, '\0');
+	}
+	fileHeader.fileNameLength = (uint16_t)filename.size();
+	fileHeader.extraFieldLength = (uint16_t)localExtraField.size();
+
+	bool result = m_file.Seek(m_currOffset);
+	m_currOffset += sizeof(LocalFileHeader) + filename.size() + localExtraField.size();
+
+	result = result && m_file.Write(fileHeader);
+	result = result && m_file.Write((const uint8_t*)filename.c_str(), filename.size());
+	result = result && m_file.Write((const uint8_t*)localExtraField.c_str(), localExtraField.size());
+	return result;
+}
+
+void ZipWriter::AddCentralDirectoryRecord(const std::string& filename, const LocalFileHeader& fileHeader, uint64_t compressedSize, uint64_t uncompressedSize, uint64_t offset)
+{
+	CentralDirectoryRecord record;
+	record.filename = filename;
+
+	bool zip64Sizes = compressedSize >= ZIP_LIMITS::MAX_32 || uncompressedSize >= ZIP_LIMITS::MAX_32;
+	bool zip64Offset = offset >= ZIP_LIMITS::MAX_32;
+
+	CentralDirectoryHeader& header = record.header;
+	header = CentralDirectoryHeader();
+	header.centralFileHeaderSignature = ZIP_SIGNATURES::CENTRAL_DIRECTORY_FILE_HEADER;
 	header.versionMadeBy = ZIP_SIGNATURES::VERSION;
 	header.versionNeededToExtract = ZIP_SIGNATURES::VERSION;
-	header.generalPurposBbitFlag = encrypt ? 1 : 0;
-	header.compressionMethod = static_cast<uint16_t>(compression);
+	header.generalPurposBbitFlag = fileHeader.generalPurposeBitFlag;
+	header.compressionMethod = fileHeader.compressionMethod;
 	header.lastModFileDate = fileHeader.lastModFileDate;
 	header.lastModFileTime = fileHeader.lastModFileTime;
-	header.dataDescriptor = fileHeader.dataDescriptor;
-	header.fileNameLength = fileHeader.fileNameLength;
-	header.extraFieldLength = 0;
+	header.dataDescriptor.CRC32 = fileHeader.dataDescriptor.CRC32;
+	header.dataDescriptor.compressedSize = zip64Sizes ? ZIP_LIMITS::MAX_32 : (uint32_t)compressedSize;
+	header.dataDescriptor.uncompressedSize = zip64Sizes ? ZIP_LIMITS::MAX_32 : (uint32_t)uncompressedSize;
+	header.fileNameLength = (uint16_t)filename.size();
 	header.fileCommentLength = 0;
 	header.diskNumberStart = 0;
 	header.internalFileAttributes = 0;
 	header.externalFileAttributes = 0;
-	header.relativeOffsetOfLocalHeader = m_currOffset;
+	header.relativeOffsetOfLocalHeader = zip64Offset ? ZIP_LIMITS::MAX_32 : (uint32_t)offset;
+
+	std::vector<uint64_t> zip64Values;
+	if (zip64Sizes)
+	{
+		zip64Values.push_back(uncompressedSize);
+		zip64Values.push_back(compressedSize);
+	}
+	if (zip64Offset)
+	{
+		zip64Values.push_back(offset);
+	}
+	if (!zip64Values.empty())
+	{
+		AppendZip64ExtraField(record.extraField, zip64Values);
+	}
+	header.extraFieldLength = (uint16_t)record.extraField.size();
+
+	m_sizeOfCD += sizeof(CentralDirectoryHeader) + record.filename.size() + record.extraField.size();
+
+	auto existing = m_existingRecords.find(filename);
+	if (existing != m_existingRecords.end())
+	{
+		// Replacing entry keeps its place in the central directory
+		CentralDirectoryRecord& old = m_headers[existing->second];
+		m_sizeOfCD -= sizeof(CentralDirectoryHeader) + old.filename.size() + old.extraField.size();
+		old = std::move(record);
+		return;
+	}
+	m_headers.push_back(std::move(record));
+}
+
+Status ZipWriter::StreamEntry(const std::string& filename, LocalFileHeader fileHeader, File file, int compression, int level, double minSaving, const DedupKey* key)
+{
+	uint64_t uncompressedSize = file.GetSize();
+	uint64_t offset = m_currOffset;
+
+	StreamCompressor compressor(compression, level, uncompressedSize);
+	if (!compressor.ok())
+	{
+		return false;
+	}
+
+	// Compressed size is not known yet. It can exceed the uncompressed one a bit, if data is not compressible.
+	bool zip64Sizes = uncompressedSize + uncompressedSize / 64 + 1024 * 1024 >= ZIP_LIMITS::MAX_32;
+	if (!WriteLocalHeader(filename, fileHeader, 0, uncompressedSize, zip64Sizes))
+	{
+		return false;
+	}
+	uint64_t dataOffset = m_currOffset;
+
+	uint64_t compressedSize = 0;
+	auto write = [this, &compressedSize](const uint8_t* data, size_t size)
+	{
+		compressedSize += size;
+		return (bool)m_file.Write(data, size);
+	};
+
+	uint32_t crc = 0;
+	const uint8_t* mapped = file.GetDataPointer();
+	std::unique_ptr<uint8_t[]> buffer(mapped == nullptr ? new uint8_t[StreamCompressor::kChunkSize] : nullptr);
+	file.Seek(0);
 
-	std::string filepathStr = path.string();
-	m_headers.emplace_back(header, filepathStr);
+	for (uint64_t position = 0; position < uncompressedSize;)
+	{
+		size_t chunk = (size_t)std::min(uncompressedSize - position, (uint64_t)StreamCompressor::kChunkSize);
+		const uint8_t* data = mapped + position;
+		if (mapped == nullptr)
+		{
+			size_t bytesRead = 0;
+			file.Read(buffer.get(), chunk, &bytesRead);
+			if (bytesRead != chunk)
+			{
+				return false;
+			}
+			data = buffer.get();
+		}
+		crc = Crc32(crc, data, chunk);
+		if (!compressor.Compress(data, chunk, write))
+		{
+			return false;
+		}
+		position += chunk;
+	}
+	if (!compressor.Finish(write))
+	{
+		return false;
+	}
+	m_currOffset += compressedSize;
 
-	m_sizeOfCD += (int32_t)(sizeof(CentralDirectoryHeader) + filepathStr.size());
-	m_currOffset += (int32_t)(sizeof(LocalFileHeader) + filepathStr.size() + compressedSize);
+	// Same test as in CompressEntry, so output does not depend on the mode
+	if (compression != ZIP_COMPRESSION::NONE && minSaving >= 0.0 && (double)compressedSize > (double)uncompressedSize * (1.0 - minSaving))
+	{
+		if (!m_file.Seek(offset))
+		{
+			return false;
+		}
+		// Stored entry may be shorter than the compressed one. If nothing is written over the rest of it, the gap
+		// before the central directory is padded, so no stale bytes remain past the end of the archive.
+		m_minSize = std::max(m_minSize, m_currOffset);
+		m_currOffset = offset;
+		fileHeader.compressionMethod = ZIP_COMPRESSION::NONE;
+		return StreamEntry(filename, fileHeader, file, ZIP_COMPRESSION::NONE, 0, -1.0, key);
+	}
 
-	m_file.Write(fileHeader);
-	m_file.Write((uint8_t*)filepathStr.c_str(), filepathStr.size());
+	if (!zip64Sizes && compressedSize >= ZIP_LIMITS::MAX_32)
+	{
+		return false;
+	}
 
-	uint8_t* data_ptr_to_write = nullptr;
-	size_t data_size_to_write = 0;
+	// Patching sizes and CRC of the local header
+	fileHeader.dataDescriptor.CRC32 = crc;
+	fileHeader.dataDescriptor.compressedSize = zip64Sizes ? ZIP_LIMITS::MAX_32 : (uint32_t)compressedSize;
+	fileHeader.dataDescriptor.uncompressedSize = zip64Sizes ? ZIP_LIMITS::MAX_32 : (uint32_t)uncompressedSize;
 
-	if (compression == ZIP_COMPRESSION::NONE)
+	bool result = m_file.Seek(offset + offsetof(LocalFileHeader, dataDescriptor));
+	result = result && m_file.Write(fileHeader.dataDescriptor);
+	if (zip64Sizes)
 	{
-		data_ptr_to_write = dataPointer.get();
-		data_size_to_write = uncompressedSize;
+		uint64_t sizes[2] = {uncompressedSize, compressedSize};
+		result = result && m_file.Seek(offset + sizeof(LocalFileHeader) + filename.size() + sizeof(ExtraFieldHeader));
+		result = result && m_file.Write((const uint8_t*)sizes, sizeof(sizes));
 	}
-	else
+	result = result && m_file.Seek(dataOffset + compressedSize);
+	if (!result)
 	{
-		data_ptr_to_write = dataPointerCompressed.get();
-		data_size_to_write = compressedSize;
+		return false;
 	}
-	m_file.Write(data_ptr_to_write, data_size_to_write);
 
+	AddCentralDirectoryRecord(filename, fileHeader, compressedSize, uncompressedSize, offset);
+	if (key != nullptr)
+	{
+		m_dedupEntries[*key] = DedupEntry{fileHeader, compressedSize, offset};
+	}
 	return true;
 }
 
 Status ZipWriter::CreateDirectory(const fs::path& path)
 {
-	CentralDirectoryHeader header = {0};
 	LocalFileHeader fileHeader = {0};
 
 	std::string dir_path = path.string();
 
-	if (dir_path.size() == 0)
+	if (!m_valid || dir_path.size() == 0)
 		return false;
 	if (dir_path[dir_path.size()-1] == '\\')
 		dir_path[dir_path.size()-1] = '/';
@@ -481,31 +2235,83 @@ Status ZipWriter::CreateDirectory(const fs::path& path)
 
 	fileHeader.localFileHeaderSignature = ZIP_SIGNATURES::LOCAL_HEADER;
 	fileHeader.versionNeededToExtract = ZIP_SIGNATURES::VERSION;
-	fileHeader.fileNameLength = dir_path.size();
-
-	header.centralFileHeaderSignature = ZIP_SIGNATURES::CENTRAL_DIRECTORY_FILE_HEADER;
-	header.versionMadeBy = ZIP_SIGNATURES::VERSION;
-	header.versionNeededToExtract = ZIP_SIGNATURES::VERSION;
-	header.dataDescriptor = fileHeader.dataDescriptor;
-	header.fileNameLength = fileHeader.fileNameLength;
-	header.relativeOffsetOfLocalHeader = m_currOffset;
 
-	m_headers.emplace_back(header, dir_path);
-
-	m_sizeOfCD += (int32_t)(sizeof(CentralDirectoryHeader) + dir_path.size());
-	m_currOffset += (int32_t)(sizeof(LocalFileHeader) + dir_path.size());
+	if (m_pool == nullptr)
+	{
+		return WriteEntry(dir_path, fileHeader, nullptr, 0, 0);
+	}
 
-	m_file.Write(fileHeader);
-	m_file.Write((uint8_t*)dir_path.c_str(), dir_path.size());
-	return true;
+	// Queued after pending files, to keep the order of entries
+	auto entry = std::make_shared<PendingEntry>();
+	entry->filename = dir_path;
+	entry->header = fileHeader;
+	entry->status = true;
+	entry->ready = true;
+	m_pending.push_back(entry);
+	return WritePending(false);
 }
 
 ZipWriter::~ZipWriter()
 {
-	for (auto& pair: m_headers)
+	Flush();
+
+	if (!m_valid)
+	{
+		return;
+	}
+
+	m_file.Seek(m_currOffset);
+
+	auto isZip64 = [this]
+	{
+		return m_headers.size() >= ZIP_LIMITS::MAX_16 || m_sizeOfCD >= ZIP_LIMITS::MAX_32 || m_currOffset >= ZIP_LIMITS::MAX_32;
+	};
+	auto getEnd = [this](bool zip64)
+	{
+		size_t zip64Records = zip64 ? sizeof(Zip64EndOfCentralDirectoryRecord) + sizeof(Zip64EndOfCentralDirectoryLocator) : 0;
+		return m_currOffset + m_sizeOfCD + zip64Records + sizeof(EndOfCentralDirectoryRecord);
+	};
+
+	// Anything past the end of central directory record would hide it, so the gap before the central directory
+	// is filled with zeros instead. Readers locate the central directory by its offset.
+	uint64_t end = getEnd(isZip64());
+	if (end < m_minSize)
+	{
+		std::vector<uint8_t> zeros((size_t)(m_minSize - end));
+		m_file.Write(zeros.data(), zeros.size());
+		m_currOffset += zeros.size();
+	}
+
+	for (auto& record: m_headers)
 	{
-		m_file.Write(pair.first);
-		m_file.Write((uint8_t*)pair.second.c_str(), pair.second.size());
+		m_file.Write(record.header);
+		m_file.Write((const uint8_t*)record.filename.c_str(), record.filename.size());
+		m_file.Write((const uint8_t*)record.extraField.c_str(), record.extraField.size());
+	}
+
+	FileStream stream(m_file);
+
+	bool zip64 = isZip64();
+
+	if (zip64)
+	{
+		Zip64EndOfCentralDirectoryRecord zip64ecdr = {0};
+		zip64ecdr.zip64EndOfCentralDirSignature = ZIP_SIGNATURES::ZIP64_END_OF_CENTRAL_DIRECTORY_SIGN;
+		zip64ecdr.sizeOfZip64EndOfCentralDirectoryRecord = sizeof(Zip64EndOfCentralDirectoryRecord) - 12;
+		zip64ecdr.versionMadeBy = ZIP_SIGNATURES::VERSION;
+		zip64ecdr.versionNeededToExtract = ZIP_SIGNATURES::VERSION;
+		zip64ecdr.totalNumberOfEntriesInTheCentralDirectoryOnThisDisk = m_headers.size();
+		zip64ecdr.totalNumberOfEntriesInTheCentralDirectory = m_headers.size();
+		zip64ecdr.sizeOfTheCentralDirectory = m_sizeOfCD;
+		zip64ecdr.offsetOfStartOfCentralDirectory = m_currOffset;
+
+		Zip64EndOfCentralDirectoryLocator locator = {0};
+		locator.zip64EndOfCentralDirLocatorSignature = ZIP_SIGNATURES::ZIP64_END_OF_CENTRAL_DIRECTORY_LOCATOR_SIGN;
+		locator.relativeOffsetOfTheZip64EndOfCentralDirectoryRecord = m_currOffset + m_sizeOfCD;
+		locator.totalNumberOfDisks = 1;
+
+		stream << zip64ecdr;
+		stream << locator;
 	}
 
 	EndOfCentralDirectoryRecord ecdr = {0};
@@ -513,13 +2319,11 @@ ZipWriter::~ZipWriter()
 	ecdr.endOfCentralDirSignature = ZIP_SIGNATURES::END_OF_CENTRAL_DIRECTORY_SIGN;
 	ecdr.numberOfThisDisk = 0;
 	ecdr.numberOfTheDiskWithTheStartOfTheCentralDirectory = 0;
-	ecdr.totalNumberOfEntriesInTheCentralDirectory = (int16_t)(m_headers.size());
-	ecdr.totalNumberOfEntriesInTheCentralDirectoryOnThisDisk = (int16_t)(m_headers.size());
-	ecdr.sizeOfTheCentralDirectory = m_sizeOfCD;
-	ecdr.offsetOfStartOfCentralDirectory = m_currOffset;
+	ecdr.totalNumberOfEntriesInTheCentralDirectory = (uint16_t)std::min(m_headers.size(), (size_t)ZIP_LIMITS::MAX_16);
+	ecdr.totalNumberOfEntriesInTheCentralDirectoryOnThisDisk = ecdr.totalNumberOfEntriesInTheCentralDirectory;
+	ecdr.sizeOfTheCentralDirectory = (uint32_t)std::min(m_sizeOfCD, (uint64_t)ZIP_LIMITS::MAX_32);
+	ecdr.offsetOfStartOfCentralDirectory = (uint32_t)std::min(m_currOffset, (uint64_t)ZIP_LIMITS::MAX_32);
 	ecdr.ZIPFileCommentLength = 0;
 
-	FileStream stream(m_file);
-
 	stream << ecdr;
 }
@@ -2,11 +2,21 @@
 #include "ArchiveInterface.h"
 #include "FileListBinarySearch.h"
 #include "Archive.h"
+#include "InflateFile.h"
+#include "EntryCache.h"
+#include "ThreadPool.h"
 // #include "FileListHashMap.h"
+#include <atomic>
+#include <map>
+#include <unordered_map>
+#include <deque>
+#include <memory>
 
 
 namespace fsal
 {
+	class CompressionPolicy;
+
 #if defined(_WIN32) || defined(_WIN64)
 #  if defined(_WIN64)
     typedef __int64 LONG_PTR;
@@ -23,18 +33,44 @@ namespace fsal
 		{
 			CENTRAL_DIRECTORY_FILE_HEADER = 0x02014b50,
 			END_OF_CENTRAL_DIRECTORY_SIGN = 0x06054b50,
+			ZIP64_END_OF_CENTRAL_DIRECTORY_SIGN = 0x06064b50,
+			ZIP64_END_OF_CENTRAL_DIRECTORY_LOCATOR_SIGN = 0x07064b50,
 			LOCAL_HEADER = 0x04034b50,
 			VERSION = 46,
 		};
 	}
 
+	namespace ZIP_EXTRA_FIELD
+	{
+		enum
+		{
+			ZIP64 = 0x0001,
+
+			// Padding of local header, that aligns data of the entry (as written by Android zipalign)
+			ALIGNMENT = 0xD935,
+		};
+	}
+
 	namespace ZIP_COMPRESSION
 	{
 		enum Compression
 		{
+			// Not a ZIP method, ZipWriter chooses the method with its compression policy
+			AUTO = -1,
 			NONE = 0,
 			DEFLATE = 8,
-			LZ4 = 30
+			LZ4 = 30,
+			ZSTD = 93
+		};
+	}
+
+	namespace ZIP_LIMITS
+	{
+		// Values of 32-bit and 16-bit fields, that indicate that the actual value is stored in ZIP64 records
+		enum : uint32_t
+		{
+			MAX_32 = 0xFFFFFFFFu,
+			MAX_16 = 0xFFFFu,
 		};
 	}
 
@@ -42,62 +78,95 @@ namespace fsal
 
 	struct DataDescriptor
 	{
-		int32_t CRC32;
-		int32_t compressedSize;
-		int32_t uncompressedSize;
+		uint32_t CRC32;
+		uint32_t compressedSize;
+		uint32_t uncompressedSize;
 	};
 
 	struct CentralDirectoryHeader
 	{
-		int32_t centralFileHeaderSignature;
-		int16_t versionMadeBy;
-		int16_t	versionNeededToExtract;
-		int16_t	generalPurposBbitFlag;
-		int16_t	compressionMethod;
-		int16_t	lastModFileTime;
-		int16_t	lastModFileDate;
+		uint32_t centralFileHeaderSignature;
+		uint16_t versionMadeBy;
+		uint16_t versionNeededToExtract;
+		uint16_t generalPurposBbitFlag;
+		uint16_t compressionMethod;
+		uint16_t lastModFileTime;
+		uint16_t lastModFileDate;
 		DataDescriptor dataDescriptor;
-		int16_t	fileNameLength;
-		int16_t	extraFieldLength;
-		int16_t	fileCommentLength;
-		int16_t	diskNumberStart;
-		int16_t	internalFileAttributes;
-		int32_t	externalFileAttributes;
-		int32_t	relativeOffsetOfLocalHeader;
+		uint16_t fileNameLength;
+		uint16_t extraFieldLength;
+		uint16_t fileCommentLength;
+		uint16_t diskNumberStart;
+		uint16_t internalFileAttributes;
+		uint32_t externalFileAttributes;
+		uint32_t relativeOffsetOfLocalHeader;
 	};
 
 	struct EndOfCentralDirectoryRecord
 	{
-		int32_t endOfCentralDirSignature;
-		int16_t	numberOfThisDisk;
-		int16_t	numberOfTheDiskWithTheStartOfTheCentralDirectory;
-		int16_t	totalNumberOfEntriesInTheCentralDirectoryOnThisDisk;
-		int16_t	totalNumberOfEntriesInTheCentralDirectory;
-		int32_t	sizeOfTheCentralDirectory;
-		int32_t	offsetOfStartOfCentralDirectory;
-		int16_t ZIPFileCommentLength;
+		uint32_t endOfCentralDirSignature;
+		uint16_t numberOfThisDisk;
+		uint16_t numberOfTheDiskWithTheStartOfTheCentralDirectory;
+		uint16_t totalNumberOfEntriesInTheCentralDirectoryOnThisDisk;
+		uint16_t totalNumberOfEntriesInTheCentralDirectory;
+		uint32_t sizeOfTheCentralDirectory;
+		uint32_t offsetOfStartOfCentralDirectory;
+		uint16_t ZIPFileCommentLength;
+	};
+
+	struct Zip64EndOfCentralDirectoryRecord
+	{
+		uint32_t zip64EndOfCentralDirSignature;
+		uint64_t sizeOfZip64EndOfCentralDirectoryRecord;
+		uint16_t versionMadeBy;
+		uint16_t versionNeededToExtract;
+		uint32_t numberOfThisDisk;
+		uint32_t numberOfTheDiskWithTheStartOfTheCentralDirectory;
+		uint64_t totalNumberOfEntriesInTheCentralDirectoryOnThisDisk;
+		uint64_t totalNumberOfEntriesInTheCentralDirectory;
+		uint64_t sizeOfTheCentralDirectory;
+		uint64_t offsetOfStartOfCentralDirectory;
+	};
+
+	struct Zip64EndOfCentralDirectoryLocator
+	{
+		uint32_t zip64EndOfCentralDirLocatorSignature;
+		uint32_t numberOfTheDiskWithTheStartOfTheZip64EndOfCentralDirectory;
+		uint64_t relativeOffsetOfTheZip64EndOfCentralDirectoryRecord;
+		uint32_t totalNumberOfDisks;
 	};
 
 	struct LocalFileHeader
 	{
-		int32_t localFileHeaderSignature;
-		int16_t	versionNeededToExtract;
-		int16_t	generalPurposeBitFlag;
-		int16_t	compressionMethod;
-		int16_t	lastModFileTime;
-		int16_t	lastModFileDate;
+		uint32_t localFileHeaderSignature;
+		uint16_t versionNeededToExtract;
+		uint16_t generalPurposeBitFlag;
+		uint16_t compressionMethod;
+		uint16_t lastModFileTime;
+		uint16_t lastModFileDate;
 		DataDescriptor dataDescriptor;
-		int16_t	fileNameLength;
-		int16_t	extraFieldLength;
+		uint16_t fileNameLength;
+		uint16_t extraFieldLength;
+	};
+
+	struct ExtraFieldHeader
+	{
+		uint16_t headerID;
+		uint16_t dataSize;
 	};
 
 	struct ZipEntryData
 	{
 		size_t sizeCompressed = 0;
 		size_t sizeUncompressed = 0;
+		// Offset of the entry data. Resolved on open, see ZipReader::ResolveDataOffset
 		ssize_t offset = -1;
-		int16_t	compressionMethod = 0;
-		int16_t	generalPurposeBitFlag = 0;
+		ssize_t localHeaderOffset = -1;
+		// Index of the entry in central directory
+		uint32_t index = 0;
+		uint32_t crc32 = 0;
+		uint16_t compressionMethod = 0;
+		uint16_t generalPurposeBitFlag = 0;
 	};
 
 #pragma pack(pop)
@@ -105,18 +174,154 @@ namespace fsal
 	class ZipReader: public ArchiveReaderInterface
 	{
 	public:
+		enum
+		{
+			kDefaultStreamingThreshold = 64 * 1024 * 1024,
+			kDefaultScratchBufferLimit = 4 * 1024 * 1024
+		};
+
 		Status OpenArchive(File file);
 
+		// Takes entries from the index, saved with SaveIndex, if it was saved for this archive (same size, modification
+		// time and hash of the central directory). Otherwise central directory is parsed. Index file should be mapped,
+		// so it is used in place.
+		Status OpenArchive(File file, File indexFile);
+
+		// Writes sorted entries of the archive, so the next OpenArchive does not need to parse them.
+		Status SaveIndex(File indexFile);
+
+		// Returns true if entries were taken from the index.
+		bool IsIndexed() const;
+
 		File OpenFile(const fs::path& filepath) override;
 
+		// Local header and compressed data are read with the engine, and entries are decompressed on its thread pool.
+		// Cancellation is checked between the stages. Reader must stay alive until the result is completed.
+		AsyncResult<File> OpenFileAsync(const fs::path& filepath, AsyncEngine& engine) override;
+
 		void* OpenFile(const fs::path& filepath, std::function<void*(size_t size)> alloc_func) override;
 
+		Status GetFileSize(const fs::path& filepath, size_t& size) override;
+
+		Status ReadFile(const fs::path& filepath, uint8_t* dst, size_t size) override;
+
 		bool Exists(const fs::path& filepath, PathType type = kFile | kDirectory) override;
 
+		// Data of the entries is prefetched in the order of their offsets, ranges, that are close to each other, are
+		// merged. Then local headers are read, so opens do not need to. If decompress is set and the cache is enabled,
+		// compressed entries, that are not streamed, are decompressed to the cache on the default thread pool.
+		size_t Prefetch(const std::vector<fs::path>& paths, bool decompress) override;
+
 		std::vector<std::string> ListDirectory(const fs::path& path) override;
+
+		bool ForEachEntry(const std::function<void(const std::string& path)>& f) override;
+
+		// DEFLATE entries, which uncompressed size is not less than the given one, are decompressed on demand
+		// while being read, instead of being inflated to memory on open.
+		void SetStreamingThreshold(size_t size);
+
+		// Enables verification of CRC32 of entries, that are decompressed or copied to memory on open. Open fails if
+		// the checksum does not match. Streamed entries and stored entries of archives, that are not memory mapped, are
+		// read on demand, so they are not verified. Disabled by default.
+		void SetVerifyCrc(bool verify);
+
+		// Verifies CRC32 of all entries of the archive. Names of corrupted entries are added to corruptedEntries,
+		// if it is given.
+		Status VerifyArchive(std::vector<std::string>* corruptedEntries = nullptr);
+
+		// Enables cache of decompressed entries, which total size is limited by the given budget. Cached entries are
+		// opened as files, that share the same buffer, so they must not be written to. Zero disables caching (default).
+		void SetCacheBudget(size_t size);
+
+		// Evicts least recently used entries from the cache until its size is not greater than the given one.
+		// Can be called when memory is low.
+		void TrimCache(size_t size = 0);
+
+		// Enables random access index for DEFLATE entries larger than span. Such entries are decompressed on demand,
+		// and a checkpoint is stored roughly every span bytes of uncompressed data while they are being read, so
+		// seeking only decompresses from the nearest checkpoint. Indices are kept for the lifetime of the reader and are
+		// shared between opens of the same entry. Zero disables indexing (default).
+		void SetCheckpointSpan(size_t span);
+
+		// Compressed data of entries is read to a buffer, that is kept per thread and reused across opens of all
+		// readers. Buffer grows up to the given size, larger entries are read to a temporary allocation.
+		static void SetScratchBufferLimit(size_t size);
+
+		// Writes all built indices to the file, so they can be loaded later instead of being built again.
+		Status SaveDeflateIndex(File indexFile);
+
+		// Loads indices, previously saved with SaveDeflateIndex for the same archive. Fails if the archive was changed
+		// since then (size, modification time or hash of the central directory differ), or if the index is truncated.
+		Status LoadDeflateIndex(File indexFile);
 	private:
+		struct DeflateIndexEntry
+		{
+			size_t sizeCompressed;
+			size_t sizeUncompressed;
+			DeflateIndexPtr index;
+		};
+
+		// Returns index of the entry, creating an empty one on the first call.
+		DeflateIndexPtr GetDeflateIndex(const ZipEntryData& entry);
+
+		// Looks up the entry and resolves offset of its data. Returns false if there is no such entry.
+		bool FindEntry(const fs::path& filepath, ZipEntryData& entry);
+
+		// Reads local header of the entry to get the offset of its data. Result is cached, so it's done once per entry.
+		bool ResolveDataOffset(ZipEntryData& entry);
+
+		// Takes offset of the data from the local header, that was read, and caches it
+		bool SetDataOffset(ZipEntryData& entry, const LocalFileHeader& fileHeader);
+
+		// DEFLATE entries, that are decompressed on demand while being read
+		bool IsStreamed(const ZipEntryData& entry) const;
+
+		// Opens the entry, which data offset is resolved
+		File OpenEntry(const ZipEntryData& entry);
+
+		// Continues OpenFileAsync once the data offset is resolved
+		void OpenEntryAsync(const ZipEntryData& entry, AsyncEngine& engine, AsyncResult<File> result);
+
+		// Decompresses data of the entry to dst, that must hold sizeUncompressed bytes. Verifies CRC32 if enabled.
+		bool Decompress(const ZipEntryData& entry, uint8_t* dst);
+
+		bool DecompressData(const ZipEntryData& entry, const uint8_t* compressedData, uint8_t* dst);
+
+		// Decompresses the entry to a memory file, and puts it to the cache if it fits the budget
+		File DecompressToMemory(const ZipEntryData& entry, const uint8_t* compressedData);
+
+		bool VerifyEntry(ZipEntryData entry);
+
+		// Returns file, that gives access to the given range of the archive. Does not copy if the archive is mapped.
+		File OpenRawData(size_t offset, size_t size);
+
+		// Returns pointer to the compressed data of the entry, or nullptr on read error. If the archive is memory mapped,
+		// pointer to the mapping is returned. Otherwise, data is read to the per-thread scratch buffer, which is valid
+		// until the next call on the same thread, or to buffer if the entry exceeds the scratch buffer limit.
+		const uint8_t* ReadCompressedData(const ZipEntryData& entry, std::unique_ptr<uint8_t[]>& buffer);
+
+		// Points to the central directory in the mapping, or reads it to buffer
+		const uint8_t* ReadCentralDirectory(std::vector<uint8_t>& buffer);
+
+		FileListKey GetIndexKey(const uint8_t* cd);
+
 		FileList<ZipEntryData> filelist;
 		File file;
+		uint64_t m_archiveSize = 0;
+		uint64_t m_offsetOfCD = 0;
+		uint64_t m_sizeOfCD = 0;
+		bool m_indexed = false;
+		std::unique_ptr<std::atomic<int64_t>[]> m_dataOffsets;
+		size_t m_streamingThreshold = kDefaultStreamingThreshold;
+		size_t m_checkpointSpan = 0;
+		bool m_verifyCrc = false;
+
+		// Decompressed entries, by offset of the local header
+		EntryCache m_cache;
+
+		// Random access indices of DEFLATE entries, by offset of the local header
+		std::map<int64_t, DeflateIndexEntry> m_deflateIndices;
+		std::mutex m_deflateIndicesMutex;
 	};
 
 	inline Archive OpenZipArchive(const File& archive)
@@ -129,23 +334,204 @@ namespace fsal
 		}
 		return Archive();
 	}
+
 	class ZipWriter : public ArchiveWriterInterface
 	{
 	public:
 		ZipWriter(const File& file);
 		~ZipWriter();
 
-		Status AddFile(const fs::path& path, File file, int compression = ZIP_COMPRESSION::DEFLATE) override;
+		// Continues the archive, that the file already contains. The file has to be opened for update (kReadUpdate).
+		// New entries are written over the old central directory, and the merged one is written when the writer is
+		// destroyed. Entries added with the name of an existing entry replace it, old data is left unreferenced.
+		// Must be called before any entries are added.
+		Status Append();
+
+		Status AddFile(const fs::path& path, File file, int compression = ZIP_COMPRESSION::AUTO) override;
 
 		Status CreateDirectory(const fs::path& path) override;
 
+		// Sets level, that is used for entries compressed with the given method. Meaning of the level is specific
+		// to the method. Defaults are 9 for DEFLATE and LZ4 (HC) and 19 for ZSTD.
+		void SetCompressionLevel(int compression, int level);
+
+		int GetCompressionLevel(int compression) const;
+
+		// Sets policy, that chooses method and level of entries added with ZIP_COMPRESSION::AUTO. Such entries are
+		// stored if compression saves less than the minimal saving of the policy. Without a policy they are
+		// compressed with DEFLATE.
+		void SetCompressionPolicy(std::shared_ptr<const CompressionPolicy> policy);
+
+		enum
+		{
+			// Larger entries are not compressed on the pool, since that requires whole entry to be in memory
+			kMaxParallelEntrySize = 64 * 1024 * 1024
+		};
+
+		// Enables compression of entries on the pool. AddFile returns as soon as the entry is queued, and entries are
+		// written in the order they were added, once they are compressed. AddFile blocks when more than
+		// maxPendingEntries are queued, zero means twice the number of threads of the pool. Errors are reported by
+		// one of subsequent calls of AddFile, CreateDirectory or Flush. nullptr disables (default).
+		// Data of queued entries is referenced until they are written, so memory of files added must not be modified.
+		void SetThreadPool(ThreadPool* pool, size_t maxPendingEntries = 0);
+
+		// Waits for all queued entries to be written.
+		Status Flush();
+
+		// Pads local headers of stored entries, so their data starts at offset that is a multiple of alignment, for
+		// example 4096 or 64. Such entries of a mapped archive are read in place at aligned addresses. Alignment must
+		// be a power of two not larger than 32768, one disables (default).
+		Status SetAlignment(size_t alignment);
+
+		// Enables deduplication of entries by content. Data of an entry, that is identical to the one of a previously
+		// added entry, is not written, instead its central directory record points to the local header of that entry.
+		// Entries are considered identical if their sizes, CRC-32 and XXH64 match, compression method of the first one
+		// is used for all of them. ZipReader and most tools read such archives, but tools that require names of local
+		// headers to match central directory may reject them. Without a thread pool, files that are not in memory are
+		// read twice, to hash them before writing. Disabled by default.
+		void SetDeduplication(bool enable);
+
 	private:
+		struct CentralDirectoryRecord
+		{
+			CentralDirectoryHeader header;
+			std::string filename;
+			std::string extraField;
+		};
+
+		struct DedupKey
+		{
+			uint64_t size;
+			uint64_t hash;
+			uint32_t crc32;
+
+			bool operator==(const DedupKey& other) const
+			{
+				return size == other.size && hash == other.hash && crc32 == other.crc32;
+			}
+		};
+
+		struct DedupKeyHash
+		{
+			size_t operator()(const DedupKey& key) const
+			{
+				return (size_t)(key.hash ^ key.size);
+			}
+		};
+
+		// Written entry, that duplicates can point to
+		struct DedupEntry
+		{
+			LocalFileHeader header;
+			uint64_t compressedSize;
+			uint64_t offset;
+		};
+
+		struct PendingEntry
+		{
+			std::string filename;
+			LocalFileHeader header;
+
+			// Data may point to memory of the source file, so it is kept alive
+			File source;
+			std::shared_ptr<uint8_t> data;
+			std::shared_ptr<uint8_t> compressedData;
+			uint64_t compressedSize = 0;
+			uint64_t uncompressedSize = 0;
+			int compression = ZIP_COMPRESSION::NONE;
+			int level = 0;
+
+			// Entry is stored, if compression saves less than this fraction of its size. Negative disables.
+			double minSaving = -1.0;
+
+			// Key is computed by worker, if deduplication is enabled
+			bool deduplicate = false;
+			DedupKey key = DedupKey();
+
+			// Set by worker, guarded by m_pendingMutex
+			Status status = false;
+			bool ready = false;
+		};
+
+		typedef std::shared_ptr<PendingEntry> PendingEntryPtr;
+
+		// Compresses data of the entry and sets CRC of its header.
+		static Status CompressEntry(PendingEntry& entry);
+
+		// Computes deduplication key of the file, reading it in chunks if it is not mapped.
+		static Status ComputeDedupKey(const File& file, DedupKey& key);
+
+		// If an entry with the same content was written, registers the entry in central directory as its duplicate.
+		bool WriteDuplicate(const std::string& filename, const LocalFileHeader& fileHeader, const DedupKey& key);
+
+		// Writes compressed entries from the front of the queue. If wait is true, waits for all of them to be compressed.
+		Status WritePending(bool wait);
+
+		// Writes local header followed by the file name and data, and registers the entry in central directory.
+		// Sizes and offset that do not fit 32 bits are moved to ZIP64 extra fields.
+		// If key is not null, the entry is remembered for deduplication.
+		Status WriteEntry(const std::string& filename, LocalFileHeader fileHeader, const uint8_t* data, uint64_t compressedSize, uint64_t uncompressedSize, const DedupKey* key = nullptr);
+
+		// Compresses the file in chunks while writing it, then seeks back to patch CRC and sizes of the local header.
+		// If compression saves less than minSaving, the entry is rewritten as stored, when that does not make it larger.
+		Status StreamEntry(const std::string& filename, LocalFileHeader fileHeader, File file, int compression, int level, double minSaving, const DedupKey* key = nullptr);
+
+		// Writes local header, followed by the file name and extra field. If zip64Sizes is true, sizes are stored in
+		// ZIP64 extra field. Extra field of stored entries is padded to the alignment.
+		Status WriteLocalHeader(const std::string& filename, LocalFileHeader fileHeader, uint64_t compressedSize, uint64_t uncompressedSize, bool zip64Sizes);
+
+		// Registers entry, which local header is at the given offset, in central directory.
+		void AddCentralDirectoryRecord(const std::string& filename, const LocalFileHeader& fileHeader, uint64_t compressedSize, uint64_t uncompressedSize, uint64_t offset);
+
 		FileList<ZipEntryData> filelist;
 		File m_file;
 
-		int32_t m_currOffset;
-		int32_t m_sizeOfCD;
+		uint64_t m_currOffset;
+		uint64_t m_sizeOfCD;
 
-		std::vector<std::pair<CentralDirectoryHeader, std::string> > m_headers;
+		std::vector<CentralDirectoryRecord> m_headers;
+
+		// Records of the existing entries in append mode, by name
+		std::unordered_map<std::string, size_t> m_existingRecords;
+
+		// The archive is not truncated when appending, or when a streamed entry is rewritten as stored, so it is padded
+		// to the size, that was written
+		uint64_t m_minSize = 0;
+
+		size_t m_alignment = 1;
+
+		bool m_deduplicate = false;
+		std::unordered_map<DedupKey, DedupEntry, DedupKeyHash> m_dedupEntries;
+
+		// Cleared if Append fails, so the existing archive is left intact
+		bool m_valid = true;
+
+		std::map<int, int> m_compressionLevels;
+		std::shared_ptr<const CompressionPolicy> m_compressionPolicy;
+
+		ThreadPool* m_pool = nullptr;
+		size_t m_maxPendingEntries = 0;
+		std::deque<PendingEntryPtr> m_pending;
+		std::mutex m_pendingMutex;
+		std::condition_variable m_pendingCondition;
+		Status m_pendingStatus = true;
 	};
+
+	// Opens archive, that entries can be added to, see ZipWriter::Append. File has to be opened for update (kReadUpdate).
+	// Merged central directory is written when the last copy of the returned archive is destroyed. Reading and adding
+	// entries must not happen concurrently.
+	inline Archive OpenZipArchiveForAppend(const File& archive)
+	{
+		auto zipReader = std::make_shared<ZipReader>();
+		if (!zipReader->OpenArchive(archive))
+		{
+			return Archive();
+		}
+		auto zipWriter = std::make_shared<ZipWriter>(archive);
+		if (!zipWriter->Append())
+		{
+			return Archive();
+		}
+		return Archive(zipReader, zipWriter);
+	}
 }
@@ -1,6 +1,8 @@
 #pragma once
 #include "FileStream.h"
+#include "AsyncIO.h"
 #include "FileSystem.h"
 #include "ReadWriteShortcuts.h"
 #include "ZipArchive.h"
+#include "CompressionPolicy.h"
 #include "VpkArchive.h"
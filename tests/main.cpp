@@ -1,6 +1,12 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <fsal.h>
+#include <MemRefFile.h>
+#include <SubFile.h>
 #include "doctest.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
 
 
 TEST_CASE("API_demo")
@@ -161,6 +167,770 @@ TEST_CASE("CreateZIP_LZ4")
 	}
 }
 
+TEST_CASE("CreateZIP_ZSTD")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+	std::string original = fs.Open("tests/main.cpp");
+	{
+		auto zipfile = fs.Open("out_archive_zstd.zip", fsal::kWrite);
+		fsal::ZipWriter zip(zipfile);
+		CHECK(zipfile);
+
+		zip.SetCompressionLevel(fsal::ZIP_COMPRESSION::ZSTD, 3);
+		CHECK(zip.AddFile("tests/main.cpp", fs.Open("tests/main.cpp"), fsal::ZIP_COMPRESSION::ZSTD));
+	}
+	{
+		fsal::ZipReader zip;
+		CHECK(zip.OpenArchive(fs.Open("out_archive_zstd.zip")));
+
+		std::string decompressed = zip.OpenFile("tests/main.cpp");
+		CHECK(original == decompressed);
+
+		std::string buffer;
+		CHECK(zip.OpenFile("tests/main.cpp", [&buffer](size_t size){ buffer.resize(size); return &buffer[0]; }) != nullptr);
+		CHECK(buffer == original);
+	}
+}
+
+TEST_CASE("ParallelZipWriter")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	const char* files[] = {"CMakeLists.txt", "tests/main.cpp", "README.md", "sources/ZipArchive.cpp", "test_archive.zip"};
+	int methods[] = {fsal::ZIP_COMPRESSION::DEFLATE, fsal::ZIP_COMPRESSION::LZ4, fsal::ZIP_COMPRESSION::ZSTD, fsal::ZIP_COMPRESSION::NONE};
+
+	auto write = [&](const char* name, fsal::ThreadPool* pool)
+	{
+		auto zipfile = fs.Open(name, fsal::kWrite);
+		fsal::ZipWriter zip(zipfile);
+		zip.SetThreadPool(pool, 3);
+		for (int i = 0; i < 20; ++i)
+		{
+			if (i % 7 == 0)
+			{
+				CHECK(zip.CreateDirectory("dir" + std::to_string(i)));
+			}
+			CHECK(zip.AddFile("file" + std::to_string(i), fs.Open(files[i % 5]), methods[i % 4]));
+		}
+		CHECK(zip.Flush());
+	};
+
+	fsal::ThreadPool pool(4);
+	write("out_archive_sequential.zip", nullptr);
+	write("out_archive_parallel.zip", &pool);
+
+	// Output does not depend on the order, in which entries are compressed
+	std::string sequential = fs.Open("out_archive_sequential.zip");
+	std::string parallel = fs.Open("out_archive_parallel.zip");
+	CHECK(sequential == parallel);
+
+	fsal::ZipReader zip;
+	CHECK(zip.OpenArchive(fs.Open("out_archive_parallel.zip", fsal::kRead, true)));
+	for (int i = 0; i < 20; ++i)
+	{
+		std::string reference = fs.Open(files[i % 5]);
+		std::string content = zip.OpenFile("file" + std::to_string(i));
+		CHECK(content == reference);
+	}
+	CHECK(zip.Exists("dir14", fsal::kDirectory));
+
+	// File, that ends before its reported size, is not added, entries before it are
+	class ShortFile: public fsal::MemRefFile
+	{
+	public:
+		ShortFile(): fsal::MemRefFile((uint8_t*)"short", 5, true)
+		{}
+
+		size_t GetSize() const override { return 64; }
+
+		const uint8_t* GetDataPointer() const override { return nullptr; }
+
+		uint8_t* GetDataPointer() override { return nullptr; }
+	};
+	{
+		auto zipfile = fs.Open("out_archive_short.zip", fsal::kWrite);
+		fsal::ZipWriter writer(zipfile);
+		writer.SetThreadPool(&pool, 3);
+		CHECK(writer.AddFile("first", fs.Open(files[0]), fsal::ZIP_COMPRESSION::DEFLATE));
+		CHECK(!writer.AddFile("short", fsal::File(new ShortFile()), fsal::ZIP_COMPRESSION::DEFLATE));
+		CHECK(writer.Flush());
+	}
+	fsal::ZipReader shortZip;
+	CHECK(shortZip.OpenArchive(fs.Open("out_archive_short.zip", fsal::kRead, true)));
+	CHECK(std::string(shortZip.OpenFile("first")) == std::string(fs.Open(files[0])));
+	CHECK(!shortZip.Exists("short"));
+}
+
+TEST_CASE("ReadAt")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	fs.Open("read_at.txt", fsal::kWrite) = std::string("0123456789");
+	fsal::File files[] = {fs.Open("read_at.txt"), fsal::File(new fsal::MemRefFile((uint8_t*)"0123456789", 10, true))};
+	for (auto& file: files)
+	{
+		char buffer[8] = {};
+		size_t bytesRead = 0;
+		file.Seek(2);
+		CHECK(file.ReadAt(5, (uint8_t*)buffer, 3, &bytesRead));
+		CHECK(std::string(buffer, bytesRead) == "567");
+		CHECK(file.Tell() == 2);
+
+		fsal::Status status = file.ReadAt(8, (uint8_t*)buffer, 4, &bytesRead);
+		CHECK(status.ok());
+		CHECK(status.is_eof());
+		CHECK(std::string(buffer, bytesRead) == "89");
+		CHECK(file.ReadAt(12, (uint8_t*)buffer, 4, &bytesRead).is_eof());
+		CHECK(bytesRead == 0);
+	}
+
+	const char* sources[] = {"CMakeLists.txt", "tests/main.cpp", "README.md", "sources/ZipArchive.cpp"};
+	int methods[] = {fsal::ZIP_COMPRESSION::DEFLATE, fsal::ZIP_COMPRESSION::NONE, fsal::ZIP_COMPRESSION::LZ4, fsal::ZIP_COMPRESSION::NONE};
+	{
+		fsal::ZipWriter zip(fs.Open("out_archive_read_at.zip", fsal::kWrite));
+		for (int i = 0; i < 8; ++i)
+		{
+			CHECK(zip.AddFile("file" + std::to_string(i), fs.Open(sources[i % 4]), methods[i % 4]));
+		}
+	}
+
+	// Archive file is neither lockable nor mapped, so readers share it through positional reads only
+	fsal::ZipReader zip;
+	CHECK(zip.OpenArchive(fs.Open("out_archive_read_at.zip", fsal::kRead)));
+	std::atomic<int> failures(0);
+	std::vector<std::thread> readers;
+	for (int t = 0; t < 4; ++t)
+	{
+		readers.emplace_back([&]()
+		{
+			for (int n = 0; n < 20; ++n)
+			{
+				for (int i = 0; i < 8; ++i)
+				{
+					std::string reference = fs.Open(sources[i % 4]);
+					fsal::File file = zip.OpenFile("file" + std::to_string(i));
+					if (!file || std::string(file) != reference)
+					{
+						++failures;
+					}
+				}
+			}
+		});
+	}
+	for (auto& thread: readers)
+	{
+		thread.join();
+	}
+	CHECK(failures == 0);
+}
+
+TEST_CASE("ReadRanges")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	fs.Open("read_ranges.txt", fsal::kWrite) = std::string("__0123456789abcdef");
+	fsal::File disk = fs.Open("read_ranges.txt");
+	fsal::File files[] = {
+		fsal::File(new fsal::SubFile(disk.GetInterface(), 16, 2)),
+		fsal::File(new fsal::MemRefFile((uint8_t*)"0123456789abcdef", 16, true))
+	};
+	for (auto& file: files)
+	{
+		char buffer[32] = {};
+		fsal::ReadRange ranges[] = {
+			{8, (uint8_t*)buffer + 0, 4, 0},
+			{0, (uint8_t*)buffer + 4, 2, 0},
+			{2, (uint8_t*)buffer + 6, 3, 0},
+			{14, (uint8_t*)buffer + 9, 4, 0},
+			{20, (uint8_t*)buffer + 13, 2, 0}
+		};
+		fsal::Status status = file.ReadRanges(ranges, 5);
+		CHECK(status.ok());
+		CHECK(status.is_eof());
+		CHECK(ranges[0].bytesRead == 4);
+		CHECK(ranges[1].bytesRead == 2);
+		CHECK(ranges[2].bytesRead == 3);
+		CHECK(ranges[3].bytesRead == 2);
+		CHECK(ranges[4].bytesRead == 0);
+		CHECK(std::string(buffer, 11) == "89ab01234ef");
+
+		fsal::ReadRange whole[] = {{0, (uint8_t*)buffer, 10, 0}, {10, (uint8_t*)buffer + 10, 6, 0}};
+		status = file.ReadRanges(whole, 2);
+		CHECK(status.ok());
+		CHECK(!status.is_eof());
+		CHECK(std::string(buffer, 16) == "0123456789abcdef");
+	}
+}
+
+TEST_CASE("AsyncRead")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	std::string content;
+	for (int i = 0; i < 4096; ++i)
+	{
+		content += std::to_string(i) + ",";
+	}
+	fs.Open("async_read.txt", fsal::kWrite) = content;
+
+	const char* sources[] = {"CMakeLists.txt", "tests/main.cpp", "README.md", "sources/ZipArchive.cpp"};
+	int methods[] = {fsal::ZIP_COMPRESSION::NONE, fsal::ZIP_COMPRESSION::DEFLATE, fsal::ZIP_COMPRESSION::LZ4, fsal::ZIP_COMPRESSION::ZSTD};
+	{
+		fsal::ZipWriter zip(fs.Open("out_archive_async.zip", fsal::kWrite));
+		for (int i = 0; i < 8; ++i)
+		{
+			CHECK(zip.AddFile("file" + std::to_string(i), fs.Open(sources[i % 4]), methods[i % 4]));
+		}
+	}
+
+	fsal::AsyncEngine uring(16);
+	fsal::AsyncEngine pooled(16, nullptr, false);
+	CHECK(!pooled.UsesIoUring());
+	for (fsal::AsyncEngine* current: {&uring, &pooled})
+	{
+		fsal::AsyncEngine& engine = *current;
+		// More reads, than the queue depth, are in flight
+		fsal::File file = fs.Open("async_read.txt");
+		std::string buffer(content.size(), '\0');
+		std::vector<fsal::AsyncResult<size_t>> reads;
+		for (size_t offset = 0; offset < content.size(); offset += 64)
+		{
+			reads.push_back(engine.Read(file, offset, (uint8_t*)&buffer[offset], std::min<size_t>(64, content.size() - offset)));
+		}
+		for (auto& read: reads)
+		{
+			CHECK(read.Wait());
+		}
+		CHECK(buffer == content);
+
+		// Reads, that are chained from a completion callback, exceed the queue depth too
+		std::string chained(content.size(), '\0');
+		std::mutex chainedMutex;
+		std::vector<fsal::AsyncResult<size_t>> chainedReads;
+		engine.Read(file, 0, (uint8_t*)&chained[0], 64).Then([&](fsal::Status, size_t)
+		{
+			std::lock_guard<std::mutex> lock(chainedMutex);
+			for (size_t offset = 64; offset < content.size(); offset += 64)
+			{
+				chainedReads.push_back(engine.Read(file, offset, (uint8_t*)&chained[offset], std::min<size_t>(64, content.size() - offset)));
+			}
+		});
+		for (;;)
+		{
+			std::lock_guard<std::mutex> lock(chainedMutex);
+			if (!chainedReads.empty())
+			{
+				break;
+			}
+		}
+		for (auto& read: chainedReads)
+		{
+			CHECK(read.Wait());
+		}
+		CHECK(chained == content);
+
+		char tail[16];
+		fsal::AsyncResult<size_t> read = engine.Read(file, content.size() - 4, (uint8_t*)tail, sizeof(tail));
+		CHECK(read.Wait().is_eof());
+		CHECK(read.Get() == 4);
+
+		std::atomic<int> callbacks(0);
+		engine.Read(file, 0, (uint8_t*)tail, 4).Then([&callbacks](fsal::Status status, size_t bytesRead)
+		{
+			callbacks += status.ok() && bytesRead == 4;
+		});
+
+		auto reader = std::make_shared<fsal::ZipReader>();
+		CHECK(reader->OpenArchive(fs.Open("out_archive_async.zip")));
+		fsal::Archive archive(reader);
+		reader.reset();
+		std::vector<fsal::AsyncResult<fsal::File>> opens;
+		for (int i = 0; i < 8; ++i)
+		{
+			opens.push_back(archive.OpenFileAsync("file" + std::to_string(i), engine));
+		}
+		fsal::AsyncResult<fsal::File> missing = archive.OpenFileAsync("missing", engine);
+		for (int i = 0; i < 8; ++i)
+		{
+			CHECK(opens[i].Wait());
+			CHECK(std::string(opens[i].Get()) == std::string(fs.Open(sources[i % 4])));
+		}
+		CHECK(!missing.Wait());
+
+		// Stored entry is a subfile of the archive, which is read with the engine too
+		std::string reference = fs.Open(sources[0]);
+		std::string stored(reference.size() + 8, '\0');
+		read = engine.Read(opens[0].Get(), 0, (uint8_t*)&stored[0], stored.size());
+		CHECK(read.Wait().is_eof());
+		CHECK(stored.substr(0, read.Get()) == reference);
+
+		while (callbacks == 0)
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	// Destruction waits for the reads, that are on the pool or in the ring
+	for (bool useIoUring: {true, false})
+	{
+		std::atomic<int> completed(0);
+		std::string buffer(content.size(), '\0');
+		{
+			fsal::AsyncEngine engine(4, nullptr, useIoUring);
+			fsal::File file = fs.Open("async_read.txt");
+			for (size_t offset = 0; offset < content.size(); offset += 1024)
+			{
+				engine.Read(file, offset, (uint8_t*)&buffer[offset], std::min<size_t>(1024, content.size() - offset)).Then([&completed](fsal::Status status, size_t)
+				{
+					completed += status.ok();
+				});
+			}
+		}
+		CHECK(completed == (int)((content.size() + 1023) / 1024));
+		CHECK(buffer == content);
+	}
+}
+
+TEST_CASE("StreamingZipWriter")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	// Larger than a chunk, so entries are compressed in several steps
+	std::string original;
+	uint32_t x = 7;
+	while (original.size() < 3000000)
+	{
+		x = x * 1103515245 + 12345;
+		original += std::to_string(x % 5000) + ",";
+	}
+	fs.Open(fsal::Location("streamed.txt", fsal::Location::kCurrentDirectory), fsal::kWrite) = original;
+
+	int methods[] = {fsal::ZIP_COMPRESSION::DEFLATE, fsal::ZIP_COMPRESSION::LZ4, fsal::ZIP_COMPRESSION::ZSTD, fsal::ZIP_COMPRESSION::NONE};
+	{
+		auto zipfile = fs.Open("out_archive_streamed.zip", fsal::kWrite);
+		fsal::ZipWriter zip(zipfile);
+		for (int method: methods)
+		{
+			auto file = fs.Open(fsal::Location("streamed.txt", fsal::Location::kCurrentDirectory));
+			CHECK(file.GetDataPointer() == nullptr);
+			CHECK(zip.AddFile("streamed_" + std::to_string(method), file, method));
+		}
+	}
+	{
+		fsal::ZipReader zip;
+		CHECK(zip.OpenArchive(fs.Open("out_archive_streamed.zip", fsal::kRead, true)));
+		for (int method: methods)
+		{
+			std::string content = zip.OpenFile("streamed_" + std::to_string(method));
+			CHECK(content == original);
+		}
+	}
+}
+
+TEST_CASE("VerifyCrc")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	{
+		fsal::ZipReader zip;
+		CHECK(zip.OpenArchive(fs.Open("test_archive.zip", fsal::kRead, true)));
+		CHECK(zip.VerifyArchive());
+	}
+
+	std::string archive = fs.Open("out_archive_parallel.zip");
+	{
+		fsal::ZipReader zip;
+		CHECK(zip.OpenArchive(fsal::File(new fsal::MemRefFile((uint8_t*)&archive[0], archive.size(), false))));
+		CHECK(zip.VerifyArchive());
+	}
+
+	// Flipping a byte of the stored entry, that does not break the structure of the archive
+	std::string reference = fs.Open("CMakeLists.txt");
+	size_t position = archive.find(reference);
+	REQUIRE(position != std::string::npos);
+	archive[position + 10] ^= 1;
+	{
+		fsal::ZipReader zip;
+		CHECK(zip.OpenArchive(fsal::File(new fsal::MemRefFile((uint8_t*)&archive[0], archive.size(), false))));
+		std::vector<std::string> corrupted;
+		CHECK(!zip.VerifyArchive(&corrupted));
+		CHECK(corrupted.size() == 1);
+		CHECK(zip.OpenFile(corrupted[0]));
+
+		zip.SetVerifyCrc(true);
+		CHECK(!zip.OpenFile(corrupted[0]));
+		std::string content = zip.OpenFile("file1");
+		std::string original = fs.Open("tests/main.cpp");
+		CHECK(content == original);
+	}
+}
+
+TEST_CASE("CorruptDeflateEntry")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	std::string reference = fs.Open("CMakeLists.txt");
+	fsal::File zipfile(new fsal::MemRefFile());
+	{
+		fsal::ZipWriter zip(zipfile);
+		CHECK(zip.AddFile("bad", fs.Open("CMakeLists.txt"), fsal::ZIP_COMPRESSION::DEFLATE));
+		CHECK(zip.AddFile("good", fs.Open("CMakeLists.txt"), fsal::ZIP_COMPRESSION::DEFLATE));
+	}
+	std::string archive((const char*)zipfile.GetDataPointer(), zipfile.GetSize());
+
+	// First block of the first entry gets invalid type, so inflate fails right away with input left
+	fsal::LocalFileHeader header;
+	memcpy(&header, &archive[0], sizeof(header));
+	archive[sizeof(header) + header.fileNameLength + header.extraFieldLength] = (char)0xFF;
+
+	fsal::ZipReader zip;
+	CHECK(zip.OpenArchive(fsal::File(new fsal::MemRefFile((uint8_t*)&archive[0], archive.size(), false))));
+
+	// Failed entry does not affect later entries, that are decompressed on the same thread
+	CHECK(!zip.OpenFile("bad"));
+	CHECK(std::string(zip.OpenFile("good")) == reference);
+	CHECK(std::string(zip.OpenFile("good")) == reference);
+}
+
+TEST_CASE("OversizedEntry")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	fsal::File zipfile(new fsal::MemRefFile());
+	{
+		fsal::ZipWriter zip(zipfile);
+		CHECK(zip.AddFile("stored", fs.Open("CMakeLists.txt"), fsal::ZIP_COMPRESSION::NONE));
+		CHECK(zip.AddFile("deflated", fs.Open("CMakeLists.txt"), fsal::ZIP_COMPRESSION::DEFLATE));
+	}
+	std::string archive((const char*)zipfile.GetDataPointer(), zipfile.GetSize());
+
+	// Central directory claims, that entries are larger than the archive
+	fsal::EndOfCentralDirectoryRecord ecdr;
+	memcpy(&ecdr, &archive[archive.size() - sizeof(ecdr)], sizeof(ecdr));
+	size_t position = ecdr.offsetOfStartOfCentralDirectory;
+	for (int i = 0; i < 2; ++i)
+	{
+		fsal::CentralDirectoryHeader header;
+		memcpy(&header, &archive[position], sizeof(header));
+		header.dataDescriptor.compressedSize = (uint32_t)archive.size();
+		header.dataDescriptor.uncompressedSize = (uint32_t)archive.size();
+		memcpy(&archive[position], &header, sizeof(header));
+		position += sizeof(header) + header.fileNameLength + header.extraFieldLength + header.fileCommentLength;
+	}
+
+	// Archive is mapped, so reads past the end would not fail on their own
+	fsal::ZipReader zip;
+	CHECK(zip.OpenArchive(fsal::File(new fsal::MemRefFile((uint8_t*)&archive[0], archive.size(), false))));
+	std::vector<uint8_t> buffer(archive.size());
+	for (const char* path: {"stored", "deflated"})
+	{
+		CHECK(!zip.OpenFile(path));
+		CHECK(!zip.ReadFile(path, buffer.data(), buffer.size()));
+	}
+	CHECK(!zip.VerifyArchive());
+}
+
+TEST_CASE("LZ4Frame")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	// Several blocks of the frame, so they are decoded in parallel
+	std::string original;
+	uint32_t x = 1;
+	while (original.size() < 3500000)
+	{
+		x = x * 1103515245 + 12345;
+		original += std::to_string(x % 1000) + " ";
+	}
+	{
+		auto zipfile = fs.Open("out_archive_lz4_frame.zip", fsal::kWrite);
+		fsal::ZipWriter zip(zipfile);
+		CHECK(zip.AddFile("data.txt", fsal::File(new fsal::MemRefFile((uint8_t*)&original[0], original.size(), false)), fsal::ZIP_COMPRESSION::LZ4));
+	}
+	std::string archive = fs.Open("out_archive_lz4_frame.zip");
+	{
+		fsal::ZipReader zip;
+		CHECK(zip.OpenArchive(fsal::File(new fsal::MemRefFile((uint8_t*)&archive[0], archive.size(), false))));
+		std::string decompressed = zip.OpenFile("data.txt");
+		CHECK(decompressed == original);
+
+		std::string buffer;
+		CHECK(zip.OpenFile("data.txt", [&buffer](size_t size){ buffer.resize(size); return &buffer[0]; }) != nullptr);
+		CHECK(buffer == original);
+	}
+	{
+		// Corrupted data must not be decoded
+		for (size_t i = 200; i < archive.size() / 2; i += 997)
+		{
+			archive[i] ^= 0x5a;
+		}
+		fsal::ZipReader zip;
+		CHECK(zip.OpenArchive(fsal::File(new fsal::MemRefFile((uint8_t*)&archive[0], archive.size(), false))));
+		fsal::File file = zip.OpenFile("data.txt");
+		CHECK(!file);
+	}
+}
+
+TEST_CASE("CompressionPolicy")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	std::string text;
+	std::string noise;
+	uint32_t x = 3;
+	while (text.size() < 200000)
+	{
+		x = x * 1103515245 + 12345;
+		text += std::to_string(x % 100) + " ";
+		noise.push_back((char)(x >> 24));
+	}
+
+	auto policy = std::make_shared<fsal::CompressionPolicy>();
+	policy->StoreCompressedFormats();
+
+	auto probing = std::make_shared<fsal::CompressionPolicy>(fsal::ZIP_COMPRESSION::ZSTD);
+	probing->SetProbeSize(4096);
+
+	// Compresses by less than the minimal saving, so it is stored
+	std::string poor = noise + std::string(noise.size() / 50, ' ');
+
+	fsal::ThreadPool pool(2);
+	std::string archives[2];
+	for (int parallel = 0; parallel < 2; ++parallel)
+	{
+		fsal::File zipfile(new fsal::MemRefFile());
+		{
+			fsal::ZipWriter zip(zipfile);
+			if (parallel)
+			{
+				zip.SetThreadPool(&pool);
+			}
+			auto make = [](std::string& data){ return fsal::File(new fsal::MemRefFile((uint8_t*)&data[0], data.size(), false)); };
+			zip.SetCompressionPolicy(policy);
+			CHECK(zip.AddFile("image.PNG", make(text)));
+			CHECK(zip.AddFile("text.txt", make(text)));
+			CHECK(zip.AddFile("noise_fallback.bin", make(noise)));
+			CHECK(zip.AddFile("noise_deflate.bin", make(noise), fsal::ZIP_COMPRESSION::DEFLATE));
+			CHECK(zip.AddFile("poor.bin", make(poor)));
+			zip.SetCompressionPolicy(probing);
+			CHECK(zip.AddFile("noise_probe.bin", make(noise)));
+			CHECK(zip.AddFile("text_probe.txt", make(text)));
+			CHECK(zip.Flush());
+		}
+		std::string& archive = archives[parallel];
+		archive.assign((const char*)zipfile.GetDataPointer(), zipfile.GetSize());
+
+		fsal::ZipReader zip;
+		CHECK(zip.OpenArchive(fsal::File(new fsal::MemRefFile((uint8_t*)&archive[0], archive.size(), false))));
+		CHECK(zip.VerifyArchive());
+
+		// Stored entries of a mapped archive point into the archive itself
+		auto isStored = [&archive, &zip](const char* path)
+		{
+			fsal::File file = zip.OpenFile(path);
+			const uint8_t* data = file.GetDataPointer();
+			return data >= (const uint8_t*)&archive[0] && data < (const uint8_t*)&archive[0] + archive.size();
+		};
+		CHECK(isStored("image.PNG"));
+		CHECK(!isStored("text.txt"));
+		CHECK(isStored("noise_fallback.bin"));
+		CHECK(!isStored("noise_deflate.bin"));
+		CHECK(isStored("poor.bin"));
+		CHECK(isStored("noise_probe.bin"));
+		CHECK(!isStored("text_probe.txt"));
+
+		CHECK(std::string(zip.OpenFile("image.PNG")) == text);
+		CHECK(std::string(zip.OpenFile("text_probe.txt")) == text);
+		CHECK(std::string(zip.OpenFile("noise_fallback.bin")) == noise);
+		CHECK(std::string(zip.OpenFile("noise_deflate.bin")) == noise);
+		CHECK(std::string(zip.OpenFile("poor.bin")) == poor);
+	}
+
+	// Output does not depend on whether entries are compressed on the pool or streamed
+	CHECK(archives[0] == archives[1]);
+
+	// Streamed entry, that is rewritten as stored, is shorter than the compressed one. If it is the last one, the gap
+	// is padded, so the end of central directory record stays at the end of the archive.
+	std::string largeNoise;
+	while (largeNoise.size() < 2 * 1024 * 1024)
+	{
+		x = x * 1103515245 + 12345;
+		largeNoise.push_back((char)(x >> 24));
+	}
+	{
+		fsal::ZipWriter zip(fs.Open("out_archive_stored_fallback.zip", fsal::kWrite));
+		zip.SetCompressionPolicy(policy);
+		CHECK(zip.AddFile("noise.bin", fsal::File(new fsal::MemRefFile((uint8_t*)&largeNoise[0], largeNoise.size(), false))));
+	}
+	std::string written = fs.Open("out_archive_stored_fallback.zip");
+	uint32_t signature = 0;
+	memcpy(&signature, &written[written.size() - sizeof(fsal::EndOfCentralDirectoryRecord)], sizeof(signature));
+	CHECK(signature == fsal::ZIP_SIGNATURES::END_OF_CENTRAL_DIRECTORY_SIGN);
+	fsal::ZipReader zip;
+	CHECK(zip.OpenArchive(fs.Open("out_archive_stored_fallback.zip")));
+	CHECK(std::string(zip.OpenFile("noise.bin")) == largeNoise);
+}
+
+TEST_CASE("AppendZIP")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	std::string first = "first version of the file, first version of the file";
+	std::string second = "second version";
+	std::string added = "added later, added later, added later";
+	auto make = [](std::string& data){ return fsal::File(new fsal::MemRefFile((uint8_t*)&data[0], data.size(), false)); };
+	{
+		auto zipfile = fs.Open("out_archive_append.zip", fsal::kWrite);
+		fsal::ZipWriter zip(zipfile);
+		CHECK(zip.AddFile("a.txt", make(first)));
+		CHECK(zip.AddFile("b.txt", make(first), fsal::ZIP_COMPRESSION::NONE));
+	}
+	{
+		fsal::Archive archive = fsal::OpenZipArchiveForAppend(fs.Open("out_archive_append.zip", fsal::kReadUpdate, true));
+		REQUIRE(archive.Valid());
+		CHECK(std::string(archive.OpenFile("a.txt")) == first);
+		CHECK(archive.AddFile("a.txt", make(second), fsal::ZIP_COMPRESSION::DEFLATE));
+		CHECK(archive.AddFile("dir/c.txt", make(added), fsal::ZIP_COMPRESSION::LZ4));
+		CHECK(archive.CreateDirectory("empty"));
+	}
+	{
+		// Appending nothing keeps the archive valid
+		fsal::Archive archive = fsal::OpenZipArchiveForAppend(fs.Open("out_archive_append.zip", fsal::kReadUpdate, true));
+		REQUIRE(archive.Valid());
+	}
+	{
+		fsal::ZipReader zip;
+		CHECK(zip.OpenArchive(fs.Open("out_archive_append.zip", fsal::kRead, true)));
+		CHECK(zip.VerifyArchive());
+		CHECK(std::string(zip.OpenFile("a.txt")) == second);
+		CHECK(std::string(zip.OpenFile("b.txt")) == first);
+		CHECK(std::string(zip.OpenFile("dir/c.txt")) == added);
+		CHECK(zip.Exists("empty", fsal::kDirectory));
+	}
+
+	// Reader only archive can not be written to
+	fsal::Archive archive = fsal::OpenZipArchive(fs.Open("out_archive_append.zip", fsal::kRead, true));
+	CHECK(!archive.AddFile("d.txt", make(added), fsal::ZIP_COMPRESSION::NONE));
+}
+
+TEST_CASE("DeduplicatingZipWriter")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	std::string shared;
+	uint32_t x = 11;
+	while (shared.size() < 100000)
+	{
+		x = x * 1103515245 + 12345;
+		shared += std::to_string(x % 1000) + " ";
+	}
+	std::string other = shared;
+	other[other.size() / 2] = '#';
+	fs.Open(fsal::Location("dedup.txt", fsal::Location::kCurrentDirectory), fsal::kWrite) = shared;
+
+	auto make = [](std::string& data){ return fsal::File(new fsal::MemRefFile((uint8_t*)&data[0], data.size(), false)); };
+
+	fsal::ThreadPool pool(2);
+	size_t sizes[2] = {0, 0};
+	for (int parallel = 0; parallel < 2; ++parallel)
+	{
+		fsal::File zipfile(new fsal::MemRefFile());
+		{
+			fsal::ZipWriter zip(zipfile);
+			if (parallel)
+			{
+				zip.SetThreadPool(&pool);
+			}
+			zip.SetDeduplication(true);
+			CHECK(zip.AddFile("a/shared.txt", make(shared), fsal::ZIP_COMPRESSION::DEFLATE));
+			CHECK(zip.AddFile("b/shared.txt", fs.Open(fsal::Location("dedup.txt", fsal::Location::kCurrentDirectory))));
+			CHECK(zip.AddFile("stored.txt", make(other), fsal::ZIP_COMPRESSION::NONE));
+			CHECK(zip.AddFile("other.txt", make(other)));
+			CHECK(zip.AddFile("c/shared.txt", make(shared), fsal::ZIP_COMPRESSION::LZ4));
+			CHECK(zip.AddFile("stored_copy.txt", make(other), fsal::ZIP_COMPRESSION::NONE));
+		}
+		sizes[parallel] = zipfile.GetSize();
+		std::string archive((const char*)zipfile.GetDataPointer(), zipfile.GetSize());
+
+		fsal::ZipReader zip;
+		CHECK(zip.OpenArchive(fsal::File(new fsal::MemRefFile((uint8_t*)&archive[0], archive.size(), false))));
+		CHECK(zip.VerifyArchive());
+		CHECK(std::string(zip.OpenFile("a/shared.txt")) == shared);
+		CHECK(std::string(zip.OpenFile("b/shared.txt")) == shared);
+		CHECK(std::string(zip.OpenFile("c/shared.txt")) == shared);
+		CHECK(std::string(zip.OpenFile("other.txt")) == other);
+		CHECK(std::string(zip.OpenFile("stored_copy.txt")) == other);
+
+		// Duplicates share data of the first entry with the same content, including its compression method
+		CHECK(zip.OpenFile("stored_copy.txt").GetDataPointer() == zip.OpenFile("stored.txt").GetDataPointer());
+		CHECK(zip.OpenFile("other.txt").GetDataPointer() == zip.OpenFile("stored.txt").GetDataPointer());
+		CHECK(archive.size() < shared.size() + other.size() / 2);
+	}
+	CHECK(sizes[0] == sizes[1]);
+}
+
+TEST_CASE("AlignedZipWriter")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	std::string text = fs.Open("tests/main.cpp");
+	auto make = [](std::string& data){ return fsal::File(new fsal::MemRefFile((uint8_t*)&data[0], data.size(), false)); };
+
+	fsal::ThreadPool pool(2);
+	for (int parallel = 0; parallel < 2; ++parallel)
+	{
+		{
+			auto zipfile = fs.Open("out_archive_aligned.zip", fsal::kWrite);
+			fsal::ZipWriter zip(zipfile);
+			if (parallel)
+			{
+				zip.SetThreadPool(&pool);
+			}
+			CHECK(!zip.SetAlignment(3));
+			CHECK(zip.SetAlignment(4096));
+			CHECK(zip.AddFile("a", make(text), fsal::ZIP_COMPRESSION::NONE));
+			CHECK(zip.AddFile("deflated.cpp", make(text), fsal::ZIP_COMPRESSION::DEFLATE));
+			CHECK(zip.AddFile("some/longer/name.cpp", make(text), fsal::ZIP_COMPRESSION::NONE));
+			CHECK(zip.CreateDirectory("dir"));
+			CHECK(zip.Flush());
+			CHECK(zip.SetAlignment(64));
+			CHECK(zip.AddFile("b", make(text), fsal::ZIP_COMPRESSION::NONE));
+		}
+
+		fsal::File zipfile = fs.Open("out_archive_aligned.zip", fsal::kRead, false, true);
+		REQUIRE(zipfile.GetDataPointer() != nullptr);
+		fsal::ZipReader zip;
+		CHECK(zip.OpenArchive(zipfile));
+		CHECK(zip.VerifyArchive());
+
+		const char* stored[] = {"a", "some/longer/name.cpp", "b"};
+		size_t alignments[] = {4096, 4096, 64};
+		for (int i = 0; i < 3; ++i)
+		{
+			fsal::File file = zip.OpenFile(stored[i]);
+			const uint8_t* data = file.GetDataPointer();
+			CHECK(data >= zipfile.GetDataPointer());
+			CHECK((uintptr_t)data % alignments[i] == 0);
+			CHECK(std::string(file) == text);
+		}
+		CHECK(std::string(zip.OpenFile("deflated.cpp")) == text);
+	}
+}
+
 TEST_CASE("MountZIP")
 {
 	fsal::FileSystem fs;
@@ -190,6 +960,257 @@ TEST_CASE("MountZIP")
 	}
 }
 
+TEST_CASE("MountPriority")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	std::string contents[3] = {"first", "second", "third"};
+	fsal::Archive archives[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		fsal::File zipfile(new fsal::MemRefFile());
+		{
+			fsal::ZipWriter zip(zipfile);
+			CHECK(zip.AddFile("mount_priority/shared.txt", fsal::File(new fsal::MemRefFile((uint8_t*)&contents[i][0], contents[i].size(), false))));
+			CHECK(zip.AddFile("mount_priority/only" + std::to_string(i) + ".txt", fsal::File(new fsal::MemRefFile((uint8_t*)&contents[i][0], contents[i].size(), false))));
+			CHECK(zip.CreateDirectory("mount_priority/dir" + std::to_string(i)));
+		}
+		archives[i] = fsal::OpenZipArchive(zipfile);
+		CHECK(fs.MountArchive(archives[i]));
+	}
+
+	auto read = [&fs](const std::string& path)
+	{
+		fsal::File file = fs.Open(fsal::Location(path, fsal::Location::kArchives));
+		return file ? std::string(file) : std::string();
+	};
+
+	CHECK(read("mount_priority/shared.txt") == "first");
+	CHECK(read("mount_priority//only2.txt") == "third");
+	CHECK(fs.Exists(fsal::Location("mount_priority/dir1", fsal::Location::kArchives, fsal::kDirectory)));
+	CHECK(!fs.Exists(fsal::Location("mount_priority/missing.txt", fsal::Location::kArchives)));
+
+	CHECK(fs.UnmountArchive(archives[0]));
+	CHECK(!fs.UnmountArchive(archives[0]));
+	CHECK(read("mount_priority/shared.txt") == "second");
+	CHECK(!fs.Exists(fsal::Location("mount_priority/only0.txt", fsal::Location::kArchives)));
+
+	CHECK(fs.UnmountArchive(archives[1]));
+	CHECK(read("mount_priority/shared.txt") == "third");
+
+	// Remounted archive has the lowest priority
+	CHECK(fs.MountArchive(archives[0]));
+	CHECK(read("mount_priority/shared.txt") == "third");
+	CHECK(read("mount_priority/only0.txt") == "first");
+
+	CHECK(fs.UnmountArchive(archives[2]));
+	CHECK(fs.UnmountArchive(archives[0]));
+	CHECK(!fs.Exists(fsal::Location("mount_priority/shared.txt", fsal::Location::kArchives)));
+}
+
+TEST_CASE("ConcurrentMount")
+{
+	fsal::FileSystem fs;
+
+	std::string content = "concurrent";
+	fsal::File zipfile(new fsal::MemRefFile());
+	{
+		fsal::ZipWriter zip(zipfile);
+		CHECK(zip.AddFile("concurrent_mount/file.txt", fsal::File(new fsal::MemRefFile((uint8_t*)&content[0], content.size(), false))));
+	}
+	fsal::Archive base = fsal::OpenZipArchive(zipfile);
+	fsal::Archive other = fsal::OpenZipArchive(zipfile);
+	CHECK(fs.MountArchive(base));
+
+	// Lookups run while the other archive is mounted and unmounted, and search paths change
+	std::atomic<bool> stop(false);
+	std::atomic<int> failures(0);
+	std::vector<std::thread> readers;
+	for (int i = 0; i < 4; ++i)
+	{
+		readers.emplace_back([&fs, &stop, &failures, &content]()
+		{
+			while (!stop)
+			{
+				fsal::File file = fs.Open(fsal::Location("concurrent_mount/file.txt", fsal::Location::kSearchPathsAndArchives));
+				if (!file || std::string(file) != content)
+				{
+					++failures;
+				}
+			}
+		});
+	}
+	for (int i = 0; i < 200; ++i)
+	{
+		CHECK(fs.MountArchive(other));
+		fs.PushSearchPath("concurrent_mount_" + std::to_string(i));
+		CHECK(fs.UnmountArchive(other));
+		fs.PopSearchPath();
+	}
+	stop = true;
+	for (auto& thread: readers)
+	{
+		thread.join();
+	}
+	CHECK(failures == 0);
+
+	CHECK(fs.UnmountArchive(base));
+	CHECK(!fs.Exists(fsal::Location("concurrent_mount/file.txt", fsal::Location::kArchives)));
+}
+
+TEST_CASE("OpenAsync")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	const char* sources[] = {"CMakeLists.txt", "tests/main.cpp", "README.md", "sources/ZipArchive.cpp"};
+	int methods[] = {fsal::ZIP_COMPRESSION::DEFLATE, fsal::ZIP_COMPRESSION::NONE, fsal::ZIP_COMPRESSION::LZ4, fsal::ZIP_COMPRESSION::ZSTD};
+	{
+		fsal::ZipWriter zip(fs.Open("out_archive_open_async.zip", fsal::kWrite));
+		for (int i = 0; i < 8; ++i)
+		{
+			CHECK(zip.AddFile("open_async/file" + std::to_string(i), fs.Open(sources[i % 4]), methods[i % 4]));
+		}
+	}
+	fsal::Archive archive = fsal::OpenZipArchive(fs.Open("out_archive_open_async.zip"));
+	CHECK(fs.MountArchive(archive));
+
+	std::vector<fsal::AsyncResult<fsal::File>> opens;
+	for (int i = 0; i < 8; ++i)
+	{
+		opens.push_back(fs.OpenAsync(fsal::Location("open_async/file" + std::to_string(i), fsal::Location::kArchives)));
+	}
+	opens.push_back(fs.OpenAsync("CMakeLists.txt"));
+	opens.push_back(fs.OpenAsync(fsal::Location("open_async/missing", fsal::Location::kArchives)));
+
+	size_t any = fsal::WaitAny(opens);
+	CHECK(any < opens.size());
+	CHECK(opens[any].Ready());
+	fsal::WaitAll(opens);
+	for (int i = 0; i < 8; ++i)
+	{
+		CHECK(opens[i].Wait());
+		CHECK(std::string(opens[i].Get()) == std::string(fs.Open(sources[i % 4])));
+	}
+	CHECK(std::string(opens[8].Get()) == std::string(fs.Open(sources[0])));
+	CHECK(!opens[9].Wait());
+	CHECK(!opens[9].Get());
+
+	// Open, that is queued behind busy workers, is cancelled before it starts
+	fsal::ThreadPool& pool = fs.GetAsyncEngine().GetThreadPool();
+	std::mutex mutex;
+	std::unique_lock<std::mutex> busy(mutex);
+	for (size_t i = 0; i < pool.GetThreadCount(); ++i)
+	{
+		pool.Push([&mutex]()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+		});
+	}
+	fsal::AsyncResult<fsal::File> cancelled = fs.OpenAsync(fsal::Location("open_async/file0", fsal::Location::kArchives));
+	CHECK(cancelled.Cancel());
+	CHECK(!cancelled.Ready());
+	busy.unlock();
+	CHECK(!cancelled.Wait());
+	CHECK(cancelled.Cancelled());
+	CHECK(!cancelled.Cancel());
+
+	CHECK(fs.UnmountArchive(archive));
+}
+
+TEST_CASE("WaitAnyLoop")
+{
+	// Result, that stays pending, is waited on by every call, while the others complete one by one
+	std::vector<fsal::AsyncResult<int>> results(1000);
+	fsal::AsyncResult<int> pending = results[0];
+	std::thread completer([results]()
+	{
+		for (size_t i = 1; i < results.size(); ++i)
+		{
+			results[i].Complete(true, (int)i);
+		}
+	});
+
+	std::vector<fsal::AsyncResult<int>> remaining = results;
+	int sum = 0;
+	while (remaining.size() > 1)
+	{
+		size_t any = fsal::WaitAny(remaining);
+		REQUIRE(any > 0);
+		REQUIRE(any < remaining.size());
+		CHECK(remaining[any].Ready());
+		sum += remaining[any].Get();
+		remaining.erase(remaining.begin() + any);
+	}
+	completer.join();
+	CHECK(sum == 999 * 1000 / 2);
+	CHECK(!pending.Ready());
+
+	pending.Complete(true, 0);
+	CHECK(fsal::WaitAny(remaining) == 0);
+	CHECK(fsal::WaitAny(std::vector<fsal::AsyncResult<int>>()) == 0);
+}
+
+TEST_CASE("Prefetch")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	const char* sources[] = {"CMakeLists.txt", "tests/main.cpp", "README.md", "sources/ZipArchive.cpp"};
+	int methods[] = {fsal::ZIP_COMPRESSION::DEFLATE, fsal::ZIP_COMPRESSION::NONE, fsal::ZIP_COMPRESSION::LZ4, fsal::ZIP_COMPRESSION::ZSTD};
+	{
+		fsal::ZipWriter zip(fs.Open("out_archive_prefetch.zip", fsal::kWrite));
+		for (int i = 0; i < 8; ++i)
+		{
+			CHECK(zip.AddFile("prefetch/file" + std::to_string(i), fs.Open(sources[i % 4]), methods[i % 4]));
+		}
+	}
+
+	// Hints are accepted by disk files, mapped files and memory files, also out of range
+	fs.Open("CMakeLists.txt").Prefetch();
+	fs.Open("CMakeLists.txt", fsal::kRead, false, true).Prefetch(16, 1024);
+	fs.Open("CMakeLists.txt", fsal::kRead, false, true).Prefetch(1 << 30);
+	fsal::File(new fsal::MemRefFile()).Prefetch();
+
+	for (bool mapped: {false, true})
+	{
+		auto* reader = new fsal::ZipReader();
+		CHECK(reader->OpenArchive(fs.Open("out_archive_prefetch.zip", fsal::kRead, false, mapped)));
+		reader->SetCacheBudget(16 * 1024 * 1024);
+		fsal::Archive archive(fsal::ArchiveReaderInterfacePtr((fsal::ArchiveReaderInterface*)reader));
+		CHECK(fs.MountArchive(archive));
+
+		std::vector<fsal::Location> locations;
+		for (int i = 7; i >= 0; --i)
+		{
+			locations.push_back(fsal::Location("prefetch/file" + std::to_string(i), fsal::Location::kArchives));
+		}
+		locations.push_back(fsal::Location("prefetch/file0", fsal::Location::kArchives));
+		locations.push_back(fsal::Location("prefetch/missing", fsal::Location::kArchives));
+		locations.push_back(fsal::Location("CMakeLists.txt"));
+		locations.push_back(fsal::Location("sources", fsal::Location::kSearchPaths, fsal::kDirectory));
+
+		fsal::AsyncResult<size_t> prefetch = fs.Prefetch(locations, true);
+		CHECK(prefetch.Wait());
+		CHECK(prefetch.Get() == 9);
+
+		// Compressed entries are in the cache, so opens share the decompressed buffer
+		for (int i = 0; i < 8; ++i)
+		{
+			fsal::File first = fs.Open(fsal::Location("prefetch/file" + std::to_string(i), fsal::Location::kArchives));
+			fsal::File second = fs.Open(fsal::Location("prefetch/file" + std::to_string(i), fsal::Location::kArchives));
+			CHECK(std::string(first) == std::string(fs.Open(sources[i % 4])));
+			if (methods[i % 4] != fsal::ZIP_COMPRESSION::NONE)
+			{
+				CHECK(first.GetDataPointer() == second.GetDataPointer());
+			}
+		}
+
+		CHECK(fs.UnmountArchive(archive));
+	}
+}
+
 TEST_CASE("MountUncompressedZIP")
 {
 	fsal::FileSystem fs;
@@ -226,6 +1247,544 @@ TEST_CASE("MountUncompressedZIP")
 	}
 }
 
+TEST_CASE("MountMappedZIP")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+	{
+		auto zipfile = fs.Open("zero_compression.zip", fsal::kRead, false, true);
+		CHECK(zipfile);
+		CHECK(zipfile.GetDataPointer() != nullptr);
+
+		fsal::ZipReader zip;
+		CHECK(zip.OpenArchive(zipfile));
+
+		// Stored entries are returned as views into the mapping
+		fsal::File file = zip.OpenFile("123/2.png");
+		CHECK(file);
+		CHECK(file.GetDataPointer() != nullptr);
+		CHECK(file.GetDataPointer() >= zipfile.GetDataPointer());
+		CHECK(file.GetDataPointer() + file.GetSize() <= zipfile.GetDataPointer() + zipfile.GetSize());
+
+		std::string content = file;
+		std::string reference = fs.Open("2.png");
+		CHECK(content == reference);
+
+		// Mapping is read-only, so writes fail instead of faulting
+		file.Seek(0);
+		CHECK(!file.Write((const uint8_t*)"xx", 2));
+	}
+	{
+		auto zipfile = fs.Open("test_archive.zip", fsal::kRead, false, true);
+		auto zip = fsal::OpenZipArchive(zipfile);
+		CHECK(zip.Valid());
+
+		std::string str = zip.OpenFile("test_folder/folder_inside/test_file.txt");
+		CHECK(str == "test");
+	}
+}
+
+TEST_CASE("StreamingInflate")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	fsal::ZipReader zip;
+	CHECK(zip.OpenArchive(fs.Open("test_archive.zip", fsal::kRead, true)));
+	std::string reference = zip.OpenFile("test_folder/folder_inside/123.png");
+
+	zip.SetStreamingThreshold(0);
+	fsal::File file = zip.OpenFile("test_folder/folder_inside/123.png");
+	CHECK(file);
+	CHECK(file.GetDataPointer() == nullptr);
+	CHECK(file.GetSize() == reference.size());
+
+	std::string content;
+	content.resize(file.GetSize());
+	size_t offset = 0;
+	while (true)
+	{
+		size_t bytesRead = 0;
+		auto status = file.Read((uint8_t*)&content[offset], 1000, &bytesRead);
+		CHECK(status.ok());
+		offset += bytesRead;
+		if (status.is_eof())
+			break;
+	}
+	CHECK(offset == reference.size());
+	CHECK(content == reference);
+
+	// Seeking backward and forward
+	uint8_t buff[16];
+	file.Seek(100);
+	file.Read(buff, 16);
+	CHECK(memcmp(buff, &reference[100], 16) == 0);
+	file.Seek(50000);
+	file.Read(buff, 16);
+	CHECK(memcmp(buff, &reference[50000], 16) == 0);
+}
+
+TEST_CASE("ScratchBufferLimit")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	fsal::ZipReader zip;
+	CHECK(zip.OpenArchive(fs.Open("test_archive.zip", fsal::kRead, true)));
+	std::string reference = zip.OpenFile("test_folder/folder_inside/123.png");
+	CHECK(!reference.empty());
+
+	// Entries larger than the limit are read to a temporary buffer
+	fsal::ZipReader::SetScratchBufferLimit(0);
+	std::string content = zip.OpenFile("test_folder/folder_inside/123.png");
+	CHECK(content == reference);
+
+	fsal::ZipReader::SetScratchBufferLimit(fsal::ZipReader::kDefaultScratchBufferLimit);
+	for (int i = 0; i < 100; ++i)
+	{
+		std::string str = zip.OpenFile("test_folder/folder_inside/test_file.txt");
+		CHECK(str == "test");
+	}
+	std::string again = zip.OpenFile("test_folder/folder_inside/123.png");
+	CHECK(again == reference);
+}
+
+TEST_CASE("EntryCache")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	fsal::ZipReader zip;
+	CHECK(zip.OpenArchive(fs.Open("test_archive.zip", fsal::kRead, true)));
+	std::string reference = zip.OpenFile("test_folder/folder_inside/123.png");
+
+	zip.SetCacheBudget(reference.size() + 2);
+	fsal::File first = zip.OpenFile("test_folder/folder_inside/123.png");
+	fsal::File second = zip.OpenFile("test_folder/folder_inside/123.png");
+	CHECK(first.GetDataPointer() == second.GetDataPointer());
+	std::string content = second;
+	CHECK(content == reference);
+
+	// Cached buffer is shared, so it can not be written through one of the files
+	first.Seek(0);
+	CHECK(!first.Write((const uint8_t*)"xx", 2));
+	CHECK(std::string(second) == reference);
+
+	// Does not fit the budget together with the previous entry, which gets evicted
+	std::string text = zip.OpenFile("test_folder/folder_inside/test_file.txt");
+	CHECK(text == "test");
+	fsal::File third = zip.OpenFile("test_folder/folder_inside/123.png");
+	CHECK(third.GetDataPointer() != first.GetDataPointer());
+
+	zip.TrimCache();
+	fsal::File fourth = zip.OpenFile("test_folder/folder_inside/123.png");
+	CHECK(fourth.GetDataPointer() != third.GetDataPointer());
+	std::string str = fourth;
+	CHECK(str == reference);
+}
+
+TEST_CASE("ReadFileToBuffer")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	fsal::Archive archive = fsal::OpenZipArchive(fs.Open("test_archive.zip", fsal::kRead, true));
+	CHECK(archive.Valid());
+	std::string reference = archive.OpenFile("test_folder/folder_inside/123.png");
+
+	size_t size = 0;
+	CHECK(archive.GetFileSize("test_folder/folder_inside/123.png", size));
+	CHECK(size == reference.size());
+
+	std::vector<uint8_t> buffer(size);
+	CHECK(!archive.ReadFile("test_folder/folder_inside/123.png", buffer.data(), size - 1));
+	CHECK(archive.ReadFile("test_folder/folder_inside/123.png", buffer.data(), size));
+	CHECK(memcmp(buffer.data(), reference.data(), size) == 0);
+
+	CHECK(!archive.GetFileSize("test_folder/no_such_file", size));
+	CHECK(!archive.ReadFile("test_folder/no_such_file", buffer.data(), buffer.size()));
+}
+
+TEST_CASE("DeflateIndex")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	std::string reference;
+	{
+		fsal::ZipReader zip;
+		CHECK(zip.OpenArchive(fs.Open("test_archive.zip", fsal::kRead, true)));
+		reference = std::string(zip.OpenFile("test_folder/folder_inside/123.png"));
+
+		zip.SetCheckpointSpan(8 * 1024);
+		fsal::File file = zip.OpenFile("test_folder/folder_inside/123.png");
+		CHECK(file.GetDataPointer() == nullptr);
+
+		// First pass builds the index
+		std::string content = file;
+		CHECK(content == reference);
+
+		// Random reads restart from checkpoints
+		uint8_t buff[64];
+		for (size_t offset: {60000, 10, 30000, 73000, 20000})
+		{
+			file.Seek(offset);
+			file.Read(buff, 64);
+			CHECK(memcmp(buff, &reference[offset], 64) == 0);
+		}
+
+		// Index is shared with other opens of the same entry
+		fsal::File other = zip.OpenFile("test_folder/folder_inside/123.png");
+		other.Seek(50000);
+		other.Read(buff, 64);
+		CHECK(memcmp(buff, &reference[50000], 64) == 0);
+
+		CHECK(zip.SaveDeflateIndex(fs.Open("out_archive_index.bin", fsal::kWrite)));
+	}
+	{
+		fsal::ZipReader zip;
+		CHECK(zip.OpenArchive(fs.Open("test_archive.zip", fsal::kRead, true)));
+		zip.SetCheckpointSpan(8 * 1024);
+		CHECK(zip.LoadDeflateIndex(fs.Open("out_archive_index.bin")));
+
+		fsal::File file = zip.OpenFile("test_folder/folder_inside/123.png");
+		uint8_t buff[64];
+		file.Seek(70000);
+		file.Read(buff, 64);
+		CHECK(memcmp(buff, &reference[70000], 64) == 0);
+	}
+
+	// Index is not applied to an archive of the same size, which central directory is different, and truncated
+	// index is rejected
+	std::string archive = fs.Open("test_archive.zip");
+	std::string changed = archive;
+	fsal::EndOfCentralDirectoryRecord ecdr;
+	memcpy(&ecdr, &changed[changed.size() - sizeof(ecdr)], sizeof(ecdr));
+	changed[ecdr.offsetOfStartOfCentralDirectory + sizeof(fsal::CentralDirectoryHeader)] ^= 1;
+
+	auto open = [](std::string& data)
+	{
+		auto* zip = new fsal::ZipReader();
+		CHECK(zip->OpenArchive(fsal::File(new fsal::MemRefFile((uint8_t*)&data[0], data.size(), false))));
+		zip->SetCheckpointSpan(8 * 1024);
+		return std::unique_ptr<fsal::ZipReader>(zip);
+	};
+	fsal::File index(new fsal::MemRefFile());
+	{
+		auto zip = open(archive);
+		std::string content = zip->OpenFile("test_folder/folder_inside/123.png");
+		CHECK(zip->SaveDeflateIndex(index));
+	}
+	std::string saved((const char*)index.GetDataPointer(), index.GetSize());
+	auto load = [&open](std::string& data, std::string indexData)
+	{
+		auto zip = open(data);
+		return (bool)zip->LoadDeflateIndex(fsal::File(new fsal::MemRefFile((uint8_t*)&indexData[0], indexData.size(), false)));
+	};
+	CHECK(load(archive, saved));
+	CHECK(!load(changed, saved));
+	CHECK(!load(archive, saved.substr(0, saved.size() - 100)));
+	CHECK(!load(archive, saved.substr(0, 40)));
+}
+
+TEST_CASE("CreateZIP64")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+	// More entries, than 16-bit fields can hold, so ZIP64 end of central directory is required
+	const int count = 70000;
+	{
+		auto zipfile = fs.Open("out_archive_zip64.zip", fsal::kWrite);
+		fsal::ZipWriter zip(zipfile);
+		auto file = fs.Open("somefile.bin");
+		for (int i = 0; i < count; ++i)
+		{
+			zip.AddFile("files/" + std::to_string(i) + ".bin", file, fsal::ZIP_COMPRESSION::NONE);
+		}
+	}
+	{
+		fsal::ZipReader zip;
+		CHECK(zip.OpenArchive(fs.Open("out_archive_zip64.zip", fsal::kRead, true)));
+		CHECK(zip.ListDirectory("files").size() == count);
+		std::string reference = fs.Open("somefile.bin");
+		std::string content = zip.OpenFile("files/" + std::to_string(count - 1) + ".bin");
+		CHECK(content == reference);
+	}
+}
+
+namespace
+{
+	// File in memory, that does not store chunks of zeros, so archives larger than 4 GiB fit
+	class SparseFile: public fsal::FileInterface
+	{
+	public:
+		enum
+		{
+			kChunkSize = 1 << 20
+		};
+
+		bool ok() const override { return true; }
+
+		fsal::path GetPath() const override { return "sparse"; }
+
+		fsal::Status Open(fsal::path filepath, fsal::Mode mode) override { return false; }
+
+		fsal::Status ReadData(uint8_t* dst, size_t size, size_t* bytesRead) override
+		{
+			size_t read = 0;
+			fsal::Status status = ReadDataAt(m_position, dst, size, &read);
+			m_position += read;
+			if (bytesRead != nullptr)
+			{
+				*bytesRead = read;
+			}
+			return status;
+		}
+
+		fsal::Status ReadDataAt(size_t offset, uint8_t* dst, size_t size, size_t* bytesRead) override
+		{
+			size_t available = offset < m_size ? std::min(size, m_size - offset) : 0;
+			for (size_t i = 0; i < available;)
+			{
+				size_t position = offset + i;
+				size_t n = std::min<size_t>(available - i, kChunkSize - position % kChunkSize);
+				auto it = m_chunks.find(position / kChunkSize);
+				if (it == m_chunks.end())
+				{
+					memset(dst + i, 0, n);
+				}
+				else
+				{
+					memcpy(dst + i, &it->second[position % kChunkSize], n);
+				}
+				i += n;
+			}
+			if (bytesRead != nullptr)
+			{
+				*bytesRead = available;
+			}
+			return available == size ? fsal::Status(true) : fsal::Status(fsal::Status::kEOF);
+		}
+
+		bool ReadsAtOffset() const override { return true; }
+
+		fsal::Status WriteData(const uint8_t* src, size_t size) override
+		{
+			for (size_t i = 0; i < size;)
+			{
+				size_t position = m_position + i;
+				size_t n = std::min<size_t>(size - i, kChunkSize - position % kChunkSize);
+				auto it = m_chunks.find(position / kChunkSize);
+				bool zeros = src[i] == 0 && memcmp(src + i, src + i + 1, n - 1) == 0;
+				if (it == m_chunks.end() && !zeros)
+				{
+					it = m_chunks.emplace(position / kChunkSize, std::string(kChunkSize, '\0')).first;
+				}
+				if (it != m_chunks.end())
+				{
+					memcpy(&it->second[position % kChunkSize], src + i, n);
+				}
+				i += n;
+			}
+			m_position += size;
+			m_size = std::max(m_size, m_position);
+			return true;
+		}
+
+		fsal::Status SetPosition(size_t position) const override
+		{
+			m_position = position;
+			return true;
+		}
+
+		size_t GetPosition() const override { return m_position; }
+
+		size_t GetSize() const override { return m_size; }
+
+		fsal::Status FlushBuffer() const override { return true; }
+
+		uint64_t GetLastWriteTime() const override { return 0; }
+
+		const uint8_t* GetDataPointer() const override { return nullptr; }
+
+		uint8_t* GetDataPointer() override { return nullptr; }
+
+	private:
+		std::map<size_t, std::string> m_chunks;
+		mutable size_t m_position = 0;
+		size_t m_size = 0;
+	};
+}
+
+TEST_CASE("CreateZIP64LargeEntry")
+{
+	// Sizes of the first entry, offset of the second one and offset of the central directory do not fit 32 bits, so
+	// they are written to ZIP64 extra fields and ZIP64 end of central directory
+	const size_t size = ((size_t)4 << 30) + 16;
+	fsal::File source(new SparseFile());
+	source.Seek(size - 16);
+	CHECK(source.Write((const uint8_t*)"end of the entry", 16));
+
+	fsal::File archive(new SparseFile());
+	{
+		fsal::ZipWriter zip(archive);
+		CHECK(zip.AddFile("large.bin", source, fsal::ZIP_COMPRESSION::NONE));
+		std::string text = "after";
+		CHECK(zip.AddFile("after.txt", fsal::File(new fsal::MemRefFile((uint8_t*)&text[0], text.size(), true)), fsal::ZIP_COMPRESSION::NONE));
+	}
+	CHECK(archive.GetSize() > size);
+
+	fsal::ZipReader zip;
+	CHECK(zip.OpenArchive(archive));
+	size_t entrySize = 0;
+	CHECK(zip.GetFileSize("large.bin", entrySize));
+	CHECK(entrySize == size);
+
+	fsal::File large = zip.OpenFile("large.bin");
+	REQUIRE(large);
+	CHECK(large.GetSize() == size);
+	char buffer[16] = {};
+	size_t bytesRead = 0;
+	CHECK(large.ReadAt(size - 16, (uint8_t*)buffer, 16, &bytesRead));
+	CHECK(std::string(buffer, bytesRead) == "end of the entry");
+	CHECK(large.ReadAt(0, (uint8_t*)buffer, 16, &bytesRead));
+	CHECK(std::string(buffer, bytesRead) == std::string(16, '\0'));
+
+	fsal::File after = zip.OpenFile("after.txt");
+	REQUIRE(after);
+	CHECK(std::string(after) == "after");
+}
+
+TEST_CASE("ArchiveIndex")
+{
+	fsal::FileSystem fs;
+	fs.PushSearchPath("../");
+
+	std::string content = "content";
+	auto make = [](std::string& data){ return fsal::File(new fsal::MemRefFile((uint8_t*)&data[0], data.size(), false)); };
+	{
+		auto zipfile = fs.Open("out_archive_indexed.zip", fsal::kWrite);
+		fsal::ZipWriter zip(zipfile);
+		for (int i = 0; i < 300; ++i)
+		{
+			CHECK(zip.AddFile("dir" + std::to_string(i % 7) + "/sub/file" + std::to_string(i) + ".txt", make(content), fsal::ZIP_COMPRESSION::NONE));
+		}
+		CHECK(zip.AddFile("Root.TXT", make(content), fsal::ZIP_COMPRESSION::NONE));
+	}
+
+	auto indexLocation = fsal::Location("out_archive_indexed.idx", fsal::Location::kCurrentDirectory);
+	fs.Remove(indexLocation);
+	fsal::ZipReader parsed;
+	CHECK(parsed.OpenArchive(fs.Open("out_archive_indexed.zip", fsal::kRead, true), fs.Open(indexLocation)));
+	CHECK(!parsed.IsIndexed());
+	CHECK(parsed.SaveIndex(fs.Open(indexLocation, fsal::kWrite)));
+
+	fsal::ZipReader indexed;
+	CHECK(indexed.OpenArchive(fs.Open("out_archive_indexed.zip", fsal::kRead, true), fs.Open(indexLocation, fsal::kRead, false, true)));
+	CHECK(indexed.IsIndexed());
+	for (const char* dir: {"", "dir3", "dir3/sub", "missing"})
+	{
+		auto a = parsed.ListDirectory(dir);
+		auto b = indexed.ListDirectory(dir);
+		CHECK(a == b);
+	}
+	CHECK(indexed.ListDirectory("dir3/sub").size() == 43);
+	CHECK(indexed.Exists("Root.TXT"));
+	CHECK(indexed.Exists("root.txt") == parsed.Exists("root.txt"));
+	CHECK(!parsed.Exists("root.txx"));
+	CHECK(!indexed.Exists("root.txx"));
+	CHECK(!indexed.Exists("dir0/sub/file1.txx"));
+	CHECK(indexed.Exists("dir0/sub", fsal::kDirectory) == parsed.Exists("dir0/sub", fsal::kDirectory));
+	CHECK(!indexed.Exists("dir0/sub/file1.txt"));
+	CHECK(std::string(indexed.OpenFile("dir5/sub/file299.txt")) == content);
+	CHECK(indexed.VerifyArchive());
+
+	// Index of another archive is not used
+	fsal::ZipReader other;
+	CHECK(other.OpenArchive(fs.Open("out_archive_append.zip", fsal::kRead, true), fs.Open(indexLocation, fsal::kRead, false, true)));
+	CHECK(!other.IsIndexed());
+	CHECK(std::string(other.OpenFile("b.txt")).size() != 0);
+
+	// Index with entries, that are out of range, used twice or out of order, is not used
+	std::string savedIndex = fs.Open(indexLocation);
+	fsal::FileListIndexHeader indexHeader;
+	memcpy(&indexHeader, &savedIndex[0], sizeof(indexHeader));
+	typedef fsal::FileListIndexEntry<fsal::ZipEntryData> IndexEntry;
+	size_t depthsSize = indexHeader.depthTableSize * sizeof(int32_t);
+	size_t entriesOffset = sizeof(indexHeader) + depthsSize + (8 - depthsSize % 8) % 8;
+	size_t count = (size_t)indexHeader.entryCount;
+	auto indexOf = [entriesOffset](size_t i)
+	{
+		return entriesOffset + i * sizeof(IndexEntry) + offsetof(IndexEntry, data) + offsetof(fsal::ZipEntryData, index);
+	};
+	std::vector<std::string> corrupted(3, savedIndex);
+	uint32_t outOfRange = (uint32_t)count + 5;
+	memcpy(&corrupted[0][indexOf(count - 1)], &outOfRange, sizeof(uint32_t));
+	memcpy(&corrupted[1][indexOf(count - 1)], &savedIndex[indexOf(count - 2)], sizeof(uint32_t));
+	std::string last = savedIndex.substr(entriesOffset + (count - 1) * sizeof(IndexEntry), sizeof(IndexEntry));
+	corrupted[2].replace(entriesOffset + (count - 1) * sizeof(IndexEntry), sizeof(IndexEntry), savedIndex, entriesOffset + (count - 2) * sizeof(IndexEntry), sizeof(IndexEntry));
+	corrupted[2].replace(entriesOffset + (count - 2) * sizeof(IndexEntry), sizeof(IndexEntry), last);
+	auto corruptedLocation = fsal::Location("out_archive_indexed_corrupted.idx", fsal::Location::kCurrentDirectory);
+	for (auto& data: corrupted)
+	{
+		CHECK(data != savedIndex);
+		fs.Open(corruptedLocation, fsal::kWrite) = data;
+		fsal::ZipReader reader;
+		CHECK(reader.OpenArchive(fs.Open("out_archive_indexed.zip", fsal::kRead, true), fs.Open(corruptedLocation)));
+		CHECK(!reader.IsIndexed());
+		CHECK(std::string(reader.OpenFile("dir5/sub/file299.txt")) == content);
+	}
+	fs.Remove(corruptedLocation);
+
+	// Minimal VPK directory file: one entry with preload bytes only, and one in the directory file itself
+	std::string tree;
+	auto addEntry = [&tree](const char* name, const std::string& preload, uint32_t offset, uint32_t length)
+	{
+		tree += std::string(name) + '\0';
+		fsal::VPKDirectoryEntry entry;
+		entry.CRC = 0;
+		entry.PreloadBytes = (uint16_t)preload.size();
+		entry.ArchiveIndex = 0x7fff;
+		entry.EntryOffset = offset;
+		entry.EntryLength = length;
+		tree.append((const char*)&entry, sizeof(entry));
+		tree += preload;
+	};
+	tree += std::string("txt") + '\0' + "folder" + '\0';
+	addEntry("a", "preloaded", 0, 0);
+	addEntry("b", "", 0, 0);
+	tree += std::string("\0\0\0", 3);
+
+	std::string vpk(12, '\0');
+	uint32_t header[3] = {fsal::VPK_SIGNATURES::HEADER, 1, (uint32_t)tree.size()};
+	memcpy(&vpk[0], header, sizeof(header));
+	vpk += tree;
+	size_t dataOffset = vpk.size();
+	vpk += "in directory";
+	vpk += std::string(64, '\0');
+	memcpy(&vpk[12 + tree.size() - 3 - sizeof(fsal::VPKDirectoryEntry) + 8], &dataOffset, 4);
+	uint32_t length = 12;
+	memcpy(&vpk[12 + tree.size() - 3 - sizeof(fsal::VPKDirectoryEntry) + 12], &length, 4);
+	auto vpkDirectory = fsal::Location("vpk_index", fsal::Location::kCurrentDirectory);
+	fs.CreateDirectory(vpkDirectory);
+	fs.Open(fsal::Location("vpk_index/test_dir.vpk", fsal::Location::kCurrentDirectory), fsal::kWrite) = vpk;
+
+	auto vpkIndexLocation = fsal::Location("vpk_index/test.idx", fsal::Location::kCurrentDirectory);
+	fs.Remove(vpkIndexLocation);
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		fsal::VPKReader vpkReader;
+		CHECK(vpkReader.OpenArchive(fs, vpkDirectory, "test_%s.vpk", fs.Open(vpkIndexLocation, fsal::kRead, false, true)));
+		CHECK(vpkReader.IsIndexed() == (pass == 1));
+		CHECK(std::string(vpkReader.OpenFile("folder/a.txt")) == "preloaded");
+		CHECK(std::string(vpkReader.OpenFile("folder/b.txt")) == "in directory");
+		if (pass == 0)
+		{
+			CHECK(vpkReader.SaveIndex(fs.Open(vpkIndexLocation, fsal::kWrite)));
+		}
+	}
+}
+
 TEST_CASE("MountVpk" * doctest::skip())
 {
 	printf("\nVPK\n");